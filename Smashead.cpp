@@ -3,373 +3,4410 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
+#include <deque>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <queue>
+#include <functional>
+#include <tuple>
 #include <algorithm>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 #include <chrono>
 #include <limits>
 #include <cctype>
-#include <windows.h>
-#include <conio.h> 
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <iomanip>
+#include <random>
+#include <filesystem>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 // --- CONFIGURACION FIJA ---
+#ifdef _WIN32
 const std::string PUERTO_SERIAL_DEFAULT = "COM8"; 
+#else
+const std::string PUERTO_SERIAL_DEFAULT = "/dev/ttyACM0"; // Tambien acepta un pseudo-terminal (/dev/pts/N)
+#endif
 #define BAUDRATE 9600
 #define MAX_BUFFER_SIZE 256
 // --------------------------
 
-// Variables globales serial
-HANDLE hSerial;
-std::mutex serialMutex;
-std::queue<std::string> colaMensajesRecibidos;
-bool hiloLecturaActivo = true;
+// --- METRICAS ---
+// Tiempos por etapa del ciclo de surtido y contadores, con reloj monotono y atomicos sin
+// candados: medir cuesta dos lecturas de reloj y unos fetch_add. Compilando con
+// -DPTL_SIN_METRICAS las macros quedan vacias y no se genera nada.
+#ifndef PTL_SIN_METRICAS
+enum EtapaPTL {
+    ETAPA_BUSQUEDA_SKU,     // buscarGruposSKU / buscarGrupo
+    ETAPA_ENCENDIDO,        // De tener el grupo a encolar el ENCENDER de todos sus destinos
+    ETAPA_ESCRITURA_SERIAL, // Escritura al puerto en el hilo escritor
+    ETAPA_COLA_EVENTOS,     // Boton recibido del Arduino hasta que la estacion lo atiende
+    ETAPA_CONFIRMACION,     // Dialogo de confirmacion abierto (incluye al operador)
+    ETAPA_BACKORDER,        // Formatear y encolar un registro de backorder
+    ETAPA_DIARIO,           // Escritura de un grupo del diario (fwrite + flush/fsync)
+    NUM_ETAPAS
+};
+const char* const NOMBRES_ETAPA[NUM_ETAPAS] = {
+    "busqueda_sku", "encendido", "escritura_serial", "cola_eventos", "confirmacion", "backorder", "diario"
+};
+
+enum ContadorPTL {
+    CONTADOR_ESCANEOS, CONTADOR_PICKS, CONTADOR_FALTANTES, CONTADOR_CAMBIOS_LOTE,
+    CONTADOR_BYTES_TX, CONTADOR_BYTES_RX, CONTADOR_RETRANSMISIONES, CONTADOR_ESCANEOS_COMBINADOS,
+    CONTADOR_LINEAS_CARGADAS, CONTADOR_COMPLEMENTOS_ESCANEADOS, NUM_CONTADORES
+};
+const char* const NOMBRES_CONTADOR[NUM_CONTADORES] = {
+    "escaneos", "picks", "faltantes", "cambios_lote", "serial_bytes_tx", "serial_bytes_rx", "retransmisiones",
+    "escaneos_combinados", "lineas_cargadas", "complementos_escaneados"
+};
+
+// Histograma log-lineal al estilo HDR, en microsegundos: exacto hasta 8 us y luego 8
+// cubetas por potencia de 2 (error relativo < 12.5%) hasta mas de una hora.
+class HistogramaLatencia {
+    static const int SUB = 8;
+    static const int CUBETAS = SUB * 34;
+    std::atomic<uint64_t> cubetas[CUBETAS] = {};
+    std::atomic<uint64_t> total{0}, sumaUs{0}, maximoUs{0};
+
+    static int cubeta(uint64_t us) {
+        if (us < SUB) return (int)us;
+        int potencia = 3;
+        while ((us >> (potencia + 1)) != 0 && potencia < 35) ++potencia;
+        return std::min(CUBETAS - 1, (potencia - 2) * SUB + (int)((us >> (potencia - 3)) & (SUB - 1)));
+    }
+    static uint64_t limiteSuperior(int i) {
+        if (i < SUB) return (uint64_t)i;
+        int potencia = i / SUB + 2;
+        return ((uint64_t)(SUB + i % SUB + 1) << (potencia - 3)) - 1;
+    }
+
+public:
+    void registrar(uint64_t us) {
+        cubetas[cubeta(us)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sumaUs.fetch_add(us, std::memory_order_relaxed);
+        uint64_t previo = maximoUs.load(std::memory_order_relaxed);
+        while (us > previo && !maximoUs.compare_exchange_weak(previo, us, std::memory_order_relaxed)) {}
+    }
+    uint64_t cuenta() const { return total.load(std::memory_order_relaxed); }
+    uint64_t suma() const { return sumaUs.load(std::memory_order_relaxed); }
+    uint64_t maximo() const { return maximoUs.load(std::memory_order_relaxed); }
+    // Cota superior de la cubeta donde cae el percentil p (0-100)
+    uint64_t percentil(double p) const {
+        uint64_t n = cuenta();
+        if (n == 0) return 0;
+        uint64_t objetivo = std::max<uint64_t>(1, (uint64_t)(p / 100.0 * n + 0.5)), acumulado = 0;
+        for (int i = 0; i < CUBETAS; ++i) {
+            acumulado += cubetas[i].load(std::memory_order_relaxed);
+            if (acumulado >= objetivo) return std::min(limiteSuperior(i), maximo());
+        }
+        return maximo();
+    }
+};
+
+struct MetricasPTL {
+    HistogramaLatencia etapas[NUM_ETAPAS];
+    std::atomic<uint64_t> contadores[NUM_CONTADORES] = {};
+    std::unique_ptr<std::atomic<uint64_t>[]> picksPorEstacion; // Por id - 1; iniciarMetricas le da una por estacion
+    std::chrono::steady_clock::time_point inicio = std::chrono::steady_clock::now();
+};
+MetricasPTL metricas;
+
+#define MICROS_DESDE(t) (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - (t)).count()
+
+// Mide el tiempo de vida del objeto y lo registra en la etapa al destruirse.
+class MedicionEtapa {
+    EtapaPTL etapa;
+    std::chrono::steady_clock::time_point inicio;
+
+public:
+    explicit MedicionEtapa(EtapaPTL e) : etapa(e), inicio(std::chrono::steady_clock::now()) {}
+    ~MedicionEtapa() { metricas.etapas[etapa].registrar(MICROS_DESDE(inicio)); }
+};
+
+#define PTL_CONCATENAR2(a, b) a##b
+#define PTL_CONCATENAR(a, b) PTL_CONCATENAR2(a, b)
+#define MEDIR_ETAPA(etapa) MedicionEtapa PTL_CONCATENAR(medicion_, __LINE__)(etapa)
+#define REGISTRAR_ETAPA(etapa, us) metricas.etapas[etapa].registrar(us)
+#define INICIAR_MEDICION(t) const auto t = std::chrono::steady_clock::now()
+#define TERMINAR_MEDICION(t, etapa) REGISTRAR_ETAPA(etapa, MICROS_DESDE(t))
+#define CONTAR(contador, n) metricas.contadores[contador].fetch_add((n), std::memory_order_relaxed)
+#define CONTAR_PICK(idEstacion) \
+    metricas.picksPorEstacion[(idEstacion) - 1].fetch_add(1, std::memory_order_relaxed)
+#else
+#define MEDIR_ETAPA(etapa) ((void)0)
+#define REGISTRAR_ETAPA(etapa, us) ((void)0)
+#define INICIAR_MEDICION(t) ((void)0)
+#define TERMINAR_MEDICION(t, etapa) ((void)0)
+#define CONTAR(contador, n) ((void)0)
+#define CONTAR_PICK(idEstacion) ((void)0)
+#endif
+
+// --- TRANSPORTE SERIAL ---
+// Interfaz comun para el puerto del Arduino. leer() se bloquea en el sistema operativo
+// hasta que llegan bytes (sin sondeo), y despertar() interrumpe a un lector bloqueado.
+class TransporteSerial {
+public:
+    virtual ~TransporteSerial() = default;
+    virtual bool abrir(const std::string& puerto, int baudios) = 0;
+    virtual bool configurarBaudios(int baudios) = 0;
+    // Devuelve bytes leidos, 0 si vencio timeoutMs (-1 = sin limite) o si se llamo a despertar(), -1 si fallo.
+    virtual int leer(char* buffer, int capacidad, int timeoutMs) = 0;
+    virtual bool escribir(const char* datos, size_t longitud) = 0;
+    virtual void despertar() = 0;
+    virtual void cerrar() = 0;
+};
+
+#ifdef _WIN32
+// Backend Win32: E/S traslapada. WaitCommEvent(EV_RXCHAR) avisa en cuanto llega un byte,
+// y lectura y escritura no se serializan entre si como ocurre con un handle sincrono.
+class TransporteWin32 : public TransporteSerial {
+    HANDLE hSerial = INVALID_HANDLE_VALUE;
+    HANDLE eventoCom = NULL, eventoLectura = NULL, eventoEscritura = NULL, eventoParo = NULL;
+    std::mutex escrituraMutex;
+
+public:
+    ~TransporteWin32() override { cerrar(); }
+
+    bool abrir(const std::string& puerto, int baudios) override {
+        // COM10 en adelante solo abre con el prefijo de dispositivo
+        std::string ruta = (puerto.rfind("COM", 0) == 0) ? "\\\\.\\" + puerto : puerto;
+        hSerial = CreateFileA(ruta.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
+        if (hSerial == INVALID_HANDLE_VALUE) return false;
+        configurarBaudios(baudios);
+        // ReadFile devuelve de inmediato lo que haya en el buffer; la espera la hace WaitCommEvent
+        COMMTIMEOUTS timeouts = {0};
+        timeouts.ReadIntervalTimeout = MAXDWORD;
+        timeouts.WriteTotalTimeoutConstant = 50; timeouts.WriteTotalTimeoutMultiplier = 10;
+        SetCommTimeouts(hSerial, &timeouts);
+        SetCommMask(hSerial, EV_RXCHAR);
+        eventoCom = CreateEvent(NULL, TRUE, FALSE, NULL);
+        eventoLectura = CreateEvent(NULL, TRUE, FALSE, NULL);
+        eventoEscritura = CreateEvent(NULL, TRUE, FALSE, NULL);
+        eventoParo = CreateEvent(NULL, FALSE, FALSE, NULL);
+        return true;
+    }
+
+    bool configurarBaudios(int baudios) override {
+        DCB dcb = {0}; dcb.DCBlength = sizeof(dcb); GetCommState(hSerial, &dcb);
+        dcb.BaudRate = baudios; dcb.ByteSize = 8; dcb.StopBits = ONESTOPBIT; dcb.Parity = NOPARITY;
+        return SetCommState(hSerial, &dcb) != 0;
+    }
+
+    int leer(char* buffer, int capacidad, int timeoutMs) override {
+        DWORD errores = 0; COMSTAT estado = {0};
+        if (!ClearCommError(hSerial, &errores, &estado)) return -1;
+        if (estado.cbInQue == 0) {
+            DWORD mascara = 0, n = 0;
+            OVERLAPPED ov = {0}; ov.hEvent = eventoCom;
+            if (!WaitCommEvent(hSerial, &mascara, &ov)) {
+                if (GetLastError() != ERROR_IO_PENDING) return -1;
+                HANDLE eventos[2] = { eventoCom, eventoParo };
+                DWORD r = WaitForMultipleObjects(2, eventos, FALSE, timeoutMs < 0 ? INFINITE : (DWORD)timeoutMs);
+                if (r != WAIT_OBJECT_0) {
+                    CancelIo(hSerial);
+                    GetOverlappedResult(hSerial, &ov, &n, TRUE);
+                    return (r == WAIT_TIMEOUT || r == WAIT_OBJECT_0 + 1) ? 0 : -1;
+                }
+            }
+            if (!ClearCommError(hSerial, &errores, &estado)) return -1;
+            if (estado.cbInQue == 0) return 0;
+        }
+        DWORD aLeer = std::min<DWORD>(capacidad, estado.cbInQue), leidos = 0;
+        OVERLAPPED ov = {0}; ov.hEvent = eventoLectura;
+        if (!ReadFile(hSerial, buffer, aLeer, &leidos, &ov)) {
+            if (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(hSerial, &ov, &leidos, TRUE)) return -1;
+        }
+        return (int)leidos;
+    }
+
+    bool escribir(const char* datos, size_t longitud) override {
+        std::lock_guard<std::mutex> lock(escrituraMutex);
+        DWORD escritos = 0;
+        OVERLAPPED ov = {0}; ov.hEvent = eventoEscritura;
+        if (!WriteFile(hSerial, datos, (DWORD)longitud, &escritos, &ov)) {
+            if (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(hSerial, &ov, &escritos, TRUE)) return false;
+        }
+        return escritos == longitud;
+    }
+
+    void despertar() override { if (eventoParo) SetEvent(eventoParo); }
+
+    void cerrar() override {
+        if (hSerial != INVALID_HANDLE_VALUE) { CloseHandle(hSerial); hSerial = INVALID_HANDLE_VALUE; }
+        for (HANDLE* e : { &eventoCom, &eventoLectura, &eventoEscritura, &eventoParo }) {
+            if (*e) { CloseHandle(*e); *e = NULL; }
+        }
+    }
+};
+#else
+// Backend POSIX: termios en modo crudo + epoll. Un eventfd registrado en el mismo epoll
+// sirve para despertar al lector al cerrar. Funciona igual contra un pseudo-terminal.
+class TransportePosix : public TransporteSerial {
+    int fd = -1, epfd = -1, efd = -1;
+    std::mutex escrituraMutex;
+
+    static speed_t velocidad(int baudios) {
+        switch (baudios) {
+            case 19200: return B19200;
+            case 38400: return B38400;
+            case 57600: return B57600;
+            case 115200: return B115200;
+            case 230400: return B230400;
+            default: return B9600;
+        }
+    }
+
+public:
+    ~TransportePosix() override { cerrar(); }
+
+    bool abrir(const std::string& puerto, int baudios) override {
+        fd = open(puerto.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) return false;
+        termios tty;
+        if (tcgetattr(fd, &tty) == 0) {
+            cfmakeraw(&tty);
+            tty.c_cflag |= CLOCAL | CREAD;
+            tty.c_cc[VMIN] = 1; tty.c_cc[VTIME] = 0;
+            tcsetattr(fd, TCSANOW, &tty);
+        }
+        configurarBaudios(baudios);
+        efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (efd < 0 || epfd < 0) { cerrar(); return false; }
+        epoll_event ev = {};
+        ev.events = EPOLLIN; ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        ev.events = EPOLLIN; ev.data.fd = efd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev);
+        return true;
+    }
+
+    bool configurarBaudios(int baudios) override {
+        termios tty;
+        if (tcgetattr(fd, &tty) != 0) return true; // No es una terminal (p. ej. una tuberia): no aplica
+        cfsetispeed(&tty, velocidad(baudios)); cfsetospeed(&tty, velocidad(baudios));
+        return tcsetattr(fd, TCSADRAIN, &tty) == 0;
+    }
+
+    int leer(char* buffer, int capacidad, int timeoutMs) override {
+        while (true) {
+            ssize_t n = read(fd, buffer, capacidad);
+            if (n > 0) return (int)n;
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+            epoll_event eventos[2];
+            int listos = epoll_wait(epfd, eventos, 2, timeoutMs);
+            if (listos < 0 && errno == EINTR) continue;
+            if (listos <= 0) return (listos == 0) ? 0 : -1;
+            for (int i = 0; i < listos; ++i) {
+                if (eventos[i].data.fd == efd) {
+                    uint64_t valor; (void)!read(efd, &valor, sizeof(valor));
+                    return 0;
+                }
+                // Puerto desconectado (o el otro extremo del PTY se cerro)
+                if ((eventos[i].events & (EPOLLHUP | EPOLLERR)) && !(eventos[i].events & EPOLLIN)) return -1;
+            }
+        }
+    }
+
+    bool escribir(const char* datos, size_t longitud) override {
+        std::lock_guard<std::mutex> lock(escrituraMutex);
+        while (longitud > 0) {
+            ssize_t n = write(fd, datos, longitud);
+            if (n > 0) { datos += n; longitud -= n; continue; }
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+            pollfd p = { fd, POLLOUT, 0 };
+            if (poll(&p, 1, 100) <= 0) return false;
+        }
+        return true;
+    }
+
+    void despertar() override {
+        if (efd >= 0) { uint64_t uno = 1; (void)!write(efd, &uno, sizeof(uno)); }
+    }
+
+    void cerrar() override {
+        for (int* d : { &epfd, &efd, &fd }) {
+            if (*d >= 0) { close(*d); *d = -1; }
+        }
+    }
+};
+#endif
+
+std::unique_ptr<TransporteSerial> crearTransporte() {
+#ifdef _WIN32
+    return std::make_unique<TransporteWin32>();
+#else
+    return std::make_unique<TransportePosix>();
+#endif
+}
+
+// --- PROTOCOLO BINARIO (debe coincidir con Smashead.ino) ---
+// Trama: [0xA5][VERSION][SEQ][OPCODE][LEN][DATOS x LEN][CRC16 alto][CRC16 bajo]
+// El CRC-16/CCITT (0x1021, inicial 0xFFFF) cubre desde VERSION hasta el ultimo dato.
+// Un ENCENDER/ACTUALIZAR lleva N pares [id u16][cantidad u16] y un APAGAR N ids [u16],
+// todo en little endian, asi una ola de 40 destinos cabe en una sola trama.
+// Desde la version 2 los eventos del Arduino (boton/+/-) tambien se confirman: el host
+// contesta OP_ACK con la secuencia del evento y el firmware lo reenvia si no llega.
+#define TRAMA_INICIO 0xA5
+#define PROTOCOLO_VERSION 2
+#define TRAMA_CABECERA 5
+#define TRAMA_MAX_DATOS 240
+#define BAUDRATE_BINARIO 115200
+#define RETRANSMISION_MS 250
+#define MAX_REINTENTOS 4
+#define VENTANA_SECUENCIAS 32
+#define VENTANA_TRAMAS 8      // Tramas de comandos sin ACK a la vez; menos que VENTANA_SECUENCIAS
+
+enum OpcodePTL : uint8_t {
+    OP_HOLA = 0x01, OP_BAUDIOS = 0x02,
+    OP_ENCENDER = 0x10, OP_ACTUALIZAR = 0x11, OP_APAGAR = 0x12, OP_APAGAR_TODO = 0x13,
+    OP_BOTON = 0x20, OP_MAS = 0x21, OP_MENOS = 0x22,
+    OP_MAPA = 0x30, OP_BARRIDO = 0x31,
+    OP_ACK = 0x7E, OP_NACK = 0x7F
+};
+
+struct ComandoPTL {
+    OpcodePTL opcode;
+    int destino;
+    int cantidad;
+};
+
+// --- COLA DE SALIDA ---
+struct NodoComando {
+    std::atomic<NodoComando*> siguiente{nullptr};
+    ComandoPTL comando;
+};
+
+// Cola MPSC sin bloqueo (Vyukov): encolar es un solo exchange atomico, asi que el hilo
+// de la interfaz nunca espera al puerto. Solo el hilo escritor llama a sacar() y vacia().
+class ColaComandos {
+    NodoComando stub;
+    std::atomic<NodoComando*> cabeza;
+    NodoComando* cola;
+
+public:
+    ColaComandos() : cabeza(&stub), cola(&stub) {}
+    ColaComandos(const ColaComandos&) = delete;
+    ColaComandos& operator=(const ColaComandos&) = delete;
+    ~ColaComandos() { while (NodoComando* n = sacar()) delete n; }
+
+    void encolar(NodoComando* nodo) {
+        nodo->siguiente.store(nullptr, std::memory_order_relaxed);
+        NodoComando* anterior = cabeza.exchange(nodo);
+        anterior->siguiente.store(nodo, std::memory_order_release);
+    }
+
+    // Devuelve nullptr si esta vacia o si un productor aun no termina de enlazar su nodo.
+    NodoComando* sacar() {
+        NodoComando* t = cola;
+        NodoComando* sig = t->siguiente.load(std::memory_order_acquire);
+        if (t == &stub) {
+            if (!sig) return nullptr;
+            cola = sig; t = sig;
+            sig = sig->siguiente.load(std::memory_order_acquire);
+        }
+        if (sig) { cola = sig; return t; }
+        if (t != cabeza.load()) return nullptr;
+        encolar(&stub);
+        sig = t->siguiente.load(std::memory_order_acquire);
+        if (sig) { cola = sig; return t; }
+        return nullptr;
+    }
+
+    bool vacia() const { return cola == &stub && cabeza.load() == &stub; }
+};
+
+struct TramaPendiente {
+    std::string bytes;
+    std::chrono::steady_clock::time_point enviada;
+    int intentos;
+    bool reintentar;
+    std::vector<int> destinos;   // Los que toca la trama (comandos); vacio en HOLA, MAPA...
+    bool todos = false;          // APAGAR_TODO
+};
+
+// Estado del enlace con un Arduino: transporte, modo de protocolo y tramas sin ACK.
+struct EnlacePTL {
+    std::string puerto;
+    std::unique_ptr<TransporteSerial> transporte;
+    std::atomic<bool> binario{false};
+    std::mutex mutex;                          // Protege secuencia, pendientes y respuesta HOLA
+    std::condition_variable cvRespuesta;       // Se notifica al llegar un ACK/NACK/HOLA
+    uint8_t siguienteSecuencia = 0;
+    std::map<uint8_t, TramaPendiente> pendientes;
+    int ultimaRespuesta = -1;                  // SEQ del ultimo ACK/HOLA recibido
+    int ultimoRechazo = -1;                    // SEQ del ultimo NACK de una trama sin reintento
+    int ultimoEvento = -1;                     // Eventos ya despachados (solo el lector):
+    uint32_t eventosVistos = 0;                // bit k = se recibio ultimoEvento - k
+    int versionFirmware = 0;
+    int modulosFirmware = 0;
+    std::string archivoMapa;                   // --mapa: mapa de modulos para la EEPROM del Arduino
+    int barridoUltimoMs = 0, barridoMaximoMs = 0, lecturasPorVuelta = 0, modulosEncendidos = 0;
+
+    // Hilo escritor: la interfaz solo encola; el escritor coalesce, prioriza y escribe
+    ColaComandos salida;
+    std::atomic<bool> escritorEsperando{false};
+    std::atomic<bool> escritorActivo{true};
+    std::mutex escritorMutex;
+    std::condition_variable cvEscritor;
+    std::atomic<uint64_t> comandosEncolados{0};
+    std::atomic<uint64_t> comandosCoalescidos{0};
+    std::atomic<uint64_t> comandosEnviados{0};
+    std::atomic<uint32_t> tramasResueltas{0};  // Sube con cada trama que sale de 'pendientes' (ACK o agotada)
+
+    std::thread lector, escritor;
+    std::atomic<bool> lecturaActiva{true};
+};
+
+uint16_t crc16(const uint8_t* datos, size_t n) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < n; ++i) {
+        crc ^= (uint16_t)datos[i] << 8;
+        for (int b = 0; b < 8; ++b) crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+std::string construirTrama(uint8_t seq, uint8_t opcode, const std::string& datos) {
+    std::string trama;
+    trama.reserve(TRAMA_CABECERA + datos.size() + 2);
+    trama += (char)TRAMA_INICIO; trama += (char)PROTOCOLO_VERSION;
+    trama += (char)seq; trama += (char)opcode; trama += (char)datos.size();
+    trama += datos;
+    uint16_t crc = crc16((const uint8_t*)trama.data() + 1, trama.size() - 1);
+    trama += (char)(crc >> 8); trama += (char)(crc & 0xFF);
+    return trama;
+}
+
+void agregarU16(std::string& datos, int valor) {
+    datos += (char)(valor & 0xFF); datos += (char)((valor >> 8) & 0xFF);
+}
+
+int leerU16(const std::string& datos, size_t pos) {
+    return (uint8_t)datos[pos] | ((uint8_t)datos[pos + 1] << 8);
+}
+
+// Arma una trama y la deja pendiente de ACK; agrega sus bytes a 'salida' sin escribirlos.
+// Devuelve true si no habia otras pendientes (el lector puede estar dormido sin limite).
+bool registrarTrama(EnlacePTL& enlace, uint8_t opcode, const std::string& datos, bool reintentar,
+                    std::string& salida, uint8_t& seq, std::vector<int> destinos = {}) {
+    std::lock_guard<std::mutex> lock(enlace.mutex);
+    seq = enlace.siguienteSecuencia++;
+    std::string trama = construirTrama(seq, opcode, datos);
+    bool eraPrimera = enlace.pendientes.empty();
+    enlace.pendientes[seq] = { trama, std::chrono::steady_clock::now(), 1, reintentar, std::move(destinos), opcode == OP_APAGAR_TODO };
+    salida += trama;
+    return eraPrimera;
+}
+
+// El escritor pudo quedarse esperando comandos nuevos o el ACK que libera a un destino retenido.
+void despertarEscritor(EnlacePTL& enlace) {
+    if (enlace.escritorEsperando.load()) {
+        std::lock_guard<std::mutex> lock(enlace.escritorMutex);
+        enlace.cvEscritor.notify_one();
+    }
+}
+
+// Envia una trama y, si reintentar, la deja pendiente hasta que llegue su ACK.
+uint8_t enviarTrama(EnlacePTL& enlace, uint8_t opcode, const std::string& datos, bool reintentar) {
+    std::string trama;
+    uint8_t seq;
+    bool despertarLector = registrarTrama(enlace, opcode, datos, reintentar, trama, seq);
+    enlace.transporte->escribir(trama.data(), trama.size());
+    CONTAR(CONTADOR_BYTES_TX, trama.size());
+    // El lector pudo quedarse bloqueado sin limite; lo despertamos para que vigile la retransmision
+    if (despertarLector) enlace.transporte->despertar();
+    return seq;
+}
+
+// Espera el ACK (o la respuesta HOLA) de una trama; false si no llego a tiempo.
+bool esperarConfirmacion(EnlacePTL& enlace, uint8_t seq, int timeoutMs) {
+    std::unique_lock<std::mutex> lock(enlace.mutex);
+    enlace.cvRespuesta.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                                [&] { return enlace.ultimaRespuesta == seq || enlace.ultimoRechazo == seq; });
+    bool confirmada = (enlace.ultimaRespuesta == seq);
+    enlace.pendientes.erase(seq);
+    return confirmada;
+}
+
+std::string comandoATexto(const ComandoPTL& c) {
+    switch (c.opcode) {
+        case OP_ENCENDER:   return "ENCENDER_" + std::to_string(c.destino) + "_" + std::to_string(c.cantidad);
+        case OP_ACTUALIZAR: return "ACTUALIZAR_" + std::to_string(c.destino) + "_" + std::to_string(c.cantidad);
+        case OP_APAGAR:     return "APAGAR_DESTINO_" + std::to_string(c.destino);
+        default:            return "APAGAR_TODO";
+    }
+}
+
+// Saca de 'porDestino' lo que puede salir ya, agrupado en tramas multi-destino (modo binario)
+// o en lineas de texto, por prioridad: APAGAR_TODO, APAGAR (confirmaciones), ENCENDER y al
+// final ACTUALIZAR; todo en una escritura. En binario cada trama queda pendiente de ACK sin
+// frenar a las demas (hasta VENTANA_TRAMAS a la vez): solo se retiene el comando de un destino
+// que ya tiene una trama sin ACK, asi su retransmision nunca llega despues de una orden mas
+// nueva. Lo retenido se queda en 'porDestino', donde lo que se encole despues lo reemplaza.
+// APAGAR_TODO espera a que no haya tramas pendientes y todo lo demas espera su ACK.
+void enviarLote(EnlacePTL& enlace, std::map<int, ComandoPTL>& porDestino, bool& apagarTodo) {
+    if (!enlace.transporte) { porDestino.clear(); apagarTodo = false; return; }
+    MEDIR_ETAPA(ETAPA_ESCRITURA_SERIAL);
+    static const OpcodePTL prioridad[] = { OP_APAGAR, OP_ENCENDER, OP_ACTUALIZAR };
+    if (!enlace.binario) {
+        std::string texto;
+        if (apagarTodo) texto += comandoATexto({OP_APAGAR_TODO, 0, 0}) + "\n";
+        for (OpcodePTL op : prioridad) {
+            for (const auto& par : porDestino) if (par.second.opcode == op) texto += comandoATexto(par.second) + "\n";
+        }
+        enlace.transporte->escribir(texto.data(), texto.size());
+        CONTAR(CONTADOR_BYTES_TX, texto.size());
+        enlace.comandosEnviados += porDestino.size() + (apagarTodo ? 1 : 0);
+        porDestino.clear();
+        apagarTodo = false;
+        return;
+    }
+
+    std::set<int> ocupados;
+    size_t enVuelo = 0;                                  // Solo tramas de comandos: HOLA o MAPA no cuentan
+    {
+        std::lock_guard<std::mutex> lock(enlace.mutex);
+        for (const auto& par : enlace.pendientes) {
+            const TramaPendiente& t = par.second;
+            if (t.todos) return;
+            if (t.destinos.empty()) continue;
+            ocupados.insert(t.destinos.begin(), t.destinos.end());
+            enVuelo++;
+        }
+    }
+    std::string salida;
+    uint8_t seq;
+    bool despertarLector = false;
+    if (apagarTodo) {
+        if (enVuelo > 0) return;
+        despertarLector = registrarTrama(enlace, OP_APAGAR_TODO, "", true, salida, seq);
+        enlace.comandosEnviados++;
+        apagarTodo = false;
+    } else {
+        for (OpcodePTL op : prioridad) {
+            size_t porElemento = op == OP_APAGAR ? 2 : 4;
+            auto it = porDestino.begin();
+            while (it != porDestino.end() && enVuelo < VENTANA_TRAMAS) {
+                std::string datos;
+                std::vector<int> destinos;
+                for (; it != porDestino.end() && datos.size() + porElemento <= TRAMA_MAX_DATOS;) {
+                    const ComandoPTL& c = it->second;
+                    if (c.opcode != op || ocupados.count(c.destino)) { ++it; continue; }
+                    agregarU16(datos, c.destino);
+                    if (porElemento == 4) agregarU16(datos, c.cantidad);
+                    destinos.push_back(c.destino);
+                    it = porDestino.erase(it);
+                }
+                if (destinos.empty()) break;
+                enlace.comandosEnviados += destinos.size();
+                despertarLector |= registrarTrama(enlace, op, datos, true, salida, seq, std::move(destinos));
+                enVuelo++;
+            }
+        }
+    }
+    if (salida.empty()) return;
+    enlace.transporte->escribir(salida.data(), salida.size());
+    CONTAR(CONTADOR_BYTES_TX, salida.size());
+    // El lector pudo quedarse bloqueado sin limite; lo despertamos para que vigile la retransmision
+    if (despertarLector) enlace.transporte->despertar();
+}
+
+// Encola sin bloquear; el hilo escritor se encarga del puerto.
+void encolarComandos(EnlacePTL& enlace, const std::vector<ComandoPTL>& comandos) {
+    for (const ComandoPTL& c : comandos) {
+        NodoComando* nodo = new NodoComando();
+        nodo->comando = c;
+        enlace.salida.encolar(nodo);
+    }
+    enlace.comandosEncolados += comandos.size();
+    despertarEscritor(enlace);
+}
+
+// Cada comando fija el estado final de su destino, asi que basta conservar el ultimo por
+// destino (solo el ACTUALIZAR mas reciente sale al puerto). Lo que enviarLote retiene espera
+// aqui al ACK de su destino y se sigue coalesciendo; al detenerse se vacia antes de salir.
+void hiloEscrituraSerial(EnlacePTL& enlace) {
+    std::map<int, ComandoPTL> ultimoPorDestino;
+    bool apagarTodo = false;
+    uint32_t resueltasVistas = enlace.tramasResueltas;
+    while (true) {
+        size_t sacados = 0;
+        while (NodoComando* nodo = enlace.salida.sacar()) {
+            const ComandoPTL c = nodo->comando;
+            delete nodo;
+            ++sacados;
+            if (c.opcode == OP_APAGAR_TODO) {
+                enlace.comandosCoalescidos += ultimoPorDestino.size();
+                ultimoPorDestino.clear();
+                apagarTodo = true;
+                continue;
+            }
+            auto it = ultimoPorDestino.find(c.destino);
+            if (it != ultimoPorDestino.end()) { it->second = c; enlace.comandosCoalescidos++; }
+            else ultimoPorDestino.emplace(c.destino, c);
+        }
+
+        // Lo retenido solo puede salir cuando una trama de comandos deja 'pendientes' (su ACK o
+        // el lector agoto los reintentos), y eso siempre sube tramasResueltas
+        bool retenidos = apagarTodo || !ultimoPorDestino.empty();
+        if (sacados == 0 && (!retenidos || enlace.tramasResueltas == resueltasVistas)) {
+            if (!retenidos && !enlace.escritorActivo) break;
+            if (!enlace.salida.vacia()) { std::this_thread::yield(); continue; } // Productor a medio encolar
+            std::unique_lock<std::mutex> lock(enlace.escritorMutex);
+            enlace.escritorEsperando = true;
+            enlace.cvEscritor.wait(lock, [&] {
+                if (!enlace.salida.vacia()) return true;
+                return retenidos ? enlace.tramasResueltas != resueltasVistas : !enlace.escritorActivo;
+            });
+            enlace.escritorEsperando = false;
+            continue;
+        }
+        resueltasVistas = enlace.tramasResueltas;
+        enviarLote(enlace, ultimoPorDestino, apagarTodo);
+    }
+}
+
+void detenerHiloEscritura(EnlacePTL& enlace, std::thread& hilo) {
+    {
+        std::lock_guard<std::mutex> lock(enlace.escritorMutex);
+        enlace.escritorActivo = false;
+        enlace.cvEscritor.notify_one();
+    }
+    if (hilo.joinable()) hilo.join();
+}
+
+// Un evento reenviado (se perdio nuestro ACK) no se despacha dos veces: un "+" repetido
+// sumaria una pieza de mas. Una secuencia mas de VENTANA_SECUENCIAS atras cuenta como nueva.
+bool eventoNuevo(EnlacePTL& enlace, uint8_t seq) {
+    if (enlace.ultimoEvento < 0) {
+        enlace.ultimoEvento = seq;
+        enlace.eventosVistos = 1;
+        return true;
+    }
+    uint8_t atras = (uint8_t)(enlace.ultimoEvento - seq);
+    if (atras < VENTANA_SECUENCIAS) {
+        if (enlace.eventosVistos & (1u << atras)) return false;
+        enlace.eventosVistos |= 1u << atras;
+        return true;
+    }
+    uint8_t adelante = (uint8_t)(seq - enlace.ultimoEvento);
+    enlace.eventosVistos = adelante >= VENTANA_SECUENCIAS ? 1 : (enlace.eventosVistos << adelante) | 1;
+    enlace.ultimoEvento = seq;
+    return true;
+}
+
+// Procesa una trama completa recibida del Arduino (CRC ya verificado).
+void procesarTramaRecibida(EnlacePTL& enlace, const std::string& trama, std::vector<std::string>& eventos) {
+    uint8_t seq = trama[2], op = trama[3], len = trama[4];
+    std::string datos = trama.substr(TRAMA_CABECERA, len);
+    switch (op) {
+        case OP_BOTON: case OP_MAS: case OP_MENOS: {
+            // Se confirma siempre, aunque sea repetido: el ACK anterior pudo perderse
+            std::string ack = construirTrama(seq, OP_ACK, "");
+            enlace.transporte->escribir(ack.data(), ack.size());
+            CONTAR(CONTADOR_BYTES_TX, ack.size());
+            if (len >= 2 && eventoNuevo(enlace, seq)) {
+                const char* prefijo = (op == OP_BOTON) ? "boton_" : (op == OP_MAS ? "+" : "-");
+                eventos.push_back(prefijo + std::to_string(leerU16(datos, 0)));
+            }
+            break;
+        }
+        case OP_HOLA: case OP_ACK: case OP_BARRIDO: {
+            std::lock_guard<std::mutex> lock(enlace.mutex);
+            if (op == OP_HOLA && len >= 2) { enlace.versionFirmware = (uint8_t)datos[0]; enlace.modulosFirmware = (uint8_t)datos[1]; }
+            if (op == OP_HOLA) enlace.ultimoEvento = -1; // El firmware reinicio la numeracion de eventos
+            if (op == OP_BARRIDO && len >= 7) {
+                enlace.modulosFirmware = (uint8_t)datos[0];
+                enlace.modulosEncendidos = (uint8_t)datos[1];
+                enlace.barridoUltimoMs = leerU16(datos, 2);
+                enlace.barridoMaximoMs = leerU16(datos, 4);
+                enlace.lecturasPorVuelta = (uint8_t)datos[6];
+            }
+            if (enlace.pendientes.erase(seq)) {
+                enlace.tramasResueltas++;
+                despertarEscritor(enlace);
+            }
+            enlace.ultimaRespuesta = seq;
+            enlace.cvRespuesta.notify_all();
+            break;
+        }
+        case OP_NACK: {
+            // Bytes perdidos o corruptos: se reenvia de inmediato si aun quedan intentos
+            std::lock_guard<std::mutex> lock(enlace.mutex);
+            auto it = enlace.pendientes.find(seq);
+            if (it != enlace.pendientes.end() && it->second.reintentar && it->second.intentos < MAX_REINTENTOS) {
+                it->second.intentos++;
+                it->second.enviada = std::chrono::steady_clock::now();
+                enlace.transporte->escribir(it->second.bytes.data(), it->second.bytes.size());
+                CONTAR(CONTADOR_RETRANSMISIONES, 1);
+            } else if (it != enlace.pendientes.end() && !it->second.reintentar) {
+                enlace.ultimoRechazo = seq; // Quien espera esta trama (HOLA, mapa...) se entera ya
+                enlace.cvRespuesta.notify_all();
+            }
+            break;
+        }
+        default: break;
+    }
+}
+
+// Reenvia las tramas que no recibieron ACK a tiempo; devuelve true si quedan pendientes.
+bool revisarRetransmisiones(EnlacePTL& enlace) {
+    std::lock_guard<std::mutex> lock(enlace.mutex);
+    auto ahora = std::chrono::steady_clock::now();
+    for (auto it = enlace.pendientes.begin(); it != enlace.pendientes.end();) {
+        TramaPendiente& t = it->second;
+        if (ahora - t.enviada < std::chrono::milliseconds(RETRANSMISION_MS)) { ++it; continue; }
+        if (t.reintentar && t.intentos < MAX_REINTENTOS) {
+            t.intentos++;
+            t.enviada = ahora;
+            enlace.transporte->escribir(t.bytes.data(), t.bytes.size());
+            CONTAR(CONTADOR_RETRANSMISIONES, 1);
+            ++it;
+        } else {
+            if (t.reintentar) std::cerr << "ALERTA: El Arduino no confirmo un comando tras " << MAX_REINTENTOS
+                                        << " intentos. Revise el cableado del bus." << std::endl;
+            it = enlace.pendientes.erase(it);
+            enlace.cvRespuesta.notify_all();
+            enlace.tramasResueltas++; // Su destino deja de estar retenido
+            despertarEscritor(enlace);
+        }
+    }
+    return !enlace.pendientes.empty();
+}
+
+// Variables globales serial: un enlace (con su lector y su escritor) por puerto/controlador
+std::vector<std::unique_ptr<EnlacePTL>> buses;
+std::vector<int> busPorDestino;          // destino -> indice en 'buses'; fuera de rango = bus 0
+
+std::string nombreArchivoBackorder = "";
+std::string archivoCSVGlobal = ""; 
+
+struct EntradaProducto {
+    uint32_t sku;             // Ids en DatosCargados::textos, como en GrupoLote
+    uint32_t lote;
+    int ordenDeVenta;
+    int piezas;
+    int destino;
+    bool yaSurtido; // <--- NUEVA BANDERA DE PROTECCIÓN
+};
+
+// --- INDICE (SKU, LOTE) ---
+// Tabla hash plana (direccionamiento abierto, sondeo lineal) que guarda solo (hash, valor).
+// La igualdad la decide quien busca, asi las claves no se copian: el valor apunta a un texto
+// internado o a un grupo que ya contiene su SKU y lote.
+class TablaPlana {
+    std::vector<uint64_t> hashes;   // 0 = ranura libre
+    std::vector<uint32_t> valores;
+    size_t usados = 0;
+
+    void crecer() {
+        std::vector<uint64_t> viejosHashes = std::move(hashes);
+        std::vector<uint32_t> viejosValores = std::move(valores);
+        size_t capacidad = viejosHashes.empty() ? 1024 : viejosHashes.size() * 2;
+        hashes.assign(capacidad, 0);
+        valores.assign(capacidad, 0);
+        for (size_t i = 0; i < viejosHashes.size(); ++i) {
+            if (!viejosHashes[i]) continue;
+            size_t j = viejosHashes[i] & (capacidad - 1);
+            while (hashes[j]) j = (j + 1) & (capacidad - 1);
+            hashes[j] = viejosHashes[i];
+            valores[j] = viejosValores[i];
+        }
+    }
+
+public:
+    static uint64_t normalizar(uint64_t h) { return h ? h : 1; }
+
+    template <class Igual>
+    bool buscar(uint64_t h, Igual igual, uint32_t& valor) const {
+        if (hashes.empty()) return false;
+        h = normalizar(h);
+        for (size_t j = h & (hashes.size() - 1); hashes[j]; j = (j + 1) & (hashes.size() - 1)) {
+            if (hashes[j] == h && igual(valores[j])) { valor = valores[j]; return true; }
+        }
+        return false;
+    }
+
+    void insertar(uint64_t h, uint32_t valor) {
+        if ((usados + 1) * 4 > hashes.size() * 3) crecer();
+        h = normalizar(h);
+        size_t j = h & (hashes.size() - 1);
+        while (hashes[j]) j = (j + 1) & (hashes.size() - 1);
+        hashes[j] = h;
+        valores[j] = valor;
+        usados++;
+    }
+
+    void agregarTodo(const TablaPlana& otra) {
+        for (size_t i = 0; i < otra.hashes.size(); ++i) if (otra.hashes[i]) insertar(otra.hashes[i], otra.valores[i]);
+    }
+};
+
+uint64_t hashTexto(std::string_view texto) {
+    return std::hash<std::string_view>()(texto);
+}
+
+uint64_t hashSKULote(std::string_view sku, std::string_view lote) {
+    return hashTexto(sku) * 0x9E3779B97F4A7C15ull ^ hashTexto(lote);
+}
+
+// Todas las lineas de una OV para un mismo SKU/lote se surten juntas en su destino.
+struct DestinoGrupo {
+    int destino;
+    int ordenDeVenta;
+    int piezas;               // Suma de las lineas
+    uint32_t primeraEntrada;  // Rango en DatosCargados::entradasPorDestino
+    uint32_t numEntradas;
+    bool surtido;
+};
+
+// Un (SKU, lote) con la lista contigua de sus destinos y cuantos faltan por surtir.
+struct GrupoLote {
+    uint32_t sku;             // Ids en DatosCargados::textos
+    uint32_t lote;
+    std::vector<DestinoGrupo> destinos;
+    int pendientes = 0;
+};
+
+// Referencia estable a un destino de un grupo (los indices sobreviven a que crezcan los vectores)
+struct RefDestino {
+    uint32_t grupo;
+    uint32_t indice;
+};
+
+// Modulos fisicos del rack. Cada OV tiene un destino logico (1..n, en orden de aparicion) y
+// toma un modulo cuando hay uno libre; al surtirse su ultima linea lo suelta y pasa a la
+// siguiente OV en espera. Asi 24 modulos atienden cualquier numero de OV.
+struct AsignadorModulos {
+    int capacidad = 0;                                  // Modulos reales
+    std::vector<int> moduloPorDestino;                  // Destino logico -> modulo (0 = sin modulo)
+    std::vector<int> destinoPorModulo;                  // Modulo -> destino logico (0 = libre)
+    std::vector<int> lineasPendientes;                  // Destino logico -> destinos de grupo sin surtir
+    std::vector<int> ordenDeVenta;                      // Destino logico -> OV
+    std::priority_queue<int, std::vector<int>, std::greater<int>> libres; // Siempre el mas bajo primero
+    int siguienteEnEspera = 1;                          // Las OV sin modulo son [siguienteEnEspera, n]
+    bool reciclando() const { return capacidad + 1 < (int)moduloPorDestino.size(); }
+};
+
+struct DatosCargados {
+    std::vector<EntradaProducto> entradas;
+    std::deque<std::string> textos;                            // SKU y lotes internados
+    TablaPlana idTexto;                                        // texto -> id en 'textos'
+    TablaPlana grupoPorClave;                                  // (SKU, lote) -> grupo
+    std::unordered_map<uint32_t, std::vector<uint32_t>> gruposPorSKU;
+    std::vector<GrupoLote> grupos;
+    std::vector<uint32_t> entradasPorDestino;                  // Indices de 'entradas', contiguos por destino
+    AsignadorModulos modulos;
+    bool cargadoExitosamente = false;
+};
+
+using Producto = EntradaProducto;
+
+DatosCargados datos;
+std::mutex mutexDatos;                   // Varias estaciones surten a la vez: marcas, bitacora y foto
+int modulosFisicos = 0;                  // --modulos=N: las OV se reparten en N modulos que se reciclan
+
+bool buscarTexto(const DatosCargados& d, std::string_view texto, uint32_t& id) {
+    return d.idTexto.buscar(hashTexto(texto), [&](uint32_t v) { return d.textos[v] == texto; }, id);
+}
+
+uint32_t internarTexto(DatosCargados& d, std::string_view texto) {
+    uint32_t id;
+    if (buscarTexto(d, texto, id)) return id;
+    d.textos.emplace_back(texto);
+    id = (uint32_t)d.textos.size() - 1;
+    d.idTexto.insertar(hashTexto(texto), id);
+    return id;
+}
+
+bool buscarIdGrupo(const DatosCargados& d, std::string_view sku, std::string_view lote, uint32_t& idGrupo) {
+    return d.grupoPorClave.buscar(hashSKULote(sku, lote), [&](uint32_t g) {
+        return d.textos[d.grupos[g].sku] == sku && d.textos[d.grupos[g].lote] == lote;
+    }, idGrupo);
+}
+
+// Devuelve el grupo del (SKU, lote), creandolo si es nuevo.
+uint32_t obtenerGrupo(DatosCargados& d, std::string_view sku, std::string_view lote) {
+    uint32_t g;
+    if (buscarIdGrupo(d, sku, lote, g)) return g;
+    uint32_t idSku = internarTexto(d, sku), idLote = internarTexto(d, lote);
+    g = (uint32_t)d.grupos.size();
+    d.grupos.push_back({idSku, idLote, {}, 0});
+    d.gruposPorSKU[idSku].push_back(g);
+    d.grupoPorClave.insertar(hashSKULote(sku, lote), g);
+    return g;
+}
+
+// Agrupa las entradas de cada (SKU, lote) por destino, en orden de aparicion en el archivo.
+// grupoDeEntrada[i] es el grupo de d.entradas[i]. Es O(n): conteo por grupo y luego por destino.
+void construirIndice(DatosCargados& d, const std::vector<uint32_t>& grupoDeEntrada) {
+    std::vector<uint32_t> inicio(d.grupos.size() + 1, 0);
+    for (uint32_t g : grupoDeEntrada) inicio[g + 1]++;
+    for (size_t g = 0; g < d.grupos.size(); ++g) inicio[g + 1] += inicio[g];
+    std::vector<uint32_t> orden(d.entradas.size());
+    std::vector<uint32_t> cursor(inicio.begin(), inicio.end() - 1);
+    for (uint32_t i = 0; i < grupoDeEntrada.size(); ++i) orden[cursor[grupoDeEntrada[i]]++] = i;
+
+    int maxDestino = 0;
+    for (const EntradaProducto& e : d.entradas) maxDestino = std::max(maxDestino, e.destino);
+    std::vector<int> posDestino(maxDestino + 1, -1);
+    d.entradasPorDestino.assign(d.entradas.size(), 0);
+
+    for (size_t g = 0; g < d.grupos.size(); ++g) {
+        GrupoLote& grupo = d.grupos[g];
+        grupo.destinos.clear();
+        for (uint32_t k = inicio[g]; k < inicio[g + 1]; ++k) {
+            const EntradaProducto& e = d.entradas[orden[k]];
+            if (posDestino[e.destino] < 0) {
+                posDestino[e.destino] = (int)grupo.destinos.size();
+                grupo.destinos.push_back({e.destino, e.ordenDeVenta, 0, 0, 0, false});
+            }
+            DestinoGrupo& dg = grupo.destinos[posDestino[e.destino]];
+            dg.piezas += e.piezas;
+            dg.numEntradas++;
+        }
+        uint32_t siguiente = inicio[g];
+        for (DestinoGrupo& dg : grupo.destinos) { dg.primeraEntrada = siguiente; siguiente += dg.numEntradas; dg.numEntradas = 0; }
+        for (uint32_t k = inicio[g]; k < inicio[g + 1]; ++k) {
+            DestinoGrupo& dg = grupo.destinos[posDestino[d.entradas[orden[k]].destino]];
+            d.entradasPorDestino[dg.primeraEntrada + dg.numEntradas++] = orden[k];
+        }
+        for (const DestinoGrupo& dg : grupo.destinos) posDestino[dg.destino] = -1;
+        grupo.pendientes = (int)grupo.destinos.size();
+    }
+}
+
+// O(1): nullptr si el SKU no existe o si ese lote no pertenece al SKU.
+GrupoLote* buscarGrupo(DatosCargados& d, std::string_view sku, std::string_view lote, uint32_t* idGrupo = nullptr) {
+    uint32_t g;
+    if (!buscarIdGrupo(d, sku, lote, g)) return nullptr;
+    if (idGrupo) *idGrupo = g;
+    return &d.grupos[g];
+}
+
+// --- INDICE PUBLICADO ---
+// Las estaciones buscan SKU y lote en un indice de solo lectura (textos, tablas y el (SKU, lote)
+// de cada grupo, sin destinos) que nunca cambia: no toman ningun candado. Esta hecho de capas
+// inmutables que las versiones comparten: una carga adicional publica otra version con las
+// capas de la anterior mas una con lo que agrego, y la cambia con std::atomic_store; quien ya
+// tenia la anterior la sigue usando hasta terminar su escaneo. Una capa que llega a la mitad de
+// la anterior se fusiona con ella, asi que hay O(log n) capas y cada texto se copia O(log n)
+// veces en la sesion. Textos y grupos solo crecen al final: los ids valen en 'datos'.
+struct CapaIndice {
+    uint32_t primerTexto = 0, primerGrupo = 0;          // Id del primer texto y grupo de la capa
+    std::vector<std::string> textos;
+    std::vector<std::pair<uint32_t, uint32_t>> grupos;  // (SKU, lote) de cada grupo
+    TablaPlana idTexto;                                 // texto -> id
+    TablaPlana grupoPorClave;                           // (SKU, lote) -> grupo
+    std::unordered_map<uint32_t, std::vector<uint32_t>> gruposPorSKU; // Todos los del SKU hasta esta capa
+
+    size_t tamano() const { return textos.size() + grupos.size(); }
+};
+
+struct IndiceBusqueda {
+    std::vector<std::shared_ptr<const CapaIndice>> capas; // De la mas vieja a la mas nueva
+
+    const std::string& texto(uint32_t id) const {
+        size_t c = capas.size() - 1;
+        while (id < capas[c]->primerTexto) --c;
+        return capas[c]->textos[id - capas[c]->primerTexto];
+    }
+};
+
+std::shared_ptr<const IndiceBusqueda> indicePublicado;
+
+bool buscarTexto(const IndiceBusqueda& x, std::string_view texto, uint32_t& id) {
+    uint64_t h = hashTexto(texto);
+    for (auto c = x.capas.rbegin(); c != x.capas.rend(); ++c) {
+        const CapaIndice& capa = **c;
+        if (capa.idTexto.buscar(h, [&](uint32_t v) { return capa.textos[v - capa.primerTexto] == texto; }, id)) return true;
+    }
+    return false;
+}
+
+bool buscarIdGrupo(const IndiceBusqueda& x, std::string_view sku, std::string_view lote, uint32_t& idGrupo) {
+    uint64_t h = hashSKULote(sku, lote);
+    for (auto c = x.capas.rbegin(); c != x.capas.rend(); ++c) {
+        const CapaIndice& capa = **c;
+        bool encontrado = capa.grupoPorClave.buscar(h, [&](uint32_t g) {
+            const auto& [idSku, idLote] = capa.grupos[g - capa.primerGrupo];
+            return x.texto(idSku) == sku && x.texto(idLote) == lote;
+        }, idGrupo);
+        if (encontrado) return true;
+    }
+    return false;
+}
+
+// La capa mas nueva que tiene el SKU trae la lista completa de sus grupos.
+const std::vector<uint32_t>* gruposDeSKU(const IndiceBusqueda& x, uint32_t idSku) {
+    for (auto c = x.capas.rbegin(); c != x.capas.rend(); ++c) {
+        auto it = (*c)->gruposPorSKU.find(idSku);
+        if (it != (*c)->gruposPorSKU.end()) return &it->second;
+    }
+    return nullptr;
+}
+
+const std::vector<uint32_t>* buscarGruposSKU(const IndiceBusqueda& x, std::string_view sku) {
+    uint32_t idSku;
+    return buscarTexto(x, sku, idSku) ? gruposDeSKU(x, idSku) : nullptr;
+}
+
+// Lo que 'd' tiene desde primerTexto y primerGrupo. De un SKU que gano grupos se copia su lista
+// entera, que son sus lotes: pocos.
+std::shared_ptr<const CapaIndice> armarCapa(const DatosCargados& d, uint32_t primerTexto, uint32_t primerGrupo) {
+    auto capa = std::make_shared<CapaIndice>();
+    capa->primerTexto = primerTexto;
+    capa->primerGrupo = primerGrupo;
+    capa->textos.assign(d.textos.begin() + primerTexto, d.textos.end());
+    for (uint32_t id = primerTexto; id < d.textos.size(); ++id) capa->idTexto.insertar(hashTexto(d.textos[id]), id);
+    capa->grupos.reserve(d.grupos.size() - primerGrupo);
+    for (uint32_t g = primerGrupo; g < d.grupos.size(); ++g) {
+        const GrupoLote& grupo = d.grupos[g];
+        capa->grupos.emplace_back(grupo.sku, grupo.lote);
+        capa->grupoPorClave.insertar(hashSKULote(d.textos[grupo.sku], d.textos[grupo.lote]), g);
+        if (!capa->gruposPorSKU.count(grupo.sku)) capa->gruposPorSKU[grupo.sku] = d.gruposPorSKU.at(grupo.sku);
+    }
+    return capa;
+}
+
+// 'nueva' empieza donde termina 'vieja'.
+std::shared_ptr<const CapaIndice> fusionarCapas(const CapaIndice& vieja, const CapaIndice& nueva) {
+    auto capa = std::make_shared<CapaIndice>(vieja);
+    capa->textos.insert(capa->textos.end(), nueva.textos.begin(), nueva.textos.end());
+    capa->grupos.insert(capa->grupos.end(), nueva.grupos.begin(), nueva.grupos.end());
+    capa->idTexto.agregarTodo(nueva.idTexto);
+    capa->grupoPorClave.agregarTodo(nueva.grupoPorClave);
+    for (const auto& [idSku, grupos] : nueva.gruposPorSKU) capa->gruposPorSKU[idSku] = grupos;
+    return capa;
+}
+
+// Indice completo de 'd' en una sola capa (al cargar o reanudar la sesion).
+void publicarIndice(const DatosCargados& d) {
+    auto x = std::make_shared<IndiceBusqueda>();
+    x->capas.push_back(armarCapa(d, 0, 0));
+    std::atomic_store(&indicePublicado, std::shared_ptr<const IndiceBusqueda>(std::move(x)));
+}
+
+// Tras una carga adicional: solo se arma la capa con lo agregado. Solo el hilo que agrega
+// textos y grupos la llama, asi que 'd' se lee sin mutexDatos: las estaciones nunca escriben
+// esos campos.
+void agregarAlIndice(const DatosCargados& d) {
+    std::shared_ptr<const IndiceBusqueda> anterior = std::atomic_load(&indicePublicado);
+    if (!anterior || anterior->capas.empty()) { publicarIndice(d); return; }
+    const CapaIndice& ultima = *anterior->capas.back();
+    uint32_t textos = ultima.primerTexto + (uint32_t)ultima.textos.size();
+    uint32_t grupos = ultima.primerGrupo + (uint32_t)ultima.grupos.size();
+    if (textos == d.textos.size() && grupos == d.grupos.size()) return; // Solo lineas en grupos que ya existian
+
+    auto x = std::make_shared<IndiceBusqueda>(*anterior); // Copia punteros, no capas
+    std::shared_ptr<const CapaIndice> nueva = armarCapa(d, textos, grupos);
+    while (!x->capas.empty() && 2 * nueva->tamano() >= x->capas.back()->tamano()) {
+        nueva = fusionarCapas(*x->capas.back(), *nueva);
+        x->capas.pop_back();
+    }
+    x->capas.push_back(std::move(nueva));
+    std::atomic_store(&indicePublicado, std::shared_ptr<const IndiceBusqueda>(std::move(x)));
+}
+
+std::shared_ptr<const IndiceBusqueda> indiceActual() {
+    return std::atomic_load(&indicePublicado);
+}
+
+// Modulo fisico del destino logico; 0 si la OV todavia espera uno.
+int moduloDe(const DatosCargados& d, int destino) {
+    const AsignadorModulos& a = d.modulos;
+    return destino < (int)a.moduloPorDestino.size() ? a.moduloPorDestino[destino] : 0;
+}
+
+// Da los modulos libres a las OV en espera, en orden de aparicion.
+void asignarEnEspera(AsignadorModulos& a) {
+    while (!a.libres.empty() && a.siguienteEnEspera < (int)a.moduloPorDestino.size()) {
+        int destino = a.siguienteEnEspera++;
+        if (a.lineasPendientes[destino] == 0 || a.moduloPorDestino[destino] != 0) continue;
+        int modulo = a.libres.top();
+        a.libres.pop();
+        a.moduloPorDestino[destino] = modulo;
+        a.destinoPorModulo[modulo] = destino;
+    }
+}
+
+// Rehace conteos, duenos y libres a partir de capacidad, moduloPorDestino y siguienteEnEspera
+// (lo unico que guarda la foto). Los libres salen del mas bajo: el resultado no depende del
+// orden en que se fueron soltando y la bitacora reaplicada asigna lo mismo que la sesion original.
+void reconstruirAsignador(DatosCargados& d) {
+    AsignadorModulos& a = d.modulos;
+    int maxDestino = 0;
+    for (const EntradaProducto& e : d.entradas) maxDestino = std::max(maxDestino, e.destino);
+    a.moduloPorDestino.resize(maxDestino + 1, 0);
+    a.lineasPendientes.assign(maxDestino + 1, 0);
+    a.ordenDeVenta.assign(maxDestino + 1, 0);
+    for (const GrupoLote& grupo : d.grupos) {
+        for (const DestinoGrupo& dg : grupo.destinos) {
+            a.ordenDeVenta[dg.destino] = dg.ordenDeVenta;
+            if (!dg.surtido) a.lineasPendientes[dg.destino]++;
+        }
+    }
+    a.destinoPorModulo.assign(a.capacidad + 1, 0);
+    for (int destino = 1; destino <= maxDestino; ++destino) {
+        int& modulo = a.moduloPorDestino[destino];
+        if (modulo > a.capacidad || a.lineasPendientes[destino] == 0 || a.destinoPorModulo[modulo] != 0) modulo = 0;
+        if (modulo != 0) a.destinoPorModulo[modulo] = destino;
+    }
+    a.libres = {};
+    for (int modulo = 1; modulo <= a.capacidad; ++modulo) if (a.destinoPorModulo[modulo] == 0) a.libres.push(modulo);
+    asignarEnEspera(a);
+}
+
+// Primera asignacion de una carga nueva. Con capacidad 0 hay un modulo por OV (destino = modulo).
+void iniciarAsignador(DatosCargados& d, int capacidad) {
+    AsignadorModulos& a = d.modulos;
+    int maxDestino = 0;
+    for (const EntradaProducto& e : d.entradas) maxDestino = std::max(maxDestino, e.destino);
+    a.capacidad = capacidad > 0 ? capacidad : maxDestino;
+    a.moduloPorDestino.assign(maxDestino + 1, 0);
+    a.siguienteEnEspera = 1;
+    reconstruirAsignador(d);
+}
+
+// Marca un destino como surtido y actualiza el conteo de su grupo en O(lineas del destino).
+// Si era la ultima linea de la OV devuelve el modulo que solto (ya reasignado si habia espera).
+int marcarSurtido(DatosCargados& d, const RefDestino& ref) {
+    GrupoLote& grupo = d.grupos[ref.grupo];
+    DestinoGrupo& dg = grupo.destinos[ref.indice];
+    if (dg.surtido) return 0;
+    dg.surtido = true;
+    grupo.pendientes--;
+    for (uint32_t k = 0; k < dg.numEntradas; ++k) d.entradas[d.entradasPorDestino[dg.primeraEntrada + k]].yaSurtido = true;
+
+    AsignadorModulos& a = d.modulos;
+    if (dg.destino >= (int)a.lineasPendientes.size() || --a.lineasPendientes[dg.destino] > 0) return 0;
+    int modulo = a.moduloPorDestino[dg.destino];
+    if (modulo == 0) return 0;
+    a.moduloPorDestino[dg.destino] = 0;
+    a.destinoPorModulo[modulo] = 0;
+    a.libres.push(modulo);
+    asignarEnEspera(a);
+    return modulo;
+}
+
+struct Estacion;
+void despacharEvento(const std::string& mensaje);
+
+// --- FUNCIONES SERIAL ---
+bool inicializarPuertoSerial(EnlacePTL& enlace, const std::string& puerto) {
+    enlace.puerto = puerto;
+    enlace.transporte = crearTransporte();
+    if (!enlace.transporte->abrir(puerto, BAUDRATE)) {
+        std::cerr << "ERROR: Puerto serial '" << puerto << "' no encontrado." << std::endl;
+        enlace.transporte.reset();
+        return false;
+    }
+    std::cout << "Puerto serial " << puerto << " inicializado." << std::endl;
+    return true;
+}
+
+// Intenta pasar a protocolo binario y a BAUDRATE_BINARIO. Si el firmware no responde
+// (version anterior), se queda en comandos de texto a BAUDRATE.
+void negociarProtocolo(EnlacePTL& enlace) {
+    std::string prefijo = (buses.size() > 1) ? "[" + enlace.puerto + "] " : "";
+    // Varios intentos: abrir el puerto reinicia el Arduino y el bootloader tarda en soltarlo
+    bool responde = false;
+    for (int intento = 0; intento < 6 && !responde; ++intento) {
+        responde = esperarConfirmacion(enlace, enviarTrama(enlace, OP_HOLA, "", false), 500);
+    }
+    if (!responde) {
+        // Un firmware de solo texto acumulo los bytes de HOLA; el salto de linea los descarta
+        enlace.transporte->escribir("\n", 1);
+        std::cout << prefijo << "Firmware sin protocolo binario. Usando comandos de texto a " << BAUDRATE << " baudios." << std::endl;
+        return;
+    }
+    enlace.binario = true;
+
+    std::string datos;
+    for (int i = 0; i < 4; ++i) datos += (char)((BAUDRATE_BINARIO >> (8 * i)) & 0xFF);
+    if (esperarConfirmacion(enlace, enviarTrama(enlace, OP_BAUDIOS, datos, false), 500)) {
+        enlace.transporte->configurarBaudios(BAUDRATE_BINARIO);
+        if (esperarConfirmacion(enlace, enviarTrama(enlace, OP_HOLA, "", false), 500)) {
+            std::cout << prefijo << "Protocolo binario v" << enlace.versionFirmware << " (" << enlace.modulosFirmware
+                      << " modulos) a " << BAUDRATE_BINARIO << " baudios." << std::endl;
+            return;
+        }
+        // El firmware regresa solo a BAUDRATE si no recibe una trama valida a la nueva velocidad
+        enlace.transporte->configurarBaudios(BAUDRATE);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+        enlace.binario = esperarConfirmacion(enlace, enviarTrama(enlace, OP_HOLA, "", false), 500);
+    }
+    std::cout << prefijo << "Protocolo " << (enlace.binario ? "binario" : "de texto") << " a " << BAUDRATE << " baudios." << std::endl;
+}
+
+int indiceBus(int destino) {
+    int b = (destino >= 0 && destino < (int)busPorDestino.size()) ? busPorDestino[destino] : -1;
+    return b < 0 ? 0 : b;
+}
+
+// Reparte los comandos entre los buses conservando su orden; APAGAR_TODO va a todos.
+void enviarComandos(const std::vector<ComandoPTL>& comandos) {
+    if (buses.size() == 1) { encolarComandos(*buses[0], comandos); return; }
+    std::vector<std::vector<ComandoPTL>> porBus(buses.size());
+    for (const ComandoPTL& c : comandos) {
+        if (c.opcode == OP_APAGAR_TODO) { for (auto& v : porBus) v.push_back(c); }
+        else porBus[indiceBus(c.destino)].push_back(c);
+    }
+    for (size_t b = 0; b < buses.size(); ++b) {
+        if (!porBus[b].empty()) encolarComandos(*buses[b], porBus[b]);
+    }
+}
+
+std::string trim(const std::string& str) {
+    size_t first = str.find_first_not_of(" \t\n\r");
+    if (std::string::npos == first) return str;
+    size_t last = str.find_last_not_of(" \t\n\r");
+    return str.substr(first, (last - first + 1));
+}
+
+// Mapa de modulos (--mapa): una linea por modulo "id,mux,canal,direccion,clk,dio". mux y
+// canal son los del TCA9548A (0-7, mux 0 = 0x70); con mux "-" el PCF8574 va directo al bus.
+// La direccion acepta 0x20. El orden de las lineas es el orden de lectura del firmware, asi
+// que conviene agruparlas por canal.
+bool leerMapaModulos(const std::string& archivo, std::string& entradas, int& modulos) {
+    std::ifstream in(archivo);
+    if (!in) { std::cerr << "ERROR: No se pudo abrir el mapa '" << archivo << "'." << std::endl; return false; }
+    entradas.clear();
+    modulos = 0;
+    std::string linea;
+    int numeroLinea = 0;
+    while (std::getline(in, linea)) {
+        ++numeroLinea;
+        linea = trim(linea);
+        if (linea.empty() || linea[0] == '#' || !std::isdigit((unsigned char)linea[0])) continue; // Encabezado o comentario
+        std::vector<std::string> campos;
+        std::stringstream ss(linea);
+        std::string campo;
+        while (std::getline(ss, campo, ',')) campos.push_back(trim(campo));
+        try {
+            if (campos.size() != 6) throw std::invalid_argument("campos");
+            int id = std::stoi(campos[0]);
+            bool directo = campos[1] == "-" || campos[1].empty();
+            int mux = directo ? 0 : std::stoi(campos[1]);
+            int canal = directo ? 0 : std::stoi(campos[2]);
+            int direccion = std::stoi(campos[3], nullptr, 0);
+            int clk = std::stoi(campos[4]), dio = std::stoi(campos[5]);
+            if (id < 1 || id > 254 || mux < 0 || mux > 7 || canal < 0 || canal > 7 || direccion < 0 || direccion > 0x7F
+                || clk < 0 || clk > 255 || dio < 0 || dio > 255) throw std::out_of_range("rango");
+            entradas += (char)(id & 0xFF);
+            entradas += (char)(id >> 8);
+            entradas += (char)(directo ? 0xFF : (mux << 3) | canal);
+            entradas += (char)direccion;
+            entradas += (char)clk;
+            entradas += (char)dio;
+            ++modulos;
+        } catch (const std::exception&) {
+            std::cerr << "ERROR: Linea " << numeroLinea << " del mapa invalida: '" << linea << "'." << std::endl;
+            return false;
+        }
+    }
+    if (modulos == 0 || modulos > 96) {
+        std::cerr << "ERROR: El mapa debe tener de 1 a 96 modulos (tiene " << modulos << ")." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Manda el mapa en tramos de OP_MAPA. El Arduino graba cada tramo en su EEPROM antes de
+// confirmar, asi que no se reenvia por tiempo: se espera cada ACK con holgura.
+void enviarMapa(EnlacePTL& enlace) {
+    std::string prefijo = (buses.size() > 1) ? "[" + enlace.puerto + "] " : "";
+    std::string entradas;
+    int modulos = 0;
+    if (!leerMapaModulos(enlace.archivoMapa, entradas, modulos)) return;
+    const int porTrama = (TRAMA_MAX_DATOS - 2) / 6;
+    for (int inicio = 0; inicio < modulos; inicio += porTrama) {
+        int n = std::min(porTrama, modulos - inicio);
+        std::string datos;
+        datos += (char)modulos;
+        datos += (char)inicio;
+        datos += entradas.substr(inicio * 6, n * 6);
+        if (!esperarConfirmacion(enlace, enviarTrama(enlace, OP_MAPA, datos, false), 3000)) {
+            std::cerr << prefijo << "ERROR: El Arduino rechazo el mapa '" << enlace.archivoMapa
+                      << "' (ids repetidos o fuera de rango); se queda con el anterior." << std::endl;
+            return;
+        }
+    }
+    esperarConfirmacion(enlace, enviarTrama(enlace, OP_HOLA, "", false), 500);
+    std::cout << prefijo << "Mapa '" << enlace.archivoMapa << "' cargado: " << enlace.modulosFirmware << " modulos." << std::endl;
+}
+
+// Pide al firmware cuanto tarda en recorrer todos los modulos encendidos: es lo mas que
+// puede esperar un boton a ser leido.
+void reportarBarrido(EnlacePTL& enlace) {
+    if (!enlace.binario || !esperarConfirmacion(enlace, enviarTrama(enlace, OP_BARRIDO, "", false), 500)) return;
+    std::string prefijo = (buses.size() > 1) ? "[" + enlace.puerto + "] " : "";
+    std::cout << prefijo << "Lectura de botones: " << enlace.modulosFirmware << " modulos, ultimo barrido "
+              << enlace.barridoUltimoMs << " ms, peor " << enlace.barridoMaximoMs << " ms ("
+              << enlace.lecturasPorVuelta << " lecturas por vuelta)." << std::endl;
+}
+
+// Separa el flujo recibido en lineas de texto y tramas binarias. El byte 0xA5 nunca aparece
+// en los mensajes de texto: si llega a media linea, lo anterior era basura del ruido y se
+// descarta, asi un byte alterado no deja al lector sordo a las tramas hasta el siguiente '\n'.
+void procesarBytesRecibidos(EnlacePTL& enlace, const char* buffer, int n, std::string& linea, std::string& trama,
+                            std::vector<std::string>& eventos) {
+    for (int i = 0; i < n; ++i) {
+        char c = buffer[i];
+        if (trama.empty() && (uint8_t)c == TRAMA_INICIO) { linea.clear(); trama += c; continue; }
+        if (!trama.empty()) {
+            trama += c;
+            if (trama.size() >= TRAMA_CABECERA && (uint8_t)trama[4] > TRAMA_MAX_DATOS) { trama.clear(); continue; }
+            if (trama.size() < TRAMA_CABECERA || trama.size() < TRAMA_CABECERA + (size_t)(uint8_t)trama[4] + 2) continue;
+            size_t finDatos = trama.size() - 2;
+            uint16_t crc = ((uint8_t)trama[finDatos] << 8) | (uint8_t)trama[finDatos + 1];
+            if ((uint8_t)trama[1] == PROTOCOLO_VERSION && crc16((const uint8_t*)trama.data() + 1, finDatos - 1) == crc) {
+                procesarTramaRecibida(enlace, trama, eventos);
+            }
+            trama.clear();
+            continue;
+        }
+        if (c == '\n') {
+            std::string message = trim(linea);
+            if (!message.empty()) eventos.push_back(message);
+            linea.clear();
+        } else {
+            linea += c;
+        }
+    }
+}
+
+void hiloLecturaSerial(EnlacePTL& enlace) {
+    char buffer[MAX_BUFFER_SIZE];
+    std::string currentData = "";
+    std::string tramaParcial;
+    std::vector<std::string> eventos;
+    bool hayPendientes = false;
+    auto ultimoByte = std::chrono::steady_clock::now();
+    while (enlace.lecturaActiva) {
+        // Sin tramas por confirmar el lector duerme sin limite; con ellas despierta para retransmitir
+        int timeout = (hayPendientes || !tramaParcial.empty()) ? RETRANSMISION_MS / 3 : -1;
+        int bytesRead = enlace.transporte->leer(buffer, sizeof(buffer), timeout);
+        if (bytesRead < 0) {
+            if (enlace.lecturaActiva) std::cerr << "ERROR: Se perdio la comunicacion con el puerto serial " << enlace.puerto << "." << std::endl;
+            break;
+        }
+        auto ahora = std::chrono::steady_clock::now();
+        if (bytesRead > 0) { ultimoByte = ahora; CONTAR(CONTADOR_BYTES_RX, bytesRead); }
+        else if (!tramaParcial.empty() && ahora - ultimoByte >= std::chrono::milliseconds(RETRANSMISION_MS / 3)) {
+            tramaParcial.clear(); // Trama incompleta: se perdieron bytes
+        }
+        procesarBytesRecibidos(enlace, buffer, bytesRead, currentData, tramaParcial, eventos);
+        hayPendientes = revisarRetransmisiones(enlace);
+        // Cada evento va a la estacion que tiene encendido ese destino
+        for (const std::string& e : eventos) despacharEvento(e);
+        eventos.clear();
+    }
+}
+
+void detenerHiloLectura(EnlacePTL& enlace) {
+    enlace.lecturaActiva = false;
+    if (enlace.transporte) enlace.transporte->despertar();
+    if (enlace.lector.joinable()) enlace.lector.join();
+}
+
+// --- DIARIOS (BACKORDERS Y WAL) ---
+// Un hilo propio mantiene el archivo abierto y escribe los registros en grupos: el primero
+// que llega abre una ventana de DIARIO_GRUPO_MS (o hasta DIARIO_GRUPO_MAX registros) y todo
+// el grupo sale en una escritura. Las confirmaciones solo formatean y encolan. Si la escritura
+// falla (antivirus, disco lleno) el grupo vuelve al frente de la cola y se reintenta con espera
+// creciente; al cerrar solo se insiste DIARIO_REINTENTOS_CIERRE veces. La bitacora no usa
+// ventana: quien registra espera su escritura (esperarDiario) y lo que se encolo mientras
+// tanto sale junto en la siguiente.
+#define DIARIO_GRUPO_MS 200
+#define DIARIO_GRUPO_MAX 256
+#define DIARIO_ESPERA_MIN_MS 100
+#define DIARIO_ESPERA_MAX_MS 5000
+#define DIARIO_REINTENTOS_CIERRE 5
+
+enum class Durabilidad { SO, DISCO };       // SO: fflush al cerrar cada grupo; DISCO: ademas fsync
+enum class FormatoDiario { CSV, JSONL };
+
+struct DiarioArchivo {
+    std::string archivo;
+    std::string encabezado;                    // Se escribe si el archivo esta vacio
+    bool truncarAlAbrir = false;
+    Durabilidad durabilidad = Durabilidad::DISCO;
+    std::mutex mutex;
+    std::condition_variable cv;
+    int ventanaMs = DIARIO_GRUPO_MS;
+    std::vector<std::string> cola;
+    uint64_t encolados = 0, terminados = 0;    // Turnos: terminados cuenta los ya escritos (o perdidos)
+    std::condition_variable cvTerminados;
+    bool activo = false;
+    bool corriendo = false;                    // El hilo aun puede escribir (activo o vaciando la cola)
+    std::thread hilo;
+    uint64_t registros = 0, grupos = 0;        // Escritos con exito; solo los toca el hilo del diario
+    uint64_t fallas = 0, perdidos = 0;         // Escrituras fallidas (reintentadas) y registros descartados al cerrar
+};
+
+DiarioArchivo diario;                          // Backorders
+DiarioArchivo diarioWAL;                       // Bitacora de la sesion (binaria)
+FormatoDiario formatoBackorder = FormatoDiario::CSV;
+
+std::string escaparJSON(const std::string& texto) {
+    std::string r;
+    for (char c : texto) {
+        if (c == '"' || c == '\\') r += '\\';
+        r += c;
+    }
+    return r;
+}
+
+bool sincronizarADisco(std::FILE* f) {
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fdatasync(fileno(f)) == 0;
+#endif
+}
+
+// Tras crear o renombrar un archivo, su entrada en la carpeta tambien debe llegar al disco.
+// En Windows MOVEFILE_WRITE_THROUGH ya lo hace al renombrar.
+void sincronizarCarpeta(const std::string& archivo) {
+#ifndef _WIN32
+    std::string carpeta = std::filesystem::path(archivo).parent_path().string();
+    int fd = open(carpeta.empty() ? "." : carpeta.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+#else
+    (void)archivo;
+#endif
+}
+
+// Escribe el grupo entero o nada: si falla se recorta lo que alcanzo a escribirse y se cierra
+// el archivo, que el reintento vuelve a abrir.
+bool escribirGrupo(DiarioArchivo& d, std::FILE*& f, const std::vector<std::string>& grupo) {
+    if (!f) {
+        f = std::fopen(d.archivo.c_str(), d.truncarAlAbrir ? "wb" : "ab");
+        if (!f) return false;
+        d.truncarAlAbrir = false; // Un reintento no debe borrar lo ya escrito
+        std::fseek(f, 0, SEEK_END);
+        if (d.durabilidad == Durabilidad::DISCO && std::ftell(f) == 0) sincronizarCarpeta(d.archivo);
+    }
+    MEDIR_ETAPA(ETAPA_DIARIO);
+    long antes = std::ftell(f);
+    std::string bloque = antes == 0 ? d.encabezado : std::string();
+    for (const std::string& r : grupo) bloque += r;
+    bool ok = std::fwrite(bloque.data(), 1, bloque.size(), f) == bloque.size() && std::fflush(f) == 0;
+    if (ok && d.durabilidad == Durabilidad::DISCO) ok = sincronizarADisco(f);
+    if (ok) return true;
+    int error = errno;
+    if (antes >= 0) {
+#ifdef _WIN32
+        bool recortado = _chsize_s(_fileno(f), antes) == 0;
+#else
+        bool recortado = ftruncate(fileno(f), antes) == 0;
+#endif
+        if (!recortado) std::cerr << "AVISO: " << d.archivo << " puede quedar con un registro cortado." << std::endl;
+    }
+    std::fclose(f);
+    f = nullptr;
+    errno = error;
+    return false;
+}
+
+void hiloDiario(DiarioArchivo& d) {
+    std::FILE* f = nullptr;
+    std::vector<std::string> grupo;
+    int fallasSeguidas = 0;
+    std::unique_lock<std::mutex> lock(d.mutex);
+    while (true) {
+        d.cv.wait(lock, [&] { return !d.cola.empty() || !d.activo; });
+        if (d.cola.empty() && !d.activo) break;
+        // Ventana de grupo: esperar mas registros salvo que ya haya suficientes o se este cerrando
+        if (d.ventanaMs > 0) {
+            d.cv.wait_for(lock, std::chrono::milliseconds(d.ventanaMs),
+                          [&] { return d.cola.size() >= DIARIO_GRUPO_MAX || !d.activo; });
+        }
+        grupo.swap(d.cola);
+        lock.unlock();
+
+        if (escribirGrupo(d, f, grupo)) {
+            d.registros += grupo.size();
+            d.grupos++;
+            if (fallasSeguidas > 0) std::cerr << "AVISO: " << d.archivo << " se escribio tras " << fallasSeguidas << " intentos fallidos." << std::endl;
+            fallasSeguidas = 0;
+            lock.lock();
+            d.terminados += grupo.size();
+            grupo.clear();
+            d.cvTerminados.notify_all();
+            continue;
+        }
+        d.fallas++;
+        if (fallasSeguidas++ == 0) {
+            std::cerr << "ERROR: No se pudo escribir " << d.archivo << " (" << std::strerror(errno) << "); se reintenta." << std::endl;
+        }
+        lock.lock();
+        d.cola.insert(d.cola.begin(), std::make_move_iterator(grupo.begin()), std::make_move_iterator(grupo.end()));
+        grupo.clear();
+        if (!d.activo && fallasSeguidas > DIARIO_REINTENTOS_CIERRE) {
+            d.perdidos = d.cola.size();
+            d.terminados += d.cola.size();
+            d.cola.clear();
+            std::cerr << "ERROR: " << d.archivo << " no se pudo escribir; se perdieron " << d.perdidos << " registros." << std::endl;
+            break;
+        }
+        int espera = std::min(DIARIO_ESPERA_MAX_MS, DIARIO_ESPERA_MIN_MS << std::min(fallasSeguidas - 1, 6));
+        if (d.activo) d.cv.wait_for(lock, std::chrono::milliseconds(espera), [&] { return !d.activo; });
+        else {
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(espera));
+            lock.lock();
+        }
+    }
+    d.corriendo = false;
+    d.cvTerminados.notify_all();
+    lock.unlock();
+    if (f) std::fclose(f);
+}
+
+void iniciarDiario(DiarioArchivo& d, const std::string& archivo, const std::string& encabezado, bool truncar,
+                   int ventanaMs = DIARIO_GRUPO_MS) {
+    d.archivo = archivo;
+    d.encabezado = encabezado;
+    d.truncarAlAbrir = truncar;
+    d.ventanaMs = ventanaMs;
+    d.activo = d.corriendo = true;
+    d.hilo = std::thread(hiloDiario, std::ref(d));
+}
+
+// Escribe lo pendiente y cierra el archivo.
+void detenerDiario(DiarioArchivo& d) {
+    {
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if (!d.activo) return;
+        d.activo = false;
+    }
+    d.cv.notify_one();
+    if (d.hilo.joinable()) d.hilo.join();
+}
+
+// Devuelve el turno del registro, para esperarDiario.
+uint64_t escribirEnDiario(DiarioArchivo& d, std::string registro) {
+    uint64_t turno;
+    {
+        std::lock_guard<std::mutex> lock(d.mutex);
+        d.cola.push_back(std::move(registro));
+        turno = ++d.encolados;
+    }
+    d.cv.notify_one();
+    return turno;
+}
+
+// Bloquea hasta que el registro 'turno' y todos los anteriores esten escritos (con fsync si la
+// durabilidad es DISCO). Mientras la escritura falle, sigue esperando.
+void esperarDiario(DiarioArchivo& d, uint64_t turno) {
+    std::unique_lock<std::mutex> lock(d.mutex);
+    d.cvTerminados.wait(lock, [&] { return d.terminados >= turno || !d.corriendo; });
+}
+
+void iniciarDiarioBackorder(const std::string& archivo) {
+    const char* encabezado = "SKU,LoteRequerido,LoteConfirmado,Orden de venta,Destino,PiezasRequeridas,CantidadSurtida,Motivo\n";
+    iniciarDiario(diario, archivo, formatoBackorder == FormatoDiario::CSV ? encabezado : "", false);
+}
+
+// --- LOGICA PRINCIPAL ---
+
+void registrarBackorder(const std::string& sku, int ordenDeVenta, int destino,
+                        int piezasOriginales, int piezasSurtidas,
+                        const std::string& loteRequerido, const std::string& loteConfirmado,
+                        const std::string& motivo) {
+    MEDIR_ETAPA(ETAPA_BACKORDER);
+    std::ostringstream registro;
+    if (formatoBackorder == FormatoDiario::CSV) {
+        registro << sku << "," << loteRequerido << "," << loteConfirmado << "," << ordenDeVenta << ","
+                 << destino << "," << piezasOriginales << "," << piezasSurtidas << "," << motivo << "\n";
+    } else {
+        registro << "{\"sku\":\"" << escaparJSON(sku) << "\",\"loteRequerido\":\"" << escaparJSON(loteRequerido)
+                 << "\",\"loteConfirmado\":\"" << escaparJSON(loteConfirmado) << "\",\"ov\":" << ordenDeVenta
+                 << ",\"destino\":" << destino << ",\"piezasRequeridas\":" << piezasOriginales
+                 << ",\"cantidadSurtida\":" << piezasSurtidas << ",\"motivo\":\"" << escaparJSON(motivo) << "\"}\n";
+    }
+    escribirEnDiario(diario, registro.str());
+}
+
+// --- CARGA DE CSV ---
+// El archivo se lee de una sola vez y se recorre con std::string_view: ningun campo se copia
+// hasta materializar las entradas. Las columnas se ubican por nombre de encabezado, asi que
+// exportaciones del ERP con columnas extra o en otro orden cargan igual.
+#define CSV_BLOQUE_MINIMO (4u << 20) // Por debajo de 4 MB no vale la pena repartir en hilos
+#define CSV_MAX_RECHAZOS_MOSTRADOS 20
+
+struct FilaCSV {
+    std::string_view sku;
+    std::string_view lote;
+    int orden;
+    int piezas;
+};
+
+struct RechazoCSV {
+    size_t linea;
+    std::string motivo;
+};
+
+struct ColumnasCSV {
+    int sku = -1, lote = -1, orden = -1, piezas = -1;
+    int caducidad = -1, existencia = -1; // Solo del inventario
+    bool completas() const { return sku >= 0 && lote >= 0 && orden >= 0 && piezas >= 0; }
+    int maxima() const { return std::max(std::max(sku, lote), std::max(orden, piezas)); }
+};
+
+struct ResultadoBloque {
+    std::vector<FilaCSV> filas;
+    std::vector<RechazoCSV> rechazos;      // Lineas relativas al inicio del bloque
+    std::deque<std::string> sinComillas;   // Campos con "" escapadas (raro); las vistas apuntan aqui
+    size_t lineas = 0;
+};
+
+// Minusculas, sin acentos y sin signos: "Nº documento" -> "nodocumento", "O.V." -> "ov".
+// Acepta UTF-8 y Latin-1, que es como suele exportar Excel en Windows.
+std::string normalizarEncabezado(std::string_view texto) {
+    std::string r;
+    for (size_t i = 0; i < texto.size(); ++i) {
+        unsigned char c = texto[i];
+        if (c < 0x80) {
+            if (std::isalnum(c)) r += (char)std::tolower(c);
+            continue;
+        }
+        if ((c == 0xC2 || c == 0xC3) && i + 1 < texto.size()) {
+            c = (unsigned char)((c == 0xC3 ? 0xC0 : 0x80) | ((unsigned char)texto[++i] & 0x3F));
+        }
+        if ((c >= 0xC0 && c <= 0xC5) || (c >= 0xE0 && c <= 0xE5) || c == 0xAA) r += 'a';
+        else if ((c >= 0xC8 && c <= 0xCB) || (c >= 0xE8 && c <= 0xEB)) r += 'e';
+        else if ((c >= 0xCC && c <= 0xCF) || (c >= 0xEC && c <= 0xEF)) r += 'i';
+        else if ((c >= 0xD2 && c <= 0xD6) || (c >= 0xF2 && c <= 0xF6) || c == 0xBA) r += 'o';
+        else if ((c >= 0xD9 && c <= 0xDC) || (c >= 0xF9 && c <= 0xFC)) r += 'u';
+        else if (c == 0xD1 || c == 0xF1) r += 'n';
+        else if (c == 0xC7 || c == 0xE7) r += 'c';
+    }
+    return r;
+}
+
+ColumnasCSV mapearColumnas(const std::vector<std::string_view>& encabezados) {
+    static const std::map<std::string, int ColumnasCSV::*> alias = {
+        {"sku", &ColumnasCSV::sku}, {"codigo", &ColumnasCSV::sku}, {"numero", &ColumnasCSV::sku},
+        {"articulo", &ColumnasCSV::sku}, {"material", &ColumnasCSV::sku},
+        {"lote", &ColumnasCSV::lote}, {"numerodelote", &ColumnasCSV::lote}, {"lot", &ColumnasCSV::lote},
+        {"ov", &ColumnasCSV::orden}, {"ordendeventa", &ColumnasCSV::orden}, {"orden", &ColumnasCSV::orden},
+        {"nodocumento", &ColumnasCSV::orden}, {"documento", &ColumnasCSV::orden}, {"pedido", &ColumnasCSV::orden},
+        {"pza", &ColumnasCSV::piezas}, {"pzas", &ColumnasCSV::piezas}, {"piezas", &ColumnasCSV::piezas},
+        {"cantidad", &ColumnasCSV::piezas}, {"liberado", &ColumnasCSV::piezas},
+        {"caducidad", &ColumnasCSV::caducidad}, {"fechadecaducidad", &ColumnasCSV::caducidad},
+        {"vencimiento", &ColumnasCSV::caducidad}, {"expiracion", &ColumnasCSV::caducidad}, {"expiry", &ColumnasCSV::caducidad},
+        {"existencia", &ColumnasCSV::existencia}, {"existencias", &ColumnasCSV::existencia},
+        {"disponible", &ColumnasCSV::existencia}, {"stock", &ColumnasCSV::existencia}, {"onhand", &ColumnasCSV::existencia}
+    };
+    ColumnasCSV columnas;
+    for (size_t i = 0; i < encabezados.size(); ++i) {
+        auto it = alias.find(normalizarEncabezado(encabezados[i]));
+        if (it != alias.end() && columnas.*(it->second) < 0) columnas.*(it->second) = (int)i;
+    }
+    return columnas;
+}
+
+std::string_view recortar(std::string_view v) {
+    while (!v.empty() && (v.front() == ' ' || v.front() == '\t')) v.remove_prefix(1);
+    while (!v.empty() && (v.back() == ' ' || v.back() == '\t' || v.back() == '\r')) v.remove_suffix(1);
+    return v;
+}
+
+// Separa un registro en campos a partir de 'pos' y deja 'pos' al inicio del siguiente.
+// Soporta campos entre comillas (con comas, saltos de linea y "" escapadas).
+void leerRegistro(std::string_view texto, size_t& pos, std::vector<std::string_view>& campos,
+                  std::deque<std::string>& sinComillas, size_t& lineas) {
+    campos.clear();
+    const size_t n = texto.size();
+    while (true) {
+        size_t inicio = pos;
+        while (pos < n && (texto[pos] == ' ' || texto[pos] == '\t')) ++pos;
+        if (pos < n && texto[pos] == '"') {
+            size_t abre = ++pos;
+            bool escapadas = false;
+            while (pos < n) {
+                if (texto[pos] == '"') {
+                    if (pos + 1 < n && texto[pos + 1] == '"') { escapadas = true; pos += 2; continue; }
+                    break;
+                }
+                if (texto[pos] == '\n') ++lineas;
+                ++pos;
+            }
+            std::string_view valor = texto.substr(abre, pos - abre);
+            if (escapadas) {
+                std::string limpio;
+                for (size_t i = 0; i < valor.size(); ++i) {
+                    limpio += valor[i];
+                    if (valor[i] == '"') ++i;
+                }
+                sinComillas.push_back(std::move(limpio));
+                valor = sinComillas.back();
+            }
+            campos.push_back(valor);
+            if (pos < n) ++pos; // Comilla de cierre
+            while (pos < n && texto[pos] != ',' && texto[pos] != '\n') ++pos;
+        } else {
+            pos = inicio;
+            while (pos < n && texto[pos] != ',' && texto[pos] != '\n') ++pos;
+            campos.push_back(recortar(texto.substr(inicio, pos - inicio)));
+        }
+        if (pos >= n) return;
+        if (texto[pos++] == '\n') { ++lineas; return; }
+    }
+}
+
+bool leerEntero(std::string_view v, int& valor) {
+    v = recortar(v);
+    auto r = std::from_chars(v.data(), v.data() + v.size(), valor);
+    return !v.empty() && r.ec == std::errc() && r.ptr == v.data() + v.size();
+}
+
+void parsearBloque(std::string_view bloque, const ColumnasCSV& columnas, ResultadoBloque& resultado) {
+    std::vector<std::string_view> campos;
+    size_t pos = 0;
+    while (pos < bloque.size()) {
+        size_t linea = resultado.lineas + 1;
+        leerRegistro(bloque, pos, campos, resultado.sinComillas, resultado.lineas);
+
+        bool vacia = true;
+        for (std::string_view c : campos) if (!c.empty()) { vacia = false; break; }
+        if (vacia) continue; // Separadores ",,," que deja el ERP entre pedidos
+
+        if ((int)campos.size() <= columnas.maxima()) {
+            resultado.rechazos.push_back({linea, "faltan columnas (" + std::to_string(campos.size()) + ")"});
+            continue;
+        }
+        FilaCSV fila;
+        fila.sku = campos[columnas.sku];
+        fila.lote = recortar(campos[columnas.lote]);
+        // Igual que al escanear: el lote termina en el primer espacio
+        size_t posEspacio = fila.lote.find(' ');
+        if (posEspacio != std::string_view::npos) fila.lote = fila.lote.substr(0, posEspacio);
+        if (fila.sku.empty()) { resultado.rechazos.push_back({linea, "SKU vacio"}); continue; }
+        if (!leerEntero(campos[columnas.orden], fila.orden)) {
+            resultado.rechazos.push_back({linea, "OV invalida '" + std::string(campos[columnas.orden]) + "'"});
+            continue;
+        }
+        if (!leerEntero(campos[columnas.piezas], fila.piezas) || fila.piezas <= 0) {
+            resultado.rechazos.push_back({linea, "cantidad invalida '" + std::string(campos[columnas.piezas]) + "'"});
+            continue;
+        }
+        resultado.filas.push_back(fila);
+    }
+}
+
+bool leerArchivoCompleto(const std::string& archivo, std::string& contenido) {
+    std::ifstream file(archivo, std::ios::binary);
+    if (!file.is_open()) return false;
+    file.seekg(0, std::ios::end);
+    contenido.resize((size_t)file.tellg());
+    file.seekg(0, std::ios::beg);
+    file.read(&contenido[0], contenido.size());
+    return (bool)file;
+}
+
+// Lee el encabezado y deja 'texto' al inicio de la primera linea de datos.
+ColumnasCSV leerEncabezadoCSV(std::string_view& texto, size_t& lineasEncabezado) {
+    if (texto.substr(0, 3) == "\xEF\xBB\xBF") texto.remove_prefix(3); // BOM de Excel
+    std::vector<std::string_view> encabezados;
+    std::deque<std::string> encabezadosSinComillas;
+    size_t pos = 0;
+    leerRegistro(texto, pos, encabezados, encabezadosSinComillas, lineasEncabezado);
+    ColumnasCSV columnas = mapearColumnas(encabezados);
+    if (!columnas.completas()) {
+        std::cout << "AVISO: Encabezado no reconocido; se usan las columnas SKU,Lote,OV,Piezas por posicion." << std::endl;
+        columnas = ColumnasCSV{0, 1, 2, 3};
+    }
+    texto.remove_prefix(pos);
+    return columnas;
+}
+
+// Bloques cortados en saltos de linea; con comillas en el archivo un salto puede caer
+// dentro de un campo, asi que en ese caso se parsea en un solo bloque.
+std::vector<ResultadoBloque> parsearEnBloques(std::string_view texto, const ColumnasCSV& columnas) {
+    unsigned hilos = std::max(1u, std::thread::hardware_concurrency());
+    if (texto.size() < 2 * CSV_BLOQUE_MINIMO || texto.find('"') != std::string_view::npos) hilos = 1;
+    hilos = std::min<unsigned>(hilos, (unsigned)(texto.size() / CSV_BLOQUE_MINIMO) + 1);
+    std::vector<std::string_view> bloques;
+    size_t desde = 0;
+    for (unsigned i = 1; i <= hilos && desde < texto.size(); ++i) {
+        size_t hasta = (i == hilos) ? texto.size() : texto.find('\n', texto.size() * i / hilos);
+        hasta = (hasta == std::string_view::npos) ? texto.size() : std::min(hasta + 1, texto.size());
+        if (hasta <= desde) continue;
+        bloques.push_back(texto.substr(desde, hasta - desde));
+        desde = hasta;
+    }
+    std::vector<ResultadoBloque> resultados(bloques.size());
+    std::vector<std::thread> trabajadores;
+    for (size_t i = 1; i < bloques.size(); ++i) {
+        trabajadores.emplace_back(parsearBloque, bloques[i], std::cref(columnas), std::ref(resultados[i]));
+    }
+    if (!bloques.empty()) parsearBloque(bloques[0], columnas, resultados[0]);
+    for (std::thread& t : trabajadores) t.join();
+    return resultados;
+}
+
+// Muestra los primeros rechazos con su linea en el archivo ('lineaBase' = primera linea del
+// texto parseado) y devuelve cuantos hubo.
+size_t reportarRechazos(std::vector<ResultadoBloque>& resultados, size_t lineaBase) {
+    std::vector<RechazoCSV> rechazos;
+    for (ResultadoBloque& r : resultados) {
+        for (RechazoCSV& rechazo : r.rechazos) {
+            rechazo.linea += lineaBase - 1;
+            rechazos.push_back(std::move(rechazo));
+        }
+        lineaBase += r.lineas;
+    }
+    for (size_t i = 0; i < rechazos.size() && i < CSV_MAX_RECHAZOS_MOSTRADOS; ++i) {
+        std::cerr << "  Linea " << rechazos[i].linea << " rechazada: " << rechazos[i].motivo << std::endl;
+    }
+    if (rechazos.size() > CSV_MAX_RECHAZOS_MOSTRADOS) {
+        std::cerr << "  ... y " << (rechazos.size() - CSV_MAX_RECHAZOS_MOSTRADOS) << " lineas rechazadas mas." << std::endl;
+    }
+    return rechazos.size();
+}
+
+DatosCargados cargarProductosDesdeCSV(const std::string& archivo) {
+    DatosCargados datos;
+    auto inicio = std::chrono::steady_clock::now();
+    std::string contenido;
+
+    if (!leerArchivoCompleto(archivo, contenido)) {
+        std::cerr << "ERROR: No se pudo abrir el archivo CSV." << std::endl;
+        return datos;
+    }
+    std::string_view texto = contenido;
+    size_t lineasEncabezado = 0;
+    ColumnasCSV columnas = leerEncabezadoCSV(texto, lineasEncabezado);
+    std::vector<ResultadoBloque> resultados = parsearEnBloques(texto, columnas);
+
+    // Las OV reciben destino en orden de aparicion, igual que antes
+    std::unordered_map<int, int> asignacionDestinos;
+    std::vector<uint32_t> grupoDeEntrada;
+    size_t totalFilas = 0;
+    for (const ResultadoBloque& r : resultados) totalFilas += r.filas.size();
+    datos.entradas.reserve(totalFilas);
+    grupoDeEntrada.reserve(totalFilas);
+    int siguienteDestinoDisponible = 1;
+
+    for (const ResultadoBloque& r : resultados) {
+        for (const FilaCSV& fila : r.filas) {
+            auto it = asignacionDestinos.find(fila.orden);
+            if (it == asignacionDestinos.end()) it = asignacionDestinos.emplace(fila.orden, siguienteDestinoDisponible++).first;
+            uint32_t g = obtenerGrupo(datos, fila.sku, fila.lote);
+            grupoDeEntrada.push_back(g);
+            datos.entradas.push_back({datos.grupos[g].sku, datos.grupos[g].lote, fila.orden, fila.piezas, it->second, false});
+        }
+    }
+    size_t rechazadas = reportarRechazos(resultados, 1 + lineasEncabezado);
+
+    construirIndice(datos, grupoDeEntrada);
+
+    if (datos.entradas.empty()) {
+        std::cerr << "ERROR: CSV invalido." << std::endl;
+    } else {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - inicio).count();
+        std::cout << "Carga exitosa. Lineas: " << totalFilas << ", rechazadas: " << rechazadas
+                  << ", destinos asignados: " << (siguienteDestinoDisponible - 1) << " (" << ms << " ms)" << std::endl;
+        datos.cargadoExitosamente = true;
+    }
+    return datos;
+}
+
+std::string generarNombreArchivo() {
+    auto now = std::chrono::system_clock::now();
+    std::time_t now_c = std::chrono::system_clock::to_time_t(now);
+    std::tm* time_info = std::localtime(&now_c);
+    std::ostringstream oss;
+    oss << "backorders_" << std::put_time(time_info, "%Y-%m-%d_%H-%M-%S")
+        << (formatoBackorder == FormatoDiario::JSONL ? ".jsonl" : ".csv");
+    return oss.str();
+}
+
+// --- SESION: SNAPSHOT + BITACORA (WAL) ---
+// Cada cambio de estado de un destino (encendido, ajustado, confirmado, cancelado) se agrega a
+// la bitacora, y entre escaneos, cada SNAPSHOT_CADA registros, se guarda una foto binaria de
+// todas las lineas. Al arrancar se carga la foto, se reaplican los registros con LSN posterior
+// y se vuelve a encender lo que estaba activo.
+#define ARCHIVO_SNAPSHOT "sesion_ptl.snap"
+#define ARCHIVO_WAL "sesion_ptl.wal"
+#define SNAPSHOT_CADA 500
+#define WAL_ENCABEZADO 16 // "PTLWAL01" + id de sesion
+#define WAL_REGISTRO 27   // lsn(8) grupo(4) indice(4) destino(4) cantidad(4) tipo(1) crc(2)
+
+enum TipoWAL : uint8_t { WAL_ENCENDIDO = 1, WAL_AJUSTADO = 2, WAL_CONFIRMADO = 3, WAL_CANCELADO = 4 };
+
+// Destinos encendidos: grupo -> (indice del destino -> cantidad en el modulo)
+using DestinosActivos = std::map<uint32_t, std::map<uint32_t, int>>;
+
+// siguienteLSN y activos se protegen con mutexDatos; mutexSnapshot serializa a quien guarda la foto.
+struct SesionPTL {
+    uint64_t id = 0;                    // Liga la bitacora con su foto
+    uint64_t siguienteLSN = 1;
+    std::atomic<uint64_t> registrosDesdeSnapshot{0};
+    DestinosActivos activos;            // Lo encendido en todas las estaciones, va en la foto
+    std::mutex mutexSnapshot;
+    std::thread hiloSnapshot;
+};
+
+SesionPTL sesion;
+
+void reiniciarSesion() {
+    sesion.id = 0;
+    sesion.siguienteLSN = 1;
+    sesion.registrosDesdeSnapshot = 0;
+    sesion.activos.clear();
+}
+
+void aplicarEnActivos(DestinosActivos& activos, uint8_t tipo, const RefDestino& ref, int cantidad) {
+    if (tipo == WAL_ENCENDIDO || tipo == WAL_AJUSTADO) {
+        activos[ref.grupo][ref.indice] = cantidad;
+        return;
+    }
+    auto it = activos.find(ref.grupo);
+    if (it == activos.end()) return;
+    it->second.erase(ref.indice);
+    if (it->second.empty()) activos.erase(it);
+}
+
+void agregarLE(std::string& s, uint64_t valor, int bytes) {
+    for (int i = 0; i < bytes; ++i) s.push_back((char)((valor >> (8 * i)) & 0xFF));
+}
+
+uint64_t leerLE(const std::string& s, size_t pos, int bytes) {
+    uint64_t valor = 0;
+    for (int i = 0; i < bytes; ++i) valor |= (uint64_t)(uint8_t)s[pos + i] << (8 * i);
+    return valor;
+}
+
+void agregarTextoLE(std::string& s, const std::string& texto) {
+    agregarLE(s, texto.size(), 4);
+    s += texto;
+}
+
+uint64_t fnv1a(const char* datos, size_t n) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < n; ++i) { h ^= (uint8_t)datos[i]; h *= 0x100000001B3ull; }
+    return h;
+}
+
+// Lectura con limites: cualquier desbordamiento deja ok en false y devuelve ceros.
+struct LectorBinario {
+    const std::string& datos;
+    size_t pos;
+    bool ok = true;
+
+    uint64_t entero(int bytes) {
+        if (!ok || pos + bytes > datos.size()) { ok = false; return 0; }
+        pos += bytes;
+        return leerLE(datos, pos - bytes, bytes);
+    }
+    std::string texto() {
+        size_t n = (size_t)entero(4);
+        if (!ok || pos + n > datos.size()) { ok = false; return ""; }
+        pos += n;
+        return datos.substr(pos - n, n);
+    }
+};
+
+std::string encabezadoWAL() {
+    std::string e = "PTLWAL01";
+    agregarLE(e, sesion.id, 8);
+    return e;
+}
+
+// Encola el registro y devuelve su turno; quien registra llama a esperarWAL antes de que el
+// rack o las demas estaciones actuen sobre ese destino.
+uint64_t registrarWAL(TipoWAL tipo, const RefDestino& ref, int destino, int cantidad) {
+    std::lock_guard<std::mutex> lock(mutexDatos);
+    aplicarEnActivos(sesion.activos, tipo, ref, cantidad);
+    std::string r;
+    agregarLE(r, sesion.siguienteLSN++, 8);
+    agregarLE(r, ref.grupo, 4);
+    agregarLE(r, ref.indice, 4);
+    agregarLE(r, (uint32_t)destino, 4);
+    agregarLE(r, (uint32_t)cantidad, 4);
+    r.push_back((char)tipo);
+    agregarLE(r, crc16((const uint8_t*)r.data(), r.size()), 2);
+    sesion.registrosDesdeSnapshot++;
+    return escribirEnDiario(diarioWAL, std::move(r));
+}
+
+void esperarWAL(uint64_t turno) {
+    esperarDiario(diarioWAL, turno);
+}
+
+// Foto: textos internados, grupos como pares de ids y entradas en orden del archivo.
+// Las entradas se reagrupan al cargar con construirIndice, que da los mismos indices.
+// Al final van los destinos encendidos en ese momento, que la bitacora ya no repetira, y el
+// modulo de cada OV.
+std::string serializarSnapshot(const DatosCargados& d) {
+    std::lock_guard<std::mutex> lock(mutexDatos);
+    std::string s = "PTLSNAP3";
+    agregarLE(s, sesion.id, 8);
+    agregarLE(s, sesion.siguienteLSN - 1, 8);
+    agregarTextoLE(s, archivoCSVGlobal);
+    agregarTextoLE(s, nombreArchivoBackorder);
+    agregarLE(s, d.textos.size(), 4);
+    for (const std::string& t : d.textos) agregarTextoLE(s, t);
+    agregarLE(s, d.grupos.size(), 4);
+    std::vector<uint32_t> grupoDeEntrada(d.entradas.size());
+    for (uint32_t g = 0; g < d.grupos.size(); ++g) {
+        agregarLE(s, d.grupos[g].sku, 4);
+        agregarLE(s, d.grupos[g].lote, 4);
+        for (const DestinoGrupo& dg : d.grupos[g].destinos) {
+            for (uint32_t k = 0; k < dg.numEntradas; ++k) grupoDeEntrada[d.entradasPorDestino[dg.primeraEntrada + k]] = g;
+        }
+    }
+    agregarLE(s, d.entradas.size(), 4);
+    s.reserve(s.size() + d.entradas.size() * 17 + 8);
+    for (size_t i = 0; i < d.entradas.size(); ++i) {
+        const EntradaProducto& e = d.entradas[i];
+        agregarLE(s, grupoDeEntrada[i], 4);
+        agregarLE(s, (uint32_t)e.ordenDeVenta, 4);
+        agregarLE(s, (uint32_t)e.piezas, 4);
+        agregarLE(s, (uint32_t)e.destino, 4);
+        s.push_back(e.yaSurtido ? 1 : 0);
+    }
+    agregarLE(s, sesion.activos.size(), 4);
+    for (const auto& grupo : sesion.activos) {
+        agregarLE(s, grupo.first, 4);
+        agregarLE(s, grupo.second.size(), 4);
+        for (const auto& par : grupo.second) { agregarLE(s, par.first, 4); agregarLE(s, (uint32_t)par.second, 4); }
+    }
+    agregarLE(s, (uint32_t)d.modulos.capacidad, 4);
+    agregarLE(s, (uint32_t)d.modulos.siguienteEnEspera, 4);
+    agregarLE(s, d.modulos.moduloPorDestino.size(), 4);
+    for (int modulo : d.modulos.moduloPorDestino) agregarLE(s, (uint32_t)modulo, 4);
+    agregarLE(s, fnv1a(s.data(), s.size()), 8);
+    return s;
+}
+
+// Reemplaza 'destino' por 'temporal' en un solo paso; con 'sincronizar' el cambio de nombre
+// tambien llega al disco antes de volver.
+void reemplazarArchivo(const std::string& temporal, const std::string& destino, bool sincronizar = false) {
+#ifdef _WIN32
+    MoveFileExA(temporal.c_str(), destino.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    (void)sincronizar;
+#else
+    if (std::rename(temporal.c_str(), destino.c_str()) == 0 && sincronizar) sincronizarCarpeta(destino);
+#endif
+}
+
+// Se escribe a un temporal y se renombra: una foto a medias nunca reemplaza a la anterior.
+void escribirSnapshot(std::string contenido) {
+    std::string temporal = std::string(ARCHIVO_SNAPSHOT) + ".tmp";
+    std::FILE* f = std::fopen(temporal.c_str(), "wb");
+    if (!f) return;
+    bool ok = std::fwrite(contenido.data(), 1, contenido.size(), f) == contenido.size() && std::fflush(f) == 0;
+    if (ok && diarioWAL.durabilidad == Durabilidad::DISCO) sincronizarADisco(f);
+    std::fclose(f);
+    if (!ok) { std::remove(temporal.c_str()); return; }
+    reemplazarArchivo(temporal, ARCHIVO_SNAPSHOT, diarioWAL.durabilidad == Durabilidad::DISCO);
+}
+
+// Serializa bajo mutexDatos (las estaciones solo esperan eso) y escribe en segundo plano.
+void guardarSnapshot(const DatosCargados& d) {
+    std::lock_guard<std::mutex> lock(sesion.mutexSnapshot);
+    if (sesion.hiloSnapshot.joinable()) sesion.hiloSnapshot.join();
+    sesion.registrosDesdeSnapshot = 0;
+    sesion.hiloSnapshot = std::thread(escribirSnapshot, serializarSnapshot(d));
+}
+
+void esperarSnapshot() {
+    std::lock_guard<std::mutex> lock(sesion.mutexSnapshot);
+    if (sesion.hiloSnapshot.joinable()) sesion.hiloSnapshot.join();
+}
+
+// Sesion nueva tras cargar un CSV: id nuevo, bitacora vacia y foto inicial.
+void iniciarSesion(const DatosCargados& d) {
+    sesion.id = (uint64_t)std::chrono::system_clock::now().time_since_epoch().count() | 1;
+    sesion.siguienteLSN = 1;
+    iniciarDiario(diarioWAL, ARCHIVO_WAL, encabezadoWAL(), true, 0);
+    guardarSnapshot(d);
+}
+
+// Ola completa: sin foto ni bitacora el siguiente arranque pide un CSV nuevo.
+void cerrarSesion() {
+    std::error_code ec;
+    std::filesystem::remove(ARCHIVO_SNAPSHOT, ec);
+    std::filesystem::remove(ARCHIVO_WAL, ec);
+}
+
+// 'archivoCSV' y 'archivoBackorder' solo se tocan si la foto es valida completa.
+bool cargarSnapshot(DatosCargados& d, uint64_t& lsnSnapshot, DestinosActivos& activos,
+                    std::string& archivoCSV, std::string& archivoBackorder) {
+    std::string contenido;
+    if (!leerArchivoCompleto(ARCHIVO_SNAPSHOT, contenido)) return false;
+    // PTLSNAP2 es de antes de reciclar modulos: un modulo por OV
+    bool conModulos = contenido.compare(0, 8, "PTLSNAP3") == 0;
+    if (contenido.size() < 16 || (!conModulos && contenido.compare(0, 8, "PTLSNAP2") != 0) ||
+        leerLE(contenido, contenido.size() - 8, 8) != fnv1a(contenido.data(), contenido.size() - 8)) {
+        std::cerr << "AVISO: " << ARCHIVO_SNAPSHOT << " esta danado; se ignora." << std::endl;
+        return false;
+    }
+    LectorBinario l{contenido, 8};
+    sesion.id = l.entero(8);
+    lsnSnapshot = l.entero(8);
+    std::string csv = l.texto();
+    std::string backorder = l.texto();
+
+    uint32_t numTextos = (uint32_t)l.entero(4);
+    for (uint32_t i = 0; i < numTextos && l.ok; ++i) internarTexto(d, l.texto());
+    // Los grupos de la foto ya son unicos: se insertan sin buscarlos
+    uint32_t numGrupos = (uint32_t)l.entero(4);
+    d.grupos.reserve(std::min<size_t>(numGrupos, contenido.size() / 8));
+    for (uint32_t g = 0; g < numGrupos && l.ok; ++g) {
+        uint32_t sku = (uint32_t)l.entero(4), lote = (uint32_t)l.entero(4);
+        if (sku >= d.textos.size() || lote >= d.textos.size()) return false;
+        d.grupos.push_back({sku, lote, {}, 0});
+        d.gruposPorSKU[sku].push_back(g);
+        d.grupoPorClave.insertar(hashSKULote(d.textos[sku], d.textos[lote]), g);
+    }
+    uint32_t numEntradas = (uint32_t)l.entero(4);
+    std::vector<uint32_t> grupoDeEntrada;
+    d.entradas.reserve(std::min<size_t>(numEntradas, contenido.size() / 17));
+    grupoDeEntrada.reserve(d.entradas.capacity());
+    for (uint32_t i = 0; i < numEntradas && l.ok; ++i) {
+        uint32_t g = (uint32_t)l.entero(4);
+        int ov = (int)(uint32_t)l.entero(4), piezas = (int)(uint32_t)l.entero(4), destino = (int)(uint32_t)l.entero(4);
+        bool surtido = l.entero(1) != 0;
+        if (!l.ok || g >= d.grupos.size() || destino < 0) return false;
+        d.entradas.push_back({d.grupos[g].sku, d.grupos[g].lote, ov, piezas, destino, surtido});
+        grupoDeEntrada.push_back(g);
+    }
+    uint32_t numActivos = (uint32_t)l.entero(4);
+    for (uint32_t a = 0; a < numActivos && l.ok; ++a) {
+        uint32_t g = (uint32_t)l.entero(4), n = (uint32_t)l.entero(4);
+        for (uint32_t k = 0; k < n && l.ok; ++k) {
+            uint32_t indice = (uint32_t)l.entero(4);
+            activos[g][indice] = (int)(uint32_t)l.entero(4);
+        }
+        if (g >= d.grupos.size()) return false;
+    }
+    if (conModulos) {
+        d.modulos.capacidad = (int)(uint32_t)l.entero(4);
+        d.modulos.siguienteEnEspera = (int)(uint32_t)l.entero(4);
+        uint32_t numDestinos = (uint32_t)l.entero(4);
+        if (!l.ok || numDestinos > contenido.size() / 4) return false;
+        for (uint32_t i = 0; i < numDestinos && l.ok; ++i) d.modulos.moduloPorDestino.push_back((int)(uint32_t)l.entero(4));
+    }
+    if (!l.ok || d.entradas.empty()) return false;
+
+    construirIndice(d, grupoDeEntrada);
+    for (uint32_t g = 0; g < d.grupos.size(); ++g) {
+        for (uint32_t i = 0; i < d.grupos[g].destinos.size(); ++i) {
+            const DestinoGrupo& dg = d.grupos[g].destinos[i];
+            if (d.entradas[d.entradasPorDestino[dg.primeraEntrada]].yaSurtido) marcarSurtido(d, {g, i});
+        }
+    }
+    if (conModulos) reconstruirAsignador(d);
+    else iniciarAsignador(d, 0);
+    d.cargadoExitosamente = true;
+    archivoCSV = csv;
+    archivoBackorder = backorder;
+    return true;
+}
+
+// Reaplica los registros posteriores a la foto. Devuelve cuantos bytes de la bitacora son
+// validos: 0 si es de otra sesion, y si la ultima escritura quedo a medias, hasta antes de ella.
+size_t reaplicarWAL(DatosCargados& d, uint64_t lsnSnapshot, DestinosActivos& activos, size_t& reaplicados) {
+    std::string contenido;
+    if (!leerArchivoCompleto(ARCHIVO_WAL, contenido) || contenido.compare(0, WAL_ENCABEZADO, encabezadoWAL()) != 0) return 0;
+    size_t pos = WAL_ENCABEZADO;
+    for (; pos + WAL_REGISTRO <= contenido.size(); pos += WAL_REGISTRO) {
+        if (crc16((const uint8_t*)contenido.data() + pos, WAL_REGISTRO - 2) != leerLE(contenido, pos + WAL_REGISTRO - 2, 2)) break;
+        uint64_t lsn = leerLE(contenido, pos, 8);
+        RefDestino ref{(uint32_t)leerLE(contenido, pos + 8, 4), (uint32_t)leerLE(contenido, pos + 12, 4)};
+        int cantidad = (int)(uint32_t)leerLE(contenido, pos + 20, 4);
+        uint8_t tipo = (uint8_t)contenido[pos + 24];
+        sesion.siguienteLSN = std::max(sesion.siguienteLSN, lsn + 1);
+        // Lineas de una carga adicional cuya foto no alcanzo a escribirse: no hay a que aplicarlo
+        if (ref.grupo >= d.grupos.size() || ref.indice >= d.grupos[ref.grupo].destinos.size()) continue;
+        if (lsn <= lsnSnapshot) continue;
+
+        if (tipo == WAL_CONFIRMADO) marcarSurtido(d, ref);
+        aplicarEnActivos(activos, tipo, ref, cantidad);
+        reaplicados++;
+    }
+    return pos;
+}
+
+// Ofrece continuar la sesion anterior si hay foto. Si el operador acepta deja 'datos' y los
+// diarios listos, y en 'activos' lo que hay que volver a encender.
+bool reanudarSesion(DestinosActivos& activos) {
+    auto inicio = std::chrono::steady_clock::now();
+    DatosCargados anterior;
+    uint64_t lsnSnapshot = 0;
+    std::string csvAnterior, backorderAnterior;
+    if (!cargarSnapshot(anterior, lsnSnapshot, activos, csvAnterior, backorderAnterior)) { activos.clear(); reiniciarSesion(); return false; }
+    sesion.siguienteLSN = lsnSnapshot + 1;
+    size_t reaplicados = 0;
+    size_t validos = reaplicarWAL(anterior, lsnSnapshot, activos, reaplicados);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - inicio).count();
+
+    size_t destinos = 0, surtidos = 0, encendidos = 0;
+    for (const GrupoLote& g : anterior.grupos) { destinos += g.destinos.size(); surtidos += g.destinos.size() - g.pendientes; }
+    for (const auto& par : activos) encendidos += par.second.size();
+    std::cout << "\nSesion anterior: " << csvAnterior << " | " << surtidos << "/" << destinos << " surtidos, "
+              << encendidos << " encendidos, " << reaplicados << " registros reaplicados (" << ms << " ms)" << std::endl;
+    std::string respuesta;
+    while (respuesta != "s" && respuesta != "n") {
+        std::cout << "¿Reanudar sesion? (s/n): ";
+        if (!std::getline(std::cin, respuesta)) respuesta = "n";
+        respuesta = trim(respuesta);
+        std::transform(respuesta.begin(), respuesta.end(), respuesta.begin(), ::tolower);
+    }
+    if (respuesta == "n") { activos.clear(); reiniciarSesion(); return false; }
+
+    datos = std::move(anterior);
+    sesion.activos = activos;
+    archivoCSVGlobal = csvAnterior;
+    nombreArchivoBackorder = backorderAnterior;
+    std::error_code ec;
+    if (validos > 0 && std::filesystem::exists(ARCHIVO_WAL, ec) && validos < std::filesystem::file_size(ARCHIVO_WAL, ec)) {
+        std::filesystem::resize_file(ARCHIVO_WAL, validos, ec); // Quita la escritura interrumpida
+    }
+    iniciarDiario(diarioWAL, ARCHIVO_WAL, encabezadoWAL(), validos == 0, 0);
+    iniciarDiarioBackorder(nombreArchivoBackorder);
+    std::cout << "Backorders: " << nombreArchivoBackorder << std::endl;
+    return true;
+}
+
+// --- SECUENCIA DE SURTIDO ---
+// Orden sugerido de escaneos (SKU, lote). Es voraz: simula la sesion con su propia copia del
+// asignador de modulos y en cada paso escoge el grupo con mas puntos, donde cada destino que
+// se puede encender vale 1 y ademas pesoCierre / (destinos que le faltan a su OV). Con peso 0
+// solo cuenta el abanico; con peso alto se cierran OV primero y se liberan sus modulos antes.
+// Un grupo con OV en espera vuelve a salir cuando reciben modulo. Los puntos se guardan en un
+// monticulo perezoso y solo se recalculan los grupos de las OV que cambiaron; en una OV grande
+// eso se hace cada vez que sus pendientes bajan un cuarto (o quedan pocas), no en cada escaneo.
+struct PasoSecuencia {
+    uint32_t grupo;
+    int destinos;            // Destinos que enciende este escaneo
+    int piezas;
+    size_t destinosAcumulados;
+    size_t ordenesCompletas; // OV completas al terminar este escaneo
+};
+
+struct SecuenciaPTL {
+    std::vector<PasoSecuencia> pasos;
+    size_t siguiente = 0;    // Primer paso que aun tiene algo que encender (con mutexDatos)
+    size_t destinosTotales = 0, ordenesTotales = 0;
+};
+
+SecuenciaPTL secuencia;
+double pesoCierre = 5.0;          // --peso-cierre=W
+std::string archivoSecuencia;     // --secuencia=lista.csv
+
+SecuenciaPTL planificarSecuencia(const DatosCargados& d, double peso) {
+    SecuenciaPTL s;
+    AsignadorModulos a = d.modulos;
+    std::vector<uint32_t> base(d.grupos.size() + 1, 0);  // Destinos de grupo aplanados
+    for (size_t g = 0; g < d.grupos.size(); ++g) base[g + 1] = base[g] + (uint32_t)d.grupos[g].destinos.size();
+    std::vector<char> pendiente(base.back(), 0);
+    std::vector<std::vector<uint32_t>> porOrden(a.lineasPendientes.size());
+    std::vector<uint32_t> grupoDe(base.back());
+    for (uint32_t g = 0; g < d.grupos.size(); ++g) {
+        for (uint32_t i = 0; i < d.grupos[g].destinos.size(); ++i) {
+            const DestinoGrupo& dg = d.grupos[g].destinos[i];
+            grupoDe[base[g] + i] = g;
+            if (dg.surtido) continue;
+            pendiente[base[g] + i] = 1;
+            porOrden[dg.destino].push_back(base[g] + i);
+            s.destinosTotales++;
+        }
+    }
+    for (int restantes : a.lineasPendientes) if (restantes > 0) s.ordenesTotales++;
+
+    auto puntos = [&](uint32_t g) {
+        double p = 0;
+        for (uint32_t i = 0; i < d.grupos[g].destinos.size(); ++i) {
+            int o = d.grupos[g].destinos[i].destino;
+            if (pendiente[base[g] + i] && a.moduloPorDestino[o] != 0) p += 1.0 + peso / a.lineasPendientes[o];
+        }
+        return p;
+    };
+    std::vector<uint32_t> version(d.grupos.size(), 0);
+    using Entrada = std::tuple<double, int64_t, uint32_t>; // puntos, -grupo (empate: orden del archivo), version
+    std::vector<Entrada> monticulo; // push_heap/pop_heap en vez de priority_queue para poder compactarlo
+    for (uint32_t g = 0; g < d.grupos.size(); ++g) {
+        double p = puntos(g);
+        if (p > 0) monticulo.emplace_back(p, -(int64_t)g, 0);
+    }
+    std::make_heap(monticulo.begin(), monticulo.end());
+    std::vector<int> recalculadaCon = a.lineasPendientes; // Pendientes de la OV al recalcular sus grupos
+
+    std::vector<uint32_t> marca(d.grupos.size(), 0);
+    std::vector<uint32_t> tocados;
+    std::vector<int> ordenes;
+    size_t destinosAcumulados = 0, completas = 0;
+    while (!monticulo.empty()) {
+        std::pop_heap(monticulo.begin(), monticulo.end());
+        auto [p, menosGrupo, ver] = monticulo.back();
+        monticulo.pop_back();
+        uint32_t g = (uint32_t)-menosGrupo;
+        if (ver != version[g]) continue;
+
+        PasoSecuencia paso{g, 0, 0, 0, 0};
+        ordenes.clear();
+        for (uint32_t i = 0; i < d.grupos[g].destinos.size(); ++i) {
+            const DestinoGrupo& dg = d.grupos[g].destinos[i];
+            if (!pendiente[base[g] + i] || a.moduloPorDestino[dg.destino] == 0) continue;
+            pendiente[base[g] + i] = 0;
+            paso.destinos++;
+            paso.piezas += dg.piezas;
+            ordenes.push_back(dg.destino);
+        }
+        // Mismo criterio que marcarSurtido: la OV completa suelta su modulo y entra la siguiente
+        tocados.assign(1, g);
+        marca[g] = (uint32_t)s.pasos.size() + 1;
+        auto tocarOrden = [&](int o) {
+            std::vector<uint32_t>& fs = porOrden[o];
+            fs.erase(std::remove_if(fs.begin(), fs.end(), [&](uint32_t f) { return !pendiente[f]; }), fs.end());
+            for (uint32_t f : fs) {
+                if (marca[grupoDe[f]] != s.pasos.size() + 1) { marca[grupoDe[f]] = (uint32_t)s.pasos.size() + 1; tocados.push_back(grupoDe[f]); }
+            }
+            recalculadaCon[o] = a.lineasPendientes[o];
+        };
+        for (int o : ordenes) {
+            if (--a.lineasPendientes[o] > 0) {
+                int l = a.lineasPendientes[o];
+                if (peso > 0 && (l <= 16 || 4 * l <= 3 * recalculadaCon[o])) tocarOrden(o);
+                continue;
+            }
+            completas++;
+            int modulo = a.moduloPorDestino[o];
+            a.moduloPorDestino[o] = 0;
+            a.destinoPorModulo[modulo] = 0;
+            a.libres.push(modulo);
+            int antes = a.siguienteEnEspera;
+            asignarEnEspera(a);
+            for (int nueva = antes; nueva < a.siguienteEnEspera; ++nueva) if (a.moduloPorDestino[nueva] != 0) tocarOrden(nueva);
+        }
+        for (uint32_t t : tocados) {
+            version[t]++;
+            double nuevo = puntos(t);
+            if (nuevo <= 0) continue;
+            monticulo.emplace_back(nuevo, -(int64_t)t, version[t]);
+            std::push_heap(monticulo.begin(), monticulo.end());
+        }
+        if (monticulo.size() > 2 * d.grupos.size() + 1024) { // Casi todo son entradas viejas
+            monticulo.erase(std::remove_if(monticulo.begin(), monticulo.end(),
+                                           [&](const Entrada& e) { return std::get<2>(e) != version[(uint32_t)-std::get<1>(e)]; }),
+                            monticulo.end());
+            std::make_heap(monticulo.begin(), monticulo.end());
+        }
+        destinosAcumulados += paso.destinos;
+        paso.destinosAcumulados = destinosAcumulados;
+        paso.ordenesCompletas = completas;
+        s.pasos.push_back(paso);
+    }
+    return s;
+}
+
+// Curva esperada (cuanto queda surtido y cuantas OV cerradas al avanzar los escaneos) y,
+// si se pidio, la lista completa en CSV.
+void reportarSecuencia(const DatosCargados& d, const SecuenciaPTL& s, long long ms, bool conCurva = true) {
+    std::cout << "Secuencia sugerida: " << s.pasos.size() << " escaneos para " << s.destinosTotales << " destinos de "
+              << s.ordenesTotales << " OV (peso de cierre " << pesoCierre << ", " << ms << " ms)" << std::endl;
+    if (s.pasos.empty() || s.destinosTotales == 0) return;
+    if (conCurva) std::cout << "  Escaneos  Destinos  OV completas" << std::endl;
+    for (int decil = 1; decil <= 10 && conCurva; ++decil) {
+        const PasoSecuencia& p = s.pasos[(s.pasos.size() * decil + 9) / 10 - 1];
+        std::cout << "  " << std::setw(7) << decil * 10 << "%" << std::setw(9) << 100 * p.destinosAcumulados / s.destinosTotales << "%"
+                  << std::setw(13) << (s.ordenesTotales ? 100 * p.ordenesCompletas / s.ordenesTotales : 100) << "%" << std::endl;
+    }
+    if (archivoSecuencia.empty()) return;
+    std::ofstream f(archivoSecuencia);
+    if (!f) { std::cerr << "ERROR: No se pudo escribir " << archivoSecuencia << "." << std::endl; return; }
+    f << "Paso,SKU,Lote,Destinos,Piezas,Destinos acumulados,OV completas\n";
+    for (size_t i = 0; i < s.pasos.size(); ++i) {
+        const PasoSecuencia& p = s.pasos[i];
+        f << i + 1 << "," << d.textos[d.grupos[p.grupo].sku] << "," << d.textos[d.grupos[p.grupo].lote] << "," << p.destinos
+          << "," << p.piezas << "," << p.destinosAcumulados << "," << p.ordenesCompletas << "\n";
+    }
+    std::cout << "Lista de surtido: " << archivoSecuencia << std::endl;
+}
+
+void iniciarSecuencia(const DatosCargados& d) {
+    auto inicio = std::chrono::steady_clock::now();
+    secuencia = planificarSecuencia(d, pesoCierre);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - inicio).count();
+    reportarSecuencia(d, secuencia, ms);
+}
+
+// Siguiente paso del plan que todavia enciende algo. Si el operador se sale del orden el
+// plan no se rehace: se salta lo que ya no tiene destinos pendientes con modulo.
+bool siguienteSugerido(std::string& sku, std::string& lote, size_t& paso, size_t& pasos) {
+    std::lock_guard<std::mutex> lock(mutexDatos);
+    for (; secuencia.siguiente < secuencia.pasos.size(); ++secuencia.siguiente) {
+        const GrupoLote& grupo = datos.grupos[secuencia.pasos[secuencia.siguiente].grupo];
+        bool enciende = false;
+        for (const DestinoGrupo& dg : grupo.destinos) {
+            if (!dg.surtido && moduloDe(datos, dg.destino) != 0) { enciende = true; break; }
+        }
+        if (!enciende) continue;
+        sku = datos.textos[grupo.sku];
+        lote = datos.textos[grupo.lote];
+        paso = secuencia.siguiente;
+        pasos = secuencia.pasos.size();
+        return true;
+    }
+    return false;
+}
+
+// --- DECODIFICACION DE ESCANEOS ---
+// Un escaneo puede traer solo el SKU (y se pide el lote aparte) o SKU y lote juntos. Cada
+// formato (decodificadores[]) propone lecturas sin validar y el indice decide: gana la primera
+// cuyo (SKU, lote) existe. Formatos:
+//   GS1: AI 01 (GTIN-14), 10 (lote) y 17 (caducidad) con FNC1/GS entre campos variables, con o
+//        sin identificador de simbologia (]C1 GS1-128, ]d2 DataMatrix, ]Q3 QR) o en la forma
+//        legible "(01)...(10)...". El GTIN se prueba tal cual y sin ceros a la izquierda.
+//   Separador: "SKU LOTE" con cualquiera de los separadores configurados; se prueba en cada
+//        separador (el SKU puede traerlos) y, como al cargar, el lote termina en su primer espacio.
+//   Largo fijo: los primeros N caracteres son el SKU (--largo-sku=N, apagado por defecto).
+// Todo trabaja con vistas sobre el escaneo: decidir cuesta unas busquedas en tablas hash.
+#define GS1_GS '\x1D'
+#define MAX_LECTURAS_ESCANEO 8
+
+std::string separadoresEscaneo = " |;\t";   // --separadores-escaneo=
+char sustitutoFNC1 = 0;                     // --fnc1=C: el escaner manda C en lugar de GS
+size_t largoSKU = 0;                        // --largo-sku=N
+
+// Lo que un formato saco de un escaneo, aun sin validar contra el indice.
+struct LecturaEscaneo {
+    std::string_view skus[3];               // Un GTIN da varias formas de SKU
+    int numSkus = 0;
+    std::string_view lote;                  // Vacio: el escaneo no traia lote
+};
+
+enum ResultadoEscaneo {
+    ESCANEO_DESCONOCIDO,                    // Ningun SKU conocido
+    ESCANEO_SOLO_SKU,                       // SKU valido sin lote: flujo de dos escaneos
+    ESCANEO_LOTE_INVALIDO,                  // SKU valido con un lote que no es suyo
+    ESCANEO_COMPLETO                        // (SKU, lote) existe: un solo escaneo
+};
+
+struct EscaneoDecodificado {
+    ResultadoEscaneo resultado = ESCANEO_DESCONOCIDO;
+    std::string sku, lote;
+    uint32_t idGrupo = 0;
+};
+
+bool soloDigitos(std::string_view v) {
+    return !v.empty() && std::all_of(v.begin(), v.end(), [](char c) { return c >= '0' && c <= '9'; });
+}
+
+// Digito verificador GS1 (modulo 10, pesos 3 y 1 desde la derecha).
+bool gtinValido(std::string_view gtin) {
+    if (gtin.size() != 14 || !soloDigitos(gtin)) return false;
+    int suma = 0;
+    for (int i = 0; i < 13; ++i) suma += (gtin[i] - '0') * ((i % 2 == 0) ? 3 : 1);
+    return (10 - suma % 10) % 10 == gtin[13] - '0';
+}
+
+// Largo del AI y de su dato (0 = variable, termina en GS o al final) segun sus primeros
+// digitos, como en la tabla de prefijos predefinidos de GS1. false si no se reconoce.
+bool formatoAI(std::string_view s, size_t& largoAI, size_t& largoDato) {
+    if (s.size() < 2 || !soloDigitos(s.substr(0, 2))) return false;
+    int p = (s[0] - '0') * 10 + (s[1] - '0');
+    largoAI = 2; largoDato = 0;
+    if (p == 0) largoDato = 18;
+    else if (p >= 1 && p <= 3) largoDato = 14;
+    else if (p == 4) largoDato = 16;
+    else if (p >= 11 && p <= 19) largoDato = 6;
+    else if (p == 20) largoDato = 2;
+    else if (p == 10 || p == 21 || p == 22 || p == 30 || p == 37 || p >= 90) largoDato = 0;
+    else if (p >= 31 && p <= 36) { largoAI = 4; largoDato = 6; }
+    else if (p == 41) { largoAI = 3; largoDato = 13; }
+    else if ((p >= 23 && p <= 25) || (p >= 40 && p <= 42)) largoAI = 3;
+    else if (p >= 70 && p <= 89) largoAI = 4;
+    else return false;
+    return s.size() >= largoAI;
+}
+
+void agregarSKUsGTIN(LecturaEscaneo& l, std::string_view gtin) {
+    l.skus[l.numSkus++] = gtin;
+    if (gtin[0] == '0') l.skus[l.numSkus++] = gtin.substr(1);           // GTIN-13
+    size_t ceros = std::min(gtin.find_first_not_of('0'), gtin.size() - 1);
+    if (ceros > 1) l.skus[l.numSkus++] = gtin.substr(ceros);
+}
+
+// En la forma legible un lote puede traer '(': el dato termina en el siguiente "(AI)" que la
+// tabla reconoce, no en cualquier parentesis.
+size_t finDatoLegible(std::string_view s) {
+    for (size_t i = s.find('('); i != std::string_view::npos; i = s.find('(', i + 1)) {
+        std::string_view resto = s.substr(i + 1);
+        size_t largoAI, largoDato;
+        if (formatoAI(resto, largoAI, largoDato) && soloDigitos(resto.substr(0, largoAI))
+            && resto.size() > largoAI && resto[largoAI] == ')') return i;
+    }
+    return s.size();
+}
+
+// GS1 con FNC1 como GS, o legible con parentesis. 'explicito' indica que la simbologia ya
+// dijo que es GS1; si no, solo se acepta si todo el texto es GS1 valido y el GTIN cuadra.
+bool decodificarGS1(std::string_view s, bool explicito, LecturaEscaneo* lecturas, int& n) {
+    std::string_view gtin, lote;
+    bool parentesis = !s.empty() && s[0] == '(';
+    if (!explicito && !parentesis && s.find(GS1_GS) == std::string_view::npos && s.substr(0, 2) != "01") return false;
+    if (!s.empty() && s[0] == GS1_GS) s.remove_prefix(1);
+    while (!s.empty()) {
+        size_t largoAI, largoDato;
+        std::string_view ai, dato;
+        if (parentesis) {
+            size_t cierre = s.find(')');
+            if (s[0] != '(' || cierre == std::string_view::npos) return false;
+            ai = s.substr(1, cierre - 1);
+            if (!formatoAI(ai, largoAI, largoDato) || ai.size() != largoAI) return false;
+            s.remove_prefix(cierre + 1);
+            size_t fin = finDatoLegible(s);
+            dato = s.substr(0, fin);
+            s.remove_prefix(fin);
+            if (largoDato != 0 && dato.size() != largoDato) return false;
+        } else {
+            if (!formatoAI(s, largoAI, largoDato)) return false;
+            ai = s.substr(0, largoAI);
+            s.remove_prefix(largoAI);
+            if (largoDato == 0) {
+                size_t fin = std::min(s.find(GS1_GS), s.size());
+                dato = s.substr(0, fin);
+                s.remove_prefix(std::min(fin + 1, s.size()));
+            } else {
+                if (s.size() < largoDato) return false;
+                dato = s.substr(0, largoDato);
+                s.remove_prefix(largoDato);
+                if (!s.empty() && s[0] == GS1_GS) s.remove_prefix(1); // FNC1 de mas tras un campo fijo
+            }
+        }
+        if (dato.empty() || dato.size() > 90) return false;
+        if (ai == "01") gtin = dato;
+        else if (ai == "10") lote = dato;
+        else if (ai == "17" && !soloDigitos(dato)) return false;
+    }
+    if (gtin.empty() || (!explicito && !parentesis && !gtinValido(gtin)) || !soloDigitos(gtin) || n >= MAX_LECTURAS_ESCANEO) return false;
+    LecturaEscaneo& l = lecturas[n++];
+    l = LecturaEscaneo();
+    agregarSKUsGTIN(l, gtin);
+    l.lote = lote;
+    return true;
+}
+
+// "SKU<sep>LOTE": una lectura por cada separador encontrado, de izquierda a derecha.
+bool decodificarSeparado(std::string_view s, bool, LecturaEscaneo* lecturas, int& n) {
+    bool alguna = false;
+    for (size_t i = s.find_first_of(separadoresEscaneo); i != std::string_view::npos && n < MAX_LECTURAS_ESCANEO;
+         i = s.find_first_of(separadoresEscaneo, i + 1)) {
+        std::string_view sku = recortar(s.substr(0, i)), lote = recortar(s.substr(i + 1));
+        lote = lote.substr(0, lote.find(' '));
+        if (sku.empty() || lote.empty()) continue;
+        LecturaEscaneo& l = lecturas[n++];
+        l = LecturaEscaneo();
+        l.skus[l.numSkus++] = sku;
+        l.lote = lote;
+        alguna = true;
+    }
+    return alguna;
+}
+
+bool decodificarLargoFijo(std::string_view s, bool, LecturaEscaneo* lecturas, int& n) {
+    if (largoSKU == 0 || s.size() <= largoSKU || n >= MAX_LECTURAS_ESCANEO) return false;
+    LecturaEscaneo& l = lecturas[n++];
+    l = LecturaEscaneo();
+    l.skus[l.numSkus++] = s.substr(0, largoSKU);
+    l.lote = recortar(s.substr(largoSKU));
+    return true;
+}
+
+using DecodificadorEscaneo = bool (*)(std::string_view, bool, LecturaEscaneo*, int&);
+const DecodificadorEscaneo decodificadores[] = { decodificarGS1, decodificarSeparado, decodificarLargoFijo };
+
+// Recorta el escaneo, cambia el sustituto de FNC1 por GS y quita el identificador de simbologia
+// AIM; 'gs1' indica si ese identificador ya dice que es GS1. Si hubo que reemplazar algo, el
+// texto vive en 'normalizado'.
+std::string_view normalizarEscaneo(std::string_view crudo, std::string& normalizado, bool& gs1) {
+    std::string_view s = recortar(crudo);
+    while (!s.empty() && (s.back() == '\r' || s.back() == '\n')) s.remove_suffix(1);
+    if (sustitutoFNC1 != 0 && s.find(sustitutoFNC1) != std::string_view::npos) {
+        normalizado.assign(s);
+        std::replace(normalizado.begin(), normalizado.end(), sustitutoFNC1, GS1_GS);
+        s = normalizado;
+    }
+    gs1 = false;
+    if (s.size() >= 3 && s[0] == ']') {
+        std::string_view id = s.substr(0, 3);
+        gs1 = id == "]C1" || id == "]d2" || id == "]Q3" || id == "]e0" || id == "]J1";
+        s.remove_prefix(3);
+    }
+    return s;
+}
+
+// Lecturas de cada formato en el orden de decodificadores[]; con simbologia GS1, solo GS1.
+int leerFormatos(std::string_view s, bool gs1, LecturaEscaneo* lecturas) {
+    int n = 0;
+    for (DecodificadorEscaneo decodificar : decodificadores) {
+        if (gs1 && decodificar != decodificarGS1) break;
+        decodificar(s, gs1, lecturas, n);
+    }
+    return n;
+}
+
+// Decide que trae el escaneo. Primero el texto completo como SKU (el flujo de siempre) y luego
+// cada formato; entre lecturas con SKU conocido pero sin grupo se reporta la mas especifica.
+EscaneoDecodificado decodificarEscaneo(const IndiceBusqueda& d, std::string_view crudo) {
+    EscaneoDecodificado r;
+    std::string normalizado;
+    bool gs1;
+    std::string_view s = normalizarEscaneo(crudo, normalizado, gs1);
+    if (s.empty()) return r;
+
+    uint32_t idSku;
+    if (!gs1 && buscarTexto(d, s, idSku) && gruposDeSKU(d, idSku)) {
+        r.resultado = ESCANEO_SOLO_SKU;
+        r.sku.assign(s);
+        return r;
+    }
+    LecturaEscaneo lecturas[MAX_LECTURAS_ESCANEO];
+    int n = leerFormatos(s, gs1, lecturas);
+    for (int k = 0; k < n; ++k) {
+        for (int c = 0; c < lecturas[k].numSkus; ++c) {
+            std::string_view sku = lecturas[k].skus[c];
+            if (!buscarTexto(d, sku, idSku) || !gruposDeSKU(d, idSku)) continue;
+            uint32_t g;
+            if (!lecturas[k].lote.empty() && buscarIdGrupo(d, sku, lecturas[k].lote, g)) {
+                r.resultado = ESCANEO_COMPLETO;
+                r.sku.assign(sku);
+                r.lote.assign(lecturas[k].lote);
+                r.idGrupo = g;
+                return r;
+            }
+            ResultadoEscaneo parcial = lecturas[k].lote.empty() ? ESCANEO_SOLO_SKU : ESCANEO_LOTE_INVALIDO;
+            if (r.resultado == ESCANEO_DESCONOCIDO || (r.resultado == ESCANEO_SOLO_SKU && parcial == ESCANEO_LOTE_INVALIDO)) {
+                r.resultado = parcial;
+                r.sku.assign(sku);
+                r.lote.assign(lecturas[k].lote);
+            }
+        }
+    }
+    return r;
+}
+
+// --- INVENTARIO (FEFO) ---
+// Existencia por SKU y lote (--inventario=stock.csv: SKU, lote, caducidad, existencia). Cuando
+// un destino queda corto, el dialogo propone los lotes que caducan primero con existencia, y
+// escanear uno en la pregunta de complemento lo usa de una vez. Cada pieza confirmada se
+// descuenta del lote que la surtio y el inventario se guarda junto con la foto en
+// ARCHIVO_INVENTARIO: al reanudar se carga ese, asi las olas siguientes ven lo que queda.
+#define ARCHIVO_INVENTARIO "inventario_ptl.csv"
+#define INVENTARIO_MAX_SUGERIDOS 3
+#define SIN_CADUCIDAD 99991231
+
+struct LoteInventario {
+    std::string lote;
+    int caducidad;           // AAAAMMDD
+    int existencia;
+};
+
+struct InventarioPTL {
+    std::unordered_map<std::string, std::vector<LoteInventario>> lotesPorSKU; // Por caducidad
+    std::mutex mutex;        // Las estaciones descuentan a la vez
+    bool cargado = false;
+    bool cambiado = false;   // Hay descuentos sin guardar
+};
+
+InventarioPTL inventario;
+std::string archivoInventario;   // --inventario=stock.csv
+
+// "2026-11-30", "30/11/2026", "20261130" o "261130" (AI 17 de GS1) a AAAAMMDD; vacio = sin fecha.
+bool leerCaducidad(std::string_view v, int& fecha) {
+    v = recortar(v);
+    if (v.empty()) { fecha = SIN_CADUCIDAD; return true; }
+    int a = 0, m = 0, d = 0;
+    auto numero = [](std::string_view t, int& n) { return soloDigitos(t) && leerEntero(t, n); };
+    if (v.size() == 10 && (v[4] == '-' || v[4] == '/')) {
+        if (!numero(v.substr(0, 4), a) || !numero(v.substr(5, 2), m) || !numero(v.substr(8, 2), d)) return false;
+    } else if (v.size() == 10 && (v[2] == '/' || v[2] == '-')) {
+        if (!numero(v.substr(0, 2), d) || !numero(v.substr(3, 2), m) || !numero(v.substr(6, 4), a)) return false;
+    } else if (v.size() == 8 && numero(v, a)) {
+        d = a % 100; m = a / 100 % 100; a /= 10000;
+    } else if (v.size() == 6 && numero(v, a)) {
+        d = a % 100; m = a / 100 % 100; a = 2000 + a / 10000;
+        if (d == 0) d = 31; // GS1: dia 00 = fin de mes
+    } else {
+        return false;
+    }
+    if (m < 1 || m > 12 || d < 1 || d > 31) return false;
+    fecha = a * 10000 + m * 100 + d;
+    return true;
+}
+
+std::string textoCaducidad(int fecha) {
+    if (fecha == SIN_CADUCIDAD) return "sin fecha";
+    char texto[16];
+    std::snprintf(texto, sizeof(texto), "%04d-%02d-%02d", fecha / 10000, fecha / 100 % 100, fecha % 100);
+    return texto;
+}
+
+// Se llama desde los hilos de estacion: std::localtime comparte su resultado entre hilos.
+int fechaDeHoy() {
+    std::time_t ahora = std::time(nullptr);
+    std::tm t{};
+#ifdef _WIN32
+    localtime_s(&t, &ahora);
+#else
+    localtime_r(&ahora, &t);
+#endif
+    return (t.tm_year + 1900) * 10000 + (t.tm_mon + 1) * 100 + t.tm_mday;
+}
+
+bool cargarInventario(const std::string& archivo) {
+    std::string contenido;
+    if (!leerArchivoCompleto(archivo, contenido)) {
+        std::cerr << "ERROR: No se pudo abrir el inventario " << archivo << "." << std::endl;
+        return false;
+    }
+    std::string_view texto = contenido;
+    if (texto.substr(0, 3) == "\xEF\xBB\xBF") texto.remove_prefix(3);
+    std::vector<std::string_view> campos;
+    std::deque<std::string> sinComillas;
+    size_t pos = 0, lineas = 0;
+    leerRegistro(texto, pos, campos, sinComillas, lineas);
+    ColumnasCSV columnas = mapearColumnas(campos);
+    if (columnas.existencia < 0) columnas.existencia = columnas.piezas; // "Cantidad" en un inventario es la existencia
+    int columna[4] = {columnas.sku, columnas.lote, columnas.caducidad, columnas.existencia};
+    if (*std::min_element(columna, columna + 4) < 0) {
+        std::cout << "AVISO: Encabezado de inventario no reconocido; se usan las columnas SKU,Lote,Caducidad,Existencia por posicion." << std::endl;
+        for (int c = 0; c < 4; ++c) columna[c] = c;
+    }
+
+    std::unordered_map<std::string, std::vector<LoteInventario>> lotesPorSKU;
+    size_t cargados = 0, rechazados = 0;
+    while (pos < texto.size()) {
+        size_t linea = lineas + 1;
+        leerRegistro(texto, pos, campos, sinComillas, lineas);
+        if (std::all_of(campos.begin(), campos.end(), [](std::string_view c) { return c.empty(); })) continue;
+        LoteInventario l;
+        bool valido = (int)campos.size() > *std::max_element(columna, columna + 4) && !campos[columna[0]].empty();
+        if (valido) {
+            l.lote = std::string(campos[columna[1]].substr(0, campos[columna[1]].find(' ')));
+            valido = !l.lote.empty() && leerCaducidad(campos[columna[2]], l.caducidad)
+                     && leerEntero(campos[columna[3]], l.existencia) && l.existencia >= 0;
+        }
+        if (!valido) {
+            if (rechazados++ < CSV_MAX_RECHAZOS_MOSTRADOS) std::cerr << "  Inventario, linea " << linea << " rechazada." << std::endl;
+            continue;
+        }
+        lotesPorSKU[std::string(campos[columna[0]])].push_back(std::move(l));
+        cargados++;
+    }
+    for (auto& par : lotesPorSKU) {
+        std::stable_sort(par.second.begin(), par.second.end(),
+                         [](const LoteInventario& a, const LoteInventario& b) { return a.caducidad < b.caducidad; });
+    }
+    std::lock_guard<std::mutex> lock(inventario.mutex);
+    inventario.lotesPorSKU = std::move(lotesPorSKU);
+    inventario.cargado = true;
+    inventario.cambiado = false;
+    std::cout << "Inventario: " << cargados << " lotes de " << inventario.lotesPorSKU.size() << " SKU, rechazados: "
+              << rechazados << " (" << archivo << ")" << std::endl;
+    return true;
+}
+
+// Escribe a un temporal y renombra, como la foto.
+void guardarInventario() {
+    std::ostringstream texto;
+    {
+        std::lock_guard<std::mutex> lock(inventario.mutex);
+        if (!inventario.cargado || !inventario.cambiado) return;
+        inventario.cambiado = false;
+        texto << "SKU,Lote,Caducidad,Existencia\n";
+        for (const auto& [sku, lotes] : inventario.lotesPorSKU) {
+            for (const LoteInventario& l : lotes) {
+                texto << sku << "," << l.lote << "," << (l.caducidad == SIN_CADUCIDAD ? "" : textoCaducidad(l.caducidad)) << "," << l.existencia << "\n";
+            }
+        }
+    }
+    std::string temporal = std::string(ARCHIVO_INVENTARIO) + ".tmp";
+    std::ofstream f(temporal, std::ios::binary);
+    f << texto.str();
+    f.close();
+    if (f) reemplazarArchivo(temporal, ARCHIVO_INVENTARIO);
+}
+
+// Existencia del lote; -1 si no esta en el inventario.
+int existenciaLote(const std::string& sku, const std::string& lote) {
+    std::lock_guard<std::mutex> lock(inventario.mutex);
+    auto it = inventario.lotesPorSKU.find(sku);
+    if (it == inventario.lotesPorSKU.end()) return -1;
+    for (const LoteInventario& l : it->second) if (l.lote == lote) return l.existencia;
+    return -1;
+}
+
+void descontarInventario(const std::string& sku, const std::string& lote, int piezas) {
+    if (piezas <= 0) return;
+    std::lock_guard<std::mutex> lock(inventario.mutex);
+    auto it = inventario.lotesPorSKU.find(sku);
+    if (it == inventario.lotesPorSKU.end()) return;
+    for (LoteInventario& l : it->second) {
+        if (l.lote != lote) continue;
+        l.existencia = std::max(0, l.existencia - piezas);
+        inventario.cambiado = true;
+        return;
+    }
+}
+
+// Lotes para completar 'faltan' piezas: primero los que caducan antes (sin vencidos, sin
+// existencia ni los excluidos), y a igual caducidad el de mas existencia, hasta cubrir lo
+// que falta o llegar a INVENTARIO_MAX_SUGERIDOS.
+std::vector<LoteInventario> sugerirLotes(const std::string& sku, int faltan, const std::vector<std::string>& excluidos) {
+    std::vector<LoteInventario> candidatos;
+    {
+        std::lock_guard<std::mutex> lock(inventario.mutex);
+        auto it = inventario.lotesPorSKU.find(sku);
+        if (it == inventario.lotesPorSKU.end()) return candidatos;
+        int hoy = fechaDeHoy();
+        for (const LoteInventario& l : it->second) {
+            if (l.existencia <= 0 || l.caducidad < hoy) continue;
+            if (std::find(excluidos.begin(), excluidos.end(), l.lote) != excluidos.end()) continue;
+            candidatos.push_back(l);
+        }
+    }
+    std::stable_sort(candidatos.begin(), candidatos.end(), [](const LoteInventario& a, const LoteInventario& b) {
+        return a.caducidad != b.caducidad ? a.caducidad < b.caducidad : a.existencia > b.existencia;
+    });
+    size_t n = 0;
+    for (int cubierto = 0; n < candidatos.size() && n < INVENTARIO_MAX_SUGERIDOS && cubierto < faltan; ++n) cubierto += candidatos[n].existencia;
+    candidatos.resize(n);
+    return candidatos;
+}
+
+// El lote de un escaneo de complemento: el de un escaneo combinado del mismo SKU (GS1,
+// "SKU LOTE") o, como siempre, el texto hasta el primer espacio.
+std::string loteEscaneado(const std::string& sku, const std::string& linea) {
+    std::string normalizado;
+    bool gs1;
+    std::string_view s = normalizarEscaneo(linea, normalizado, gs1);
+    LecturaEscaneo lecturas[MAX_LECTURAS_ESCANEO];
+    int n = leerFormatos(s, gs1, lecturas);
+    for (int k = 0; k < n; ++k) {
+        for (int c = 0; c < lecturas[k].numSkus; ++c) {
+            if (lecturas[k].skus[c] == sku && !lecturas[k].lote.empty()) return std::string(lecturas[k].lote);
+        }
+    }
+    return linea.substr(0, linea.find(' '));
+}
+
+// --- ESTACIONES ---
+// Cada estacion (la consola o un escaner serial) surte en su propio hilo con su propia cola de
+// eventos: las lineas del operador y los botones de los destinos que tiene encendidos. Un
+// destino solo puede estar encendido para una estacion a la vez (duenoDestino).
+struct EventoEstacion {
+    bool deBus;              // Boton/+/- de un modulo; si no, linea del operador
+    std::string texto;
+#ifndef PTL_SIN_METRICAS
+    std::chrono::steady_clock::time_point llegada = std::chrono::steady_clock::now();
+#endif
+};
+
+struct Estacion {
+    int id = 0;                                    // 1 = consola
+    std::string nombre;
+    std::unique_ptr<TransporteSerial> escaner;     // nullptr = consola
+    std::vector<std::pair<int, int>> zona;         // Rangos de destinos; vacio = todos
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<EventoEstacion> eventos;
+    bool entradaCerrada = false;
+    std::atomic<bool> leyendo{true};               // El escaner se lee hasta que main lo detiene
+    std::thread hilo, hiloEntrada;
+    uint64_t gruposSurtidos = 0;
+};
+
+std::vector<std::unique_ptr<Estacion>> estaciones;
+std::atomic<bool> cerrando{false};       // La consola salio: las demas terminan al quedar libres
+std::mutex mutexConsola;                 // Una linea de salida a la vez
+std::mutex mutexDuenos;
+std::vector<int> duenoDestino;           // destino -> id de estacion, 0 = libre
+
+// Junta una linea y la imprime completa; con varias estaciones lleva el nombre de la suya.
+class SalidaEstacion {
+    const Estacion& est;
+    std::ostringstream texto;
+
+public:
+    explicit SalidaEstacion(const Estacion& e) : est(e) {}
+    template <class T> SalidaEstacion& operator<<(const T& valor) { texto << valor; return *this; }
+    ~SalidaEstacion() {
+        std::string s = texto.str();
+        size_t inicio = std::min(s.find_first_not_of('\n'), s.size());
+        std::lock_guard<std::mutex> lock(mutexConsola);
+        std::cout << s.substr(0, inicio);
+        if (estaciones.size() > 1) std::cout << "[" << est.nombre << "] ";
+        std::cout << s.substr(inicio) << std::flush;
+    }
+};
+
+void entregarEvento(Estacion& est, bool deBus, std::string texto) {
+    {
+        std::lock_guard<std::mutex> lock(est.mutex);
+        est.eventos.push_back({deBus, std::move(texto)});
+    }
+    est.cv.notify_one();
+}
+
+void cerrarEntrada(Estacion& est) {
+    {
+        std::lock_guard<std::mutex> lock(est.mutex);
+        est.entradaCerrada = true;
+    }
+    est.cv.notify_all();
+}
+
+void pedirCierre() {
+    cerrando = true;
+    for (auto& e : estaciones) {
+        std::lock_guard<std::mutex> lock(e->mutex);
+        e->cv.notify_all();
+    }
+}
+
+void despacharEvento(const std::string& mensaje) {
+    size_t inicio = (mensaje.rfind("boton_", 0) == 0) ? 6 : ((mensaje[0] == '+' || mensaje[0] == '-') ? 1 : 0);
+    int destino;
+    if (inicio == 0 || !leerEntero(std::string_view(mensaje).substr(inicio), destino)) return;
+    int dueno = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutexDuenos);
+        if (destino >= 0 && destino < (int)duenoDestino.size()) dueno = duenoDestino[destino];
+    }
+    if (dueno > 0) entregarEvento(*estaciones[dueno - 1], true, mensaje); // Sin dueno: nadie lo espera
+}
+
+// Espera la siguiente linea del operador; los eventos de bus que lleguen mientras tanto se
+// quedan en la cola en su orden. false si la entrada se cerro (o, con salirAlCerrar, al cerrar).
+bool leerEntrada(Estacion& est, std::string& linea, bool salirAlCerrar = false) {
+    std::unique_lock<std::mutex> lock(est.mutex);
+    auto entrada = est.eventos.end();
+    est.cv.wait(lock, [&] {
+        entrada = std::find_if(est.eventos.begin(), est.eventos.end(), [](const EventoEstacion& e) { return !e.deBus; });
+        return entrada != est.eventos.end() || est.entradaCerrada || (salirAlCerrar && cerrando);
+    });
+    if (entrada == est.eventos.end()) return false;
+    linea = trim(entrada->texto);
+    est.eventos.erase(entrada);
+    return true;
+}
+
+// Bloquea hasta el siguiente evento de cualquier tipo; false si ya no llegaran mas.
+bool esperarEvento(Estacion& est, EventoEstacion& evento) {
+    std::unique_lock<std::mutex> lock(est.mutex);
+    est.cv.wait(lock, [&] { return !est.eventos.empty() || est.entradaCerrada; });
+    if (est.eventos.empty()) return false;
+    evento = std::move(est.eventos.front());
+    est.eventos.pop_front();
+#ifndef PTL_SIN_METRICAS
+    if (evento.deBus) REGISTRAR_ETAPA(ETAPA_COLA_EVENTOS, MICROS_DESDE(evento.llegada));
+#endif
+    return true;
+}
+
+// Botones que quedaron de un surtido anterior no deben confirmar el siguiente.
+void descartarEventosBus(Estacion& est) {
+    std::lock_guard<std::mutex> lock(est.mutex);
+    est.eventos.erase(std::remove_if(est.eventos.begin(), est.eventos.end(), [](const EventoEstacion& e) { return e.deBus; }),
+                      est.eventos.end());
+}
+
+void hiloEntradaConsola(Estacion& est) {
+    std::string linea;
+    while (std::getline(std::cin, linea)) entregarEvento(est, false, linea);
+    cerrarEntrada(est);
+}
+
+// Un escaner en modo serial manda cada lectura terminada en CR y/o LF.
+void hiloEntradaEscaner(Estacion& est) {
+    char buffer[MAX_BUFFER_SIZE];
+    std::string linea;
+    int n;
+    while (est.leyendo && (n = est.escaner->leer(buffer, sizeof(buffer), -1)) >= 0) {
+        for (int i = 0; i < n; ++i) {
+            if (buffer[i] != '\r' && buffer[i] != '\n') { linea += buffer[i]; continue; }
+            if (!linea.empty()) entregarEvento(est, false, linea);
+            linea.clear();
+        }
+    }
+    cerrarEntrada(est);
+}
+
+bool enZona(const Estacion& est, int destino) {
+    if (est.zona.empty()) return true;
+    for (const auto& r : est.zona) if (destino >= r.first && destino <= r.second) return true;
+    return false;
+}
+
+void liberarDestino(int destino) {
+    std::lock_guard<std::mutex> lock(mutexDuenos);
+    if (destino >= 0 && destino < (int)duenoDestino.size()) duenoDestino[destino] = 0;
+}
+
+// --- AVANCE DE LA OLA (FILL RATE) ---
+// Agregados por OV, por SKU y por destino que se actualizan en cada confirmacion, cancelacion o
+// ajuste (una busqueda en tabla hash), para no reconstruir el fill rate desde el diario de
+// backorders. Una linea es un destino de un (SKU, lote). Por destino (el modulo donde se
+// confirmo) solo se cuenta lo confirmado; las lineas pendientes aun no tienen modulo.
+//   avance [OV]       en la consola: resumen de la ola o detalle de una OV
+//   --resumen=A.csv   reescribe el resumen cada AVANCE_CADA_S (OV, SKU, destino y total)
+//   --alerta-ov=MIN   avisa una vez por OV que pasa MIN minutos con lineas abiertas (30)
+// Al salir se imprime la conciliacion de la ola y se cuadra contra el indice. Al reanudar, las
+// lineas ya surtidas entran completas: sus faltantes estan en el diario de backorders.
+#define AVANCE_CADA_S 30
+#define AVANCE_MAX_MOSTRADOS 10
+
+struct AvanceSurtido {
+    int lineas = 0;              // Pedidas
+    int cerradas = 0;            // Confirmadas, completas o cortas
+    int cortas = 0;              // Confirmadas con faltante
+    int cambiosLote = 0;         // Cerradas con mas de un lote
+    int cancelaciones = 0;
+    int64_t piezasPedidas = 0;
+    int64_t piezasCerradas = 0;  // Pedidas de las lineas cerradas
+    int64_t piezasSurtidas = 0;
+
+    double fillRate() const { return piezasCerradas > 0 ? 100.0 * piezasSurtidas / piezasCerradas : 100.0; }
+};
+
+struct AvanceOV : AvanceSurtido {
+    std::chrono::steady_clock::time_point abierta;   // Desde que se cargo (o se reabrio)
+    bool alertada = false;
+};
+
+struct AvanceOla {
+    std::mutex mutex;
+    std::unordered_map<int, AvanceOV> porOV;
+    std::unordered_map<std::string, AvanceSurtido> porSKU;
+    std::unordered_map<int, AvanceSurtido> porDestino;
+    AvanceSurtido total;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, int>> porAntiguedad; // OV en orden de apertura
+    int lineasReanudadas = 0;
+    std::thread hilo;
+    std::condition_variable cv;
+    bool activo = false;
+};
+
+AvanceOla avance;
+std::string archivoResumen;   // --resumen=avance.csv
+int alertaOVMinutos = 30;     // --alerta-ov=MIN
+
+// Con 'avance.mutex' tomado.
+void sumarLinea(int ov, const std::string& sku, int piezas) {
+    AvanceOV& o = avance.porOV[ov];
+    if (o.lineas == o.cerradas) { // OV nueva o que se reabre
+        o.abierta = std::chrono::steady_clock::now();
+        o.alertada = false;
+        avance.porAntiguedad.push_back({o.abierta, ov});
+    }
+    for (AvanceSurtido* a : {(AvanceSurtido*)&o, &avance.porSKU[sku], &avance.total}) {
+        a->lineas++;
+        a->piezasPedidas += piezas;
+    }
+}
+
+void avanceLineaNueva(int ov, const std::string& sku, int piezas) {
+    std::lock_guard<std::mutex> lock(avance.mutex);
+    sumarLinea(ov, sku, piezas);
+}
+
+void avanceAjuste(int ov, const std::string& sku, int antes, int despues) {
+    std::lock_guard<std::mutex> lock(avance.mutex);
+    for (AvanceSurtido* a : {(AvanceSurtido*)&avance.porOV[ov], &avance.porSKU[sku], &avance.total}) a->piezasPedidas += despues - antes;
+}
+
+void avanceCierre(int ov, const std::string& sku, int destino, int pedidas, int surtidas, int lotes) {
+    std::lock_guard<std::mutex> lock(avance.mutex);
+    for (AvanceSurtido* a : {(AvanceSurtido*)&avance.porOV[ov], &avance.porSKU[sku], &avance.porDestino[destino], &avance.total}) {
+        a->cerradas++;
+        if (surtidas < pedidas) a->cortas++;
+        if (lotes > 1) a->cambiosLote++;
+        a->piezasCerradas += pedidas;
+        a->piezasSurtidas += surtidas;
+    }
+    avance.porDestino[destino].lineas++; // Por destino solo existen las confirmadas
+    avance.porDestino[destino].piezasPedidas += pedidas;
+}
+
+void avanceCancelacion(int ov, const std::string& sku, int destino) {
+    std::lock_guard<std::mutex> lock(avance.mutex);
+    for (AvanceSurtido* a : {(AvanceSurtido*)&avance.porOV[ov], &avance.porSKU[sku], &avance.porDestino[destino], &avance.total}) {
+        a->cancelaciones++;
+    }
+}
+
+double minutosDesde(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count() / 60.0;
+}
+
+// OV con lineas abiertas que ya pasaron el limite; cada una se revisa una vez por apertura.
+std::vector<std::string> revisarAntiguedad() {
+    std::vector<std::string> alertas;
+    auto limite = std::chrono::steady_clock::now() - std::chrono::minutes(alertaOVMinutos);
+    std::lock_guard<std::mutex> lock(avance.mutex);
+    while (!avance.porAntiguedad.empty() && avance.porAntiguedad.front().first <= limite) {
+        auto [abierta, ov] = avance.porAntiguedad.front();
+        avance.porAntiguedad.pop_front();
+        AvanceOV& o = avance.porOV[ov];
+        if (o.abierta != abierta || o.lineas == o.cerradas) continue; // Ya cerro o se reabrio despues
+        o.alertada = true;
+        alertas.push_back("AVISO: OV " + std::to_string(ov) + " lleva " + std::to_string((int)minutosDesde(o.abierta))
+                          + " min con " + std::to_string(o.lineas - o.cerradas) + " lineas abiertas.");
+    }
+    return alertas;
+}
+
+void escribirFilaResumen(std::ostream& out, const char* nivel, const std::string& clave, const AvanceSurtido& a, double minutos, bool alerta) {
+    out << nivel << "," << clave << "," << a.lineas << "," << a.cerradas << "," << a.cortas << "," << a.cambiosLote << ","
+        << a.cancelaciones << "," << a.piezasPedidas << "," << a.piezasSurtidas << "," << a.fillRate() << ",";
+    if (minutos >= 0) out << (int)minutos;
+    out << "," << (alerta ? "SI" : "") << "\n";
+}
+
+void escribirResumen() {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    out << "Nivel,Clave,Lineas,Cerradas,Cortas,CambiosLote,Cancelaciones,PiezasPedidas,PiezasSurtidas,FillRate,MinutosAbierta,Alerta\n";
+    {
+        std::lock_guard<std::mutex> lock(avance.mutex);
+        escribirFilaResumen(out, "Total", "", avance.total, -1, false);
+        for (const auto& [ov, o] : avance.porOV) {
+            bool abierta = o.cerradas < o.lineas;
+            escribirFilaResumen(out, "OV", std::to_string(ov), o, abierta ? minutosDesde(o.abierta) : -1, abierta && o.alertada);
+        }
+        for (const auto& [sku, a] : avance.porSKU) escribirFilaResumen(out, "SKU", sku, a, -1, false);
+        for (const auto& [destino, a] : avance.porDestino) escribirFilaResumen(out, "Destino", std::to_string(destino), a, -1, false);
+    }
+    std::string temporal = archivoResumen + ".tmp";
+    std::ofstream f(temporal, std::ios::binary | std::ios::trunc);
+    if (!f) return;
+    f << out.str();
+    f.close();
+    if (f) reemplazarArchivo(temporal, archivoResumen);
+}
+
+std::string textoAvance(const AvanceSurtido& a) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << a.cerradas << "/" << a.lineas << " lineas, " << a.cortas << " cortas, "
+        << a.cambiosLote << " con cambio de lote, " << a.cancelaciones << " cancelaciones, " << a.piezasSurtidas
+        << " de " << a.piezasCerradas << " pzs (fill rate " << a.fillRate() << "%)";
+    return out.str();
+}
+
+// Comando "avance [OV]" de la consola.
+void mostrarAvance(Estacion& est, const std::string& argumento) {
+    SalidaEstacion out(est);
+    std::lock_guard<std::mutex> lock(avance.mutex);
+    if (!argumento.empty()) {
+        int ov;
+        auto it = leerEntero(argumento, ov) ? avance.porOV.find(ov) : avance.porOV.end();
+        if (it == avance.porOV.end()) { out << "OV no encontrada: " << argumento << "\n"; return; }
+        out << "OV " << ov << ": " << textoAvance(it->second);
+        if (it->second.cerradas < it->second.lineas) out << ", abierta hace " << (int)minutosDesde(it->second.abierta) << " min";
+        out << "\n";
+        return;
+    }
+    out << "Ola: " << textoAvance(avance.total) << "\n";
+    std::vector<std::pair<double, int>> abiertas;
+    for (const auto& [ov, o] : avance.porOV) if (o.cerradas < o.lineas) abiertas.push_back({minutosDesde(o.abierta), ov});
+    std::sort(abiertas.rbegin(), abiertas.rend());
+    out << "OV abiertas: " << abiertas.size() << " de " << avance.porOV.size();
+    if (!abiertas.empty()) out << "; las mas antiguas:";
+    for (size_t i = 0; i < abiertas.size() && i < AVANCE_MAX_MOSTRADOS; ++i) {
+        const AvanceOV& o = avance.porOV[abiertas[i].second];
+        out << " " << abiertas[i].second << " (" << (int)abiertas[i].first << " min, " << o.lineas - o.cerradas << " lineas"
+            << (o.alertada ? ", ALERTA" : "") << ")";
+    }
+    out << "\n";
+}
+
+void hiloAvance() {
+    std::unique_lock<std::mutex> lock(avance.mutex);
+    while (avance.activo) {
+        avance.cv.wait_for(lock, std::chrono::seconds(AVANCE_CADA_S), [] { return !avance.activo; });
+        lock.unlock();
+        std::vector<std::string> alertas = revisarAntiguedad();
+        if (!alertas.empty()) {
+            std::lock_guard<std::mutex> lockConsola(mutexConsola);
+            for (const std::string& a : alertas) std::cout << "\n" << a << std::endl;
+        }
+        if (!archivoResumen.empty()) escribirResumen();
+        lock.lock();
+    }
+}
+
+// Lineas de 'd' (recien cargado o reanudado) y el hilo de alertas y resumen.
+void iniciarAvance(const DatosCargados& d) {
+    {
+        std::lock_guard<std::mutex> lock(avance.mutex);
+        for (const GrupoLote& g : d.grupos) {
+            const std::string& sku = d.textos[g.sku];
+            for (const DestinoGrupo& dg : g.destinos) {
+                sumarLinea(dg.ordenDeVenta, sku, dg.piezas);
+                if (!dg.surtido) continue;
+                for (AvanceSurtido* a : {(AvanceSurtido*)&avance.porOV[dg.ordenDeVenta], &avance.porSKU[sku], &avance.total}) {
+                    a->cerradas++;
+                    a->piezasCerradas += dg.piezas;
+                    a->piezasSurtidas += dg.piezas;
+                }
+                avance.lineasReanudadas++;
+            }
+        }
+        avance.activo = true;
+    }
+    avance.hilo = std::thread(hiloAvance);
+}
+
+// Conciliacion de la ola desde los agregados, cuadrada contra las lineas pendientes del indice.
+void reportarConciliacion(size_t pendientesIndice) {
+    std::lock_guard<std::mutex> lock(avance.mutex);
+    const AvanceSurtido& t = avance.total;
+    size_t completas = 0, conFaltante = 0;
+    std::vector<int> abiertas;
+    for (const auto& [ov, o] : avance.porOV) {
+        if (o.cerradas < o.lineas) abiertas.push_back(ov);
+        else if (o.cortas > 0) conFaltante++;
+        else completas++;
+    }
+    std::sort(abiertas.begin(), abiertas.end());
+    std::vector<std::pair<int, std::string>> skusCortos;
+    for (const auto& [sku, a] : avance.porSKU) if (a.cortas > 0) skusCortos.push_back({a.cortas, sku});
+    std::sort(skusCortos.rbegin(), skusCortos.rend());
+
+    std::cout << "\n--- CONCILIACION DE LA OLA ---\n"
+              << "Lineas: " << textoAvance(t) << "\n"
+              << "OV: " << avance.porOV.size() << " (" << completas << " completas, " << conFaltante << " con faltante, "
+              << abiertas.size() << " con lineas abiertas)\n";
+    if (!abiertas.empty()) {
+        std::cout << "OV abiertas:";
+        for (size_t i = 0; i < abiertas.size() && i < AVANCE_MAX_MOSTRADOS; ++i) std::cout << " " << abiertas[i];
+        if (abiertas.size() > AVANCE_MAX_MOSTRADOS) std::cout << " ... y " << abiertas.size() - AVANCE_MAX_MOSTRADOS << " mas";
+        std::cout << "\n";
+    }
+    if (!skusCortos.empty()) {
+        std::cout << "SKU con mas lineas cortas:";
+        for (size_t i = 0; i < skusCortos.size() && i < AVANCE_MAX_MOSTRADOS; ++i) std::cout << " " << skusCortos[i].second << " (" << skusCortos[i].first << ")";
+        std::cout << "\n";
+    }
+    if (avance.lineasReanudadas > 0) std::cout << "Reanudadas como completas: " << avance.lineasReanudadas << " lineas\n";
+    size_t abiertasAvance = (size_t)(t.lineas - t.cerradas);
+    if (abiertasAvance == pendientesIndice) std::cout << "Cuadra con el indice: " << pendientesIndice << " lineas pendientes." << std::endl;
+    else std::cout << "DESCUADRE: " << abiertasAvance << " lineas abiertas contra " << pendientesIndice << " pendientes en el indice." << std::endl;
+}
+
+// Detiene el hilo y emite la conciliacion; el resumen queda con el estado final.
+void detenerAvance() {
+    {
+        std::lock_guard<std::mutex> lock(avance.mutex);
+        avance.activo = false;
+    }
+    avance.cv.notify_all();
+    if (avance.hilo.joinable()) avance.hilo.join();
+
+    size_t pendientesIndice = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutexDatos);
+        for (const GrupoLote& g : datos.grupos) pendientesIndice += g.pendientes;
+    }
+    reportarConciliacion(pendientesIndice);
+    if (!archivoResumen.empty()) escribirResumen();
+}
+// --- CARGA ADICIONAL ---
+// Pedidos que llegan del ERP a media jornada: "cargar archivo.csv" en una estacion o archivos
+// que aparecen en --carpeta-pedidos=DIR. Un hilo propio lee y parsea sin tocar 'datos' (de un
+// archivo ya cargado solo lo que crecio desde la ultima vez), fusiona las lineas con mutexDatos
+// (lo que esperaria una confirmacion) y despues publica otra copia del indice fuera de todo
+// candado: las busquedas de las estaciones nunca esperan a la carga.
+// Una linea (OV, SKU, lote) que ya existia depende de donde viene. Las filas que crecieron al
+// final de un archivo ya cargado suman sus piezas, igual que las filas repetidas al cargar.
+// En un archivo nuevo (o reenviado completo) se compara por piezas: igual es duplicada y se
+// ignora; distinta se ajusta. Cualquier cambio se aplica si la linea todavia no se surte ni
+// esta encendida; si no, queda en conflicto. Las lineas de una OV ya completa la reabren en un
+// destino nuevo, porque su modulo ya se solto. Al terminar se guarda una foto y se rehace la
+// secuencia sugerida.
+#define CARPETA_REVISAR_MS 2000
+#define CARGA_MAX_CONFLICTOS_MOSTRADOS 20
+
+struct ArchivoCargado {
+    uintmax_t leido = 0;       // Bytes ya procesados, hasta el ultimo '\n'
+    uintmax_t revisado = 0;    // Tamano en la ultima lectura, con la linea a medias si la habia
+    size_t lineas = 0;         // Lineas ya procesadas, para numerar los rechazos
+    uintmax_t tamanoVisto = 0; // En la carpeta se carga cuando el tamano deja de cambiar
+};
 
-std::string nombreArchivoBackorder = "";
-std::string archivoCSVGlobal = ""; 
+struct CargadorPedidos {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::string> cola;
+    bool activo = false;
+    std::string carpeta;                             // --carpeta-pedidos=DIR
+    std::map<std::string, ArchivoCargado> archivos;  // Solo lo toca el hilo del cargador
+    std::thread hilo;
+};
 
-struct EntradaProducto {
-    std::string sku;
-    std::string lote;
-    int ordenDeVenta;
+CargadorPedidos cargador;
+
+// Todas las filas de un mismo (OV, SKU, lote) del archivo, sumadas como al cargar.
+struct LineaNueva {
+    std::string_view sku, lote;
+    int orden;
     int piezas;
-    int destino;
-    bool yaSurtido; // <--- NUEVA BANDERA DE PROTECCIÓN
 };
 
-struct DatosCargados {
-    std::map<std::string, std::vector<EntradaProducto>> productosPorSKU;
-    bool cargadoExitosamente = false;
+struct ResumenCarga {
+    size_t nuevas = 0, duplicadas = 0, ajustadas = 0, ordenesNuevas = 0, reabiertas = 0;
+    std::vector<std::string> conflictos;
 };
 
-using Producto = EntradaProducto;
+// Lee del archivo lo que no se habia procesado. De uno ya cargado solo el encabezado y la cola.
+// Una ultima linea sin '\n' puede estar a medio escribir: queda para la siguiente lectura.
+bool leerNuevo(const std::string& archivo, ArchivoCargado& estado, std::string& encabezado, std::string& contenido) {
+    std::ifstream f(archivo, std::ios::binary);
+    if (!f.is_open()) return false;
+    f.seekg(0, std::ios::end);
+    uintmax_t tamano = (uintmax_t)f.tellg();
+    if (tamano < estado.leido) estado = ArchivoCargado(); // Lo reemplazaron: se lee completo
+    if (estado.leido > 0) {
+        f.seekg(0, std::ios::beg);
+        std::getline(f, encabezado);
+    }
+    f.seekg((std::streamoff)estado.leido, std::ios::beg);
+    contenido.resize((size_t)(tamano - estado.leido));
+    f.read(&contenido[0], contenido.size());
+    if (!f) return false;
+    size_t fin = contenido.rfind('\n');
+    contenido.resize(fin == std::string::npos ? 0 : fin + 1);
+    estado.leido += contenido.size();
+    estado.revisado = tamano;
+    return true;
+}
 
-// Prototipos Actualizados (ahora reciben el mapa de punteros para marcar como surtido)
-void processInputMessage(const std::string& mensaje, std::set<int>& pendientes,
-                         std::map<int, int>& piezasOriginales, std::map<int, int>& piezasAjustadas,
-                         const std::string& sku, const std::string& lote, bool& loop_break,
-                         const std::map<int, int>& destino_a_OV, std::queue<int>& destinosParaConfirmar,
-                         std::map<int, EntradaProducto*>& mapaEntradasActivas);
+// Agrega las lineas a 'd' (con mutexDatos); 'cola' si son filas que
+// crecieron al final de un archivo ya cargado. Los destinos de grupo
+// nuevos van al final de sus grupos, asi los RefDestino de lo encendido siguen valiendo, y sus
+// entradas al final de 'entradas': la foto los reagrupa en el mismo orden.
+void fusionarLineas(DatosCargados& d, const std::vector<LineaNueva>& lineas, bool cola, ResumenCarga& r) {
+    AsignadorModulos& a = d.modulos;
+    bool unModuloPorOV = modulosFisicos == 0 && !a.reciclando();
+    int destinosAntes = (int)a.moduloPorDestino.size();
+    std::unordered_map<int, int> destinoDeOrden; // El destino mas reciente de cada OV
+    for (int destino = 1; destino < destinosAntes; ++destino) destinoDeOrden[a.ordenDeVenta[destino]] = destino;
 
-void handleConfirmation(int destino, std::set<int>& pendientes,
-                        std::map<int, int>& piezasOriginales, std::map<int, int>& piezasAjustadas,
-                        const std::string& sku, const std::string& loteRequerido,
-                        const std::map<int, int>& destino_a_OV,
-                        std::map<int, EntradaProducto*>& mapaEntradasActivas);
+    for (const LineaNueva& l : lineas) {
+        uint32_t g;
+        if (buscarIdGrupo(d, l.sku, l.lote, g)) {
+            std::vector<DestinoGrupo>& destinos = d.grupos[g].destinos;
+            auto it = std::find_if(destinos.begin(), destinos.end(), [&](const DestinoGrupo& dg) { return dg.ordenDeVenta == l.orden; });
+            if (it != destinos.end()) {
+                uint32_t indice = (uint32_t)(it - destinos.begin());
+                auto activo = sesion.activos.find(g);
+                bool encendido = activo != sesion.activos.end() && activo->second.count(indice);
+                int piezas = cola ? it->piezas + l.piezas : l.piezas;
+                if (it->piezas == piezas) {
+                    r.duplicadas++;
+                } else if (it->surtido || encendido) {
+                    r.conflictos.push_back("OV " + std::to_string(l.orden) + ", SKU " + std::string(l.sku) + ", lote " + std::string(l.lote)
+                                           + ": " + (it->surtido ? "surtida" : "encendida") + " con " + std::to_string(it->piezas)
+                                           + " pzs, el archivo " + (cola ? "agrega " : "pide ") + std::to_string(l.piezas));
+                } else {
+                    avanceAjuste(l.orden, std::string(l.sku), it->piezas, piezas);
+                    // Las piezas quedan en la primera entrada del destino
+                    for (uint32_t k = 0; k < it->numEntradas; ++k) d.entradas[d.entradasPorDestino[it->primeraEntrada + k]].piezas = k == 0 ? piezas : 0;
+                    it->piezas = piezas;
+                    r.ajustadas++;
+                }
+                continue;
+            }
+        } else {
+            g = obtenerGrupo(d, l.sku, l.lote);
+        }
 
-// --- FUNCIONES SERIAL ---
-bool inicializarPuertoSerial(const std::string& puerto) {
-    hSerial = CreateFile(puerto.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-    if (hSerial == INVALID_HANDLE_VALUE) {
-        std::cerr << "ERROR: Puerto serial '" << puerto << "' no encontrado." << std::endl;
-        return false;
+        auto orden = destinoDeOrden.find(l.orden);
+        int destino;
+        if (orden != destinoDeOrden.end() && a.lineasPendientes[orden->second] > 0) {
+            destino = orden->second;
+        } else {
+            destino = (int)a.moduloPorDestino.size();
+            a.moduloPorDestino.push_back(0);
+            a.lineasPendientes.push_back(0);
+            a.ordenDeVenta.push_back(l.orden);
+            (orden == destinoDeOrden.end() ? r.ordenesNuevas : r.reabiertas)++;
+            destinoDeOrden[l.orden] = destino;
+        }
+        uint32_t entrada = (uint32_t)d.entradas.size();
+        d.entradas.push_back({d.grupos[g].sku, d.grupos[g].lote, l.orden, l.piezas, destino, false});
+        d.entradasPorDestino.push_back(entrada);
+        d.grupos[g].destinos.push_back({destino, l.orden, l.piezas, entrada, 1, false});
+        d.grupos[g].pendientes++;
+        a.lineasPendientes[destino]++;
+        avanceLineaNueva(l.orden, std::string(l.sku), l.piezas);
+        r.nuevas++;
     }
-    DCB dcb = {0}; dcb.DCBlength = sizeof(dcb); GetCommState(hSerial, &dcb);
-    dcb.BaudRate = BAUDRATE; dcb.ByteSize = 8; dcb.StopBits = ONESTOPBIT; dcb.Parity = NOPARITY;
-    SetCommState(hSerial, &dcb);
-    COMMTIMEOUTS timeouts = {0};
-    timeouts.ReadIntervalTimeout = 50; timeouts.ReadTotalTimeoutConstant = 50; timeouts.ReadTotalTimeoutMultiplier = 10;
-    timeouts.WriteTotalTimeoutConstant = 50; timeouts.WriteTotalTimeoutMultiplier = 10;
-    SetCommTimeouts(hSerial, &timeouts);
-    std::cout << "Puerto serial " << puerto << " inicializado." << std::endl;
-    return true;
-}
 
-void enviarAArduino(const std::string& comando) {
-    std::lock_guard<std::mutex> lock(serialMutex);
-    std::string msg = comando + "\n";
-    DWORD bytesWritten;
-    if (hSerial != INVALID_HANDLE_VALUE) WriteFile(hSerial, msg.c_str(), msg.length(), &bytesWritten, NULL);
+    // Sin --modulos cada OV tiene su modulo (destino = modulo): el rack crece con las OV nuevas
+    int destinos = (int)a.moduloPorDestino.size();
+    if (unModuloPorOV && destinos > destinosAntes) {
+        a.capacidad = destinos - 1;
+        a.destinoPorModulo.resize(destinos, 0);
+        for (int destino = destinosAntes; destino < destinos; ++destino) {
+            a.moduloPorDestino[destino] = destino;
+            a.destinoPorModulo[destino] = destino;
+        }
+        a.siguienteEnEspera = destinos;
+    }
+    asignarEnEspera(a);
+    std::lock_guard<std::mutex> lock(mutexDuenos);
+    if ((int)duenoDestino.size() < a.capacidad + 1) duenoDestino.resize(a.capacidad + 1, 0);
 }
 
-std::string trim(const std::string& str) {
-    size_t first = str.find_first_not_of(" \t\n\r");
-    if (std::string::npos == first) return str;
-    size_t last = str.find_last_not_of(" \t\n\r");
-    return str.substr(first, (last - first + 1));
+// El plan se calcula sobre una copia de grupos y modulos, fuera de mutexDatos.
+void replanificarSecuencia() {
+    DatosCargados copia;
+    {
+        std::lock_guard<std::mutex> lock(mutexDatos);
+        copia.grupos = datos.grupos;
+        copia.modulos = datos.modulos;
+    }
+    auto inicio = std::chrono::steady_clock::now();
+    SecuenciaPTL nueva = planificarSecuencia(copia, pesoCierre);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - inicio).count();
+    {
+        std::lock_guard<std::mutex> lock(mutexConsola);
+        reportarSecuencia(datos, nueva, ms, false); // Solo este hilo agrega textos y grupos
+    }
+    std::lock_guard<std::mutex> lock(mutexDatos);
+    secuencia = std::move(nueva);
 }
 
-void hiloLecturaSerial() {
-    char buffer[MAX_BUFFER_SIZE];
-    DWORD bytesRead;
-    std::string currentData = "";
-    while (hiloLecturaActivo) {
-        if (hSerial != INVALID_HANDLE_VALUE && ReadFile(hSerial, buffer, sizeof(buffer) - 1, &bytesRead, NULL) && bytesRead > 0) {
-            buffer[bytesRead] = '\0';
-            currentData += std::string(buffer);
-            size_t newlinePos;
-            while ((newlinePos = currentData.find('\n')) != std::string::npos) {
-                std::string message = currentData.substr(0, newlinePos);
-                message = trim(message);
-                if (!message.empty()) {
-                    std::lock_guard<std::mutex> lock(serialMutex);
-                    colaMensajesRecibidos.push(message);
-                }
-                currentData.erase(0, newlinePos + 1);
-            }
+void procesarCarga(const std::string& archivo) {
+    auto inicio = std::chrono::steady_clock::now();
+    ArchivoCargado& estado = cargador.archivos[archivo];
+    std::string encabezado, contenido;
+    if (!leerNuevo(archivo, estado, encabezado, contenido)) {
+        std::lock_guard<std::mutex> lock(mutexConsola);
+        std::cerr << "\nERROR: No se pudo leer " << archivo << "." << std::endl;
+        return;
+    }
+    if (contenido.empty()) {
+        std::lock_guard<std::mutex> lock(mutexConsola);
+        std::cout << "\nCarga adicional: " << archivo << " | sin lineas completas nuevas." << std::endl;
+        return;
+    }
+
+    std::string_view texto = contenido, cabecera = encabezado;
+    bool cola = estado.lineas > 0; // leerNuevo reinicia el estado de un archivo reemplazado
+    size_t lineasEncabezado = 0, lineaBase = estado.lineas + 1;
+    ColumnasCSV columnas = leerEncabezadoCSV(cola ? cabecera : texto, lineasEncabezado);
+    if (!cola) lineaBase += lineasEncabezado;
+    std::vector<ResultadoBloque> resultados = parsearEnBloques(texto, columnas);
+    estado.lineas = lineaBase - 1;
+    for (const ResultadoBloque& r : resultados) estado.lineas += r.lineas;
+
+    std::map<std::tuple<int, std::string_view, std::string_view>, size_t> porClave;
+    std::vector<LineaNueva> lineas;
+    for (const ResultadoBloque& r : resultados) {
+        for (const FilaCSV& fila : r.filas) {
+            auto [it, nueva] = porClave.emplace(std::make_tuple(fila.orden, fila.sku, fila.lote), lineas.size());
+            if (nueva) lineas.push_back({fila.sku, fila.lote, fila.orden, 0});
+            lineas[it->second].piezas += fila.piezas;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
+    auto parseado = std::chrono::steady_clock::now();
+
+    ResumenCarga r;
+    if (!lineas.empty()) {
+        std::lock_guard<std::mutex> lockDatos(mutexDatos);
+        fusionarLineas(datos, lineas, cola, r);
+    }
+    auto fusionado = std::chrono::steady_clock::now();
+    if (r.nuevas > 0) agregarAlIndice(datos);
+    auto publicado = std::chrono::steady_clock::now();
+    CONTAR(CONTADOR_LINEAS_CARGADAS, r.nuevas);
+    {
+        std::lock_guard<std::mutex> lock(mutexConsola);
+        std::cout << std::endl;
+        size_t rechazadas = reportarRechazos(resultados, lineaBase);
+        std::cout << "Carga adicional: " << archivo << " | " << r.nuevas << " lineas nuevas (" << r.ordenesNuevas << " OV nuevas, "
+                  << r.reabiertas << " reabiertas), " << r.duplicadas << " duplicadas, " << r.ajustadas << " ajustadas, "
+                  << r.conflictos.size() << " en conflicto, " << rechazadas << " rechazadas (parseo "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(parseado - inicio).count() << " ms, fusion "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(fusionado - parseado).count() << " us, indice "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(publicado - fusionado).count() << " ms)" << std::endl;
+        for (size_t i = 0; i < r.conflictos.size() && i < CARGA_MAX_CONFLICTOS_MOSTRADOS; ++i) {
+            std::cout << "  Conflicto: " << r.conflictos[i] << "." << std::endl;
+        }
+    }
+    if (r.nuevas == 0 && r.ajustadas == 0) return;
+    guardarSnapshot(datos);
+    replanificarSecuencia();
 }
 
-std::string obtenerMensajeSerial() {
-    std::lock_guard<std::mutex> lock(serialMutex);
-    if (!colaMensajesRecibidos.empty()) {
-        std::string mensaje = colaMensajesRecibidos.front();
-        colaMensajesRecibidos.pop();
-        return mensaje;
+// CSV de la carpeta con contenido sin procesar y que no cambiaron desde la revision anterior.
+void revisarCarpeta() {
+    std::error_code ec;
+    for (const auto& entrada : std::filesystem::directory_iterator(cargador.carpeta, ec)) {
+        std::string extension = entrada.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (extension != ".csv" || !entrada.is_regular_file(ec)) continue;
+        if (std::filesystem::equivalent(entrada.path(), archivoCSVGlobal, ec)) continue;
+        uintmax_t tamano = entrada.file_size(ec);
+        if (ec) continue;
+        ArchivoCargado& estado = cargador.archivos[entrada.path().string()];
+        bool estable = tamano == estado.tamanoVisto;
+        estado.tamanoVisto = tamano;
+        if (estable && tamano != estado.revisado) procesarCarga(entrada.path().string());
     }
-    return "";
 }
 
-// --- LOGICA PRINCIPAL ---
+void hiloCargador() {
+    std::unique_lock<std::mutex> lock(cargador.mutex);
+    while (cargador.activo) {
+        auto hayTrabajo = [] { return !cargador.cola.empty() || !cargador.activo; };
+        if (cargador.carpeta.empty()) cargador.cv.wait(lock, hayTrabajo);
+        else cargador.cv.wait_for(lock, std::chrono::milliseconds(CARPETA_REVISAR_MS), hayTrabajo);
+        if (!cargador.activo) break;
+        std::deque<std::string> pendientes;
+        pendientes.swap(cargador.cola);
+        lock.unlock();
+        if (pendientes.empty()) revisarCarpeta();
+        for (const std::string& archivo : pendientes) procesarCarga(archivo);
+        lock.lock();
+    }
+}
 
-void registrarBackorder(const std::string& sku, int ordenDeVenta, int destino,
-                        int piezasOriginales, int piezasSurtidas,
-                        const std::string& loteRequerido, const std::string& loteConfirmado,
-                        const std::string& motivo) {
-    std::ofstream archivo(nombreArchivoBackorder, std::ios::app);
-    if (!archivo.is_open()) return;
-    archivo.seekp(0, std::ios::end);
-    if (archivo.tellp() == 0) archivo << "SKU,LoteRequerido,LoteConfirmado,Orden de venta,Destino,PiezasRequeridas,CantidadSurtida,Motivo\n";
-    archivo << sku << "," << loteRequerido << "," << loteConfirmado << "," << ordenDeVenta << ","
-            << destino << "," << piezasOriginales << "," << piezasSurtidas << "," << motivo << "\n";
+void encolarCarga(const std::string& archivo) {
+    {
+        std::lock_guard<std::mutex> lock(cargador.mutex);
+        cargador.cola.push_back(archivo);
+    }
+    cargador.cv.notify_one();
 }
 
-DatosCargados cargarProductosDesdeCSV(const std::string& archivo) {
-    DatosCargados datos;
-    std::ifstream file(archivo);
-    std::string line;
+void iniciarCargador() {
+    cargador.activo = true;
+    cargador.hilo = std::thread(hiloCargador);
+    if (!cargador.carpeta.empty()) std::cout << "Carpeta de pedidos: " << cargador.carpeta << std::endl;
+}
 
-    if (!file.is_open()) {
-        std::cerr << "ERROR: No se pudo abrir el archivo CSV." << std::endl;
-        return datos;
+// Una carga en curso termina antes de la foto final.
+void detenerCargador() {
+    {
+        std::lock_guard<std::mutex> lock(cargador.mutex);
+        cargador.activo = false;
     }
-    std::getline(file, line); // Saltar encabezado
+    cargador.cv.notify_one();
+    if (cargador.hilo.joinable()) cargador.hilo.join();
+}
 
-    std::map<std::string, int> asignacionDestinos;
-    int siguienteDestinoDisponible = 1;
+// --- LOGICA DE CONFIRMACION ACTUALIZADA ---
+// Marca el destino como surtido, lo deja en la bitacora para poder reanudar y lo libera
+// para las demas estaciones. Si la OV quedo completa y se reciclan modulos, devuelve el aviso
+// para que la estacion cambie la caja.
+std::string confirmarSurtido(const RefDestino& ref, int destino, int cantidad) {
+    int ovCompleta = 0, ovSiguiente = 0;
+    bool reciclando;
+    {
+        std::lock_guard<std::mutex> lock(mutexDatos);
+        const DestinoGrupo& dg = datos.grupos[ref.grupo].destinos[ref.indice];
+        reciclando = datos.modulos.reciclando();
+        if (marcarSurtido(datos, ref) != 0) {
+            ovCompleta = dg.ordenDeVenta;
+            int siguiente = datos.modulos.destinoPorModulo[destino];
+            if (siguiente != 0) ovSiguiente = datos.modulos.ordenDeVenta[siguiente];
+        }
+    }
+    esperarWAL(registrarWAL(WAL_CONFIRMADO, ref, destino, cantidad));
+    liberarDestino(destino);
+    if (!reciclando || ovCompleta == 0) return "";
+    std::string aviso = "  >> Modulo " + std::to_string(destino) + ": OV " + std::to_string(ovCompleta) + " completa. Retire su caja";
+    if (ovSiguiente != 0) return aviso + " y coloque la de la OV " + std::to_string(ovSiguiente) + ".\n";
+    return aviso + "; queda libre.\n";
+}
+
+// Un escaneo en curso: sus destinos encendidos y los dialogos de confirmacion abiertos. Todo
+// avanza desde el bucle de eventos de la estacion (botones, +/- y lineas del operador en una
+// sola cola), asi que un dialogo esperando respuesta no detiene a los demas destinos.
+enum FaseDialogo { DIALOGO_CORRECTA, DIALOGO_COMPLEMENTAR, DIALOGO_LOTE, DIALOGO_CANTIDAD };
 
-    while (std::getline(file, line)) {
-        std::stringstream ss(line);
-        std::string sku, lote, ordenStr, piezasStr;
-        std::getline(ss, sku, ','); std::getline(ss, lote, ',');
-        std::getline(ss, ordenStr, ','); std::getline(ss, piezasStr, ',');
+struct DestinoEncendido {
+    RefDestino ref;
+    int ordenDeVenta;
+    int piezas;              // Requeridas
+    int ajustadas;           // Lo que muestra el modulo
+    bool enDialogo = false;
+    bool cantidadFija = false; // Ya contesto que la cantidad es correcta
+};
 
-        sku = trim(sku); lote = trim(lote); ordenStr = trim(ordenStr); piezasStr = trim(piezasStr); 
-        size_t posEspacio = lote.find(' '); if (posEspacio != std::string::npos) lote = lote.substr(0, posEspacio);
+struct DialogoConfirmacion {
+    int destino = 0;
+    FaseDialogo fase = DIALOGO_CORRECTA;
+    int faltan = 0;
+    int surtidoTotal = 0;
+    std::vector<std::pair<std::string, int>> lotesUsados;
+    std::string loteComplemento;
+#ifndef PTL_SIN_METRICAS
+    std::chrono::steady_clock::time_point abierto = std::chrono::steady_clock::now();
+#endif
+};
 
-        if (sku.empty()) continue;
+struct SurtidoEnCurso {
+    Estacion& est;
+    std::string sku, lote;
+    std::map<int, DestinoEncendido> destinos;      // Encendidos sin confirmar
+    std::deque<DialogoConfirmacion> dialogos;      // El primero es el que contesta el operador
+    std::vector<std::string> avisos;               // Retenidos mientras hay una pregunta en pantalla
+    bool cancelado = false;
+};
 
-        try {
-            int orden = std::stoi(ordenStr);
-            int piezas = std::stoi(piezasStr);
-            
-            int destinoAsignado;
-            if (asignacionDestinos.find(ordenStr) != asignacionDestinos.end()) {
-                destinoAsignado = asignacionDestinos[ordenStr];
-            } else {
-                destinoAsignado = siguienteDestinoDisponible;
-                asignacionDestinos[ordenStr] = destinoAsignado;
-                siguienteDestinoDisponible++;
-            }
+// Con una pregunta en pantalla lo que pase en otros destinos se retiene y se muestra al
+// contestarla: la pregunta no queda enterrada y cada pregunta se escribe una sola vez.
+void avisar(SurtidoEnCurso& s, std::string texto) {
+    if (s.dialogos.empty()) SalidaEstacion(s.est) << texto;
+    else s.avisos.push_back(std::move(texto));
+}
 
-            // Inicializamos yaSurtido en false
-            datos.productosPorSKU[sku].push_back({sku, lote, orden, piezas, destinoAsignado, false});
+void mostrarAvisos(SurtidoEnCurso& s) {
+    for (const std::string& a : s.avisos) SalidaEstacion(s.est) << a;
+    s.avisos.clear();
+}
 
-        } catch (...) {}
-    }
+// Lotes que ya no se pueden ofrecer como complemento: el requerido y los ya usados.
+std::vector<std::string> lotesExcluidos(const SurtidoEnCurso& s, const DialogoConfirmacion& dlg) {
+    std::vector<std::string> excluidos = {s.lote};
+    for (const auto& usado : dlg.lotesUsados) excluidos.push_back(usado.first);
+    return excluidos;
+}
 
-    if (datos.productosPorSKU.empty()) {
-        std::cerr << "ERROR: CSV invalido." << std::endl;
-    } else {
-        std::cout << "Carga exitosa. Destinos asignados: " << (siguienteDestinoDisponible - 1) << std::endl;
-        datos.cargadoExitosamente = true;
+// Pregunta de la fase actual del primer dialogo; con 'encabezado' tambien el resumen.
+void mostrarDialogo(SurtidoEnCurso& s, bool encabezado) {
+    mostrarAvisos(s);
+    if (s.dialogos.empty()) return;
+    const DialogoConfirmacion& dlg = s.dialogos.front();
+    const DestinoEncendido& d = s.destinos.at(dlg.destino);
+    SalidaEstacion out(s.est);
+    if (encabezado) {
+        out << "\n==================== CONFIRMACION REQUERIDA ====================\n"
+            << "Destino: " << dlg.destino << " (OV: " << d.ordenDeVenta << ")\n"
+            << "  Requerido: " << d.piezas << " | Surtido: " << d.ajustadas << "\n";
+    }
+    switch (dlg.fase) {
+    case DIALOGO_CORRECTA: out << "  ¿Es correcta esta cantidad? (s/n): "; break;
+    case DIALOGO_COMPLEMENTAR: {
+        out << "\n  >> Faltan " << dlg.faltan << ".";
+        std::vector<LoteInventario> sugeridos = sugerirLotes(s.sku, dlg.faltan, lotesExcluidos(s, dlg));
+        if (!sugeridos.empty()) {
+            out << " Sugeridos (FEFO, escanee uno para usarlo):";
+            for (const LoteInventario& l : sugeridos) {
+                out << " " << l.lote << " (cad " << textoCaducidad(l.caducidad) << ", " << l.existencia << " disp)";
+            }
+            out << "\n  >>";
+        }
+        out << " ¿Complementar con otro lote? (s/n): ";
+        break;
+    }
+    case DIALOGO_LOTE: out << "  >> Ingrese LOTE COMPLEMENTO: "; break;
+    case DIALOGO_CANTIDAD: {
+        out << "  >> Cantidad del lote (" << dlg.loteComplemento << ") [1-" << dlg.faltan << "]";
+        int existencia = existenciaLote(s.sku, dlg.loteComplemento);
+        if (existencia >= 0) out << " (" << existencia << " disp)";
+        out << ": ";
+        break;
+    }
     }
-    return datos;
 }
 
-std::string generarNombreArchivo() {
-    auto now = std::chrono::system_clock::now();
-    std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-    std::tm* time_info = std::localtime(&now_c);
-    std::ostringstream oss;
-    oss << "backorders_" << std::put_time(time_info, "%Y-%m-%d_%H-%M-%S") << ".csv";
-    return oss.str();
+// Apaga y registra un destino confirmado y lo saca del escaneo.
+void cerrarDestino(SurtidoEnCurso& s, int destino, int surtido, int lotes = 1) {
+    DestinoEncendido d = s.destinos.at(destino);
+    s.destinos.erase(destino);
+    CONTAR(CONTADOR_PICKS, 1);
+    CONTAR_PICK(s.est.id);
+    avanceCierre(d.ordenDeVenta, s.sku, destino, d.piezas, surtido, lotes);
+    enviarComandos({{OP_APAGAR, destino, 0}});
+    std::string aviso = confirmarSurtido(d.ref, destino, surtido);
+    if (!aviso.empty()) avisar(s, aviso);
 }
 
-bool hayEntradaEnConsola() {
-    #ifdef _WIN32
-        return _kbhit(); 
-    #else
-        return false;
-    #endif
+// Quita el primer dialogo y, si hay otro esperando, lo presenta.
+void siguienteDialogo(SurtidoEnCurso& s) {
+#ifndef PTL_SIN_METRICAS
+    REGISTRAR_ETAPA(ETAPA_CONFIRMACION, MICROS_DESDE(s.dialogos.front().abierto));
+#endif
+    s.dialogos.pop_front();
+    mostrarDialogo(s, true);
 }
 
-int readIntInRange(int minVal, int maxVal) {
-    int val = -1;
-    while (!(std::cin >> val) || val < minVal || val > maxVal) {
-        std::cout << "  Entrada invalida. Ingrese numero (" << minVal << "-" << maxVal << "): ";
-        std::cin.clear(); std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+// Termina un dialogo con diferencia: backorder por cada lote usado y el destino se confirma.
+void terminarDialogo(SurtidoEnCurso& s) {
+    DialogoConfirmacion& dlg = s.dialogos.front();
+    const DestinoEncendido& d = s.destinos.at(dlg.destino);
+    std::string motivoFinal = (dlg.faltan == 0) ? "Cambio de lote - Completo" : "Falta de material";
+    if (dlg.lotesUsados.size() > 1 && dlg.faltan > 0) motivoFinal = "Cambio de lote - Incompleto";
+
+    for (size_t i = 0; i < dlg.lotesUsados.size(); ++i) {
+        int req = (i == 0) ? d.piezas : 0;
+        std::string subMotivo = motivoFinal + ((i == 0) ? " (Principal)" : " (Suplementario)");
+        registrarBackorder(s.sku, d.ordenDeVenta, dlg.destino, req, dlg.lotesUsados[i].second, s.lote, dlg.lotesUsados[i].first, subMotivo);
+        descontarInventario(s.sku, dlg.lotesUsados[i].first, dlg.lotesUsados[i].second);
     }
-    return val;
+    if (dlg.faltan > 0) CONTAR(CONTADOR_FALTANTES, 1);
+    if (dlg.lotesUsados.size() > 1) CONTAR(CONTADOR_CAMBIOS_LOTE, 1);
+    cerrarDestino(s, dlg.destino, dlg.surtidoTotal, (int)dlg.lotesUsados.size());
+    SalidaEstacion(s.est) << "  Destino " << dlg.destino << " registrado.\n";
+    siguienteDialogo(s);
 }
 
-// --- LOGICA DE CONFIRMACION ACTUALIZADA ---
-void handleConfirmation(int destino, std::set<int>& pendientes,
-                        std::map<int, int>& piezasOriginales, std::map<int, int>& piezasAjustadas,
-                        const std::string& sku, const std::string& loteRequerido,
-                        const std::map<int, int>& destino_a_OV,
-                        std::map<int, EntradaProducto*>& mapaEntradasActivas) {
+// Suma 'cant' piezas de dlg.loteComplemento. Devuelve true si con eso se completo y el
+// dialogo ya termino; si no, vuelve a preguntar por otro lote.
+bool agregarComplemento(SurtidoEnCurso& s, DialogoConfirmacion& dlg, int cant) {
+    dlg.lotesUsados.push_back({dlg.loteComplemento, cant});
+    dlg.faltan -= cant;
+    dlg.surtidoTotal += cant;
+    if (dlg.faltan == 0) { terminarDialogo(s); return true; }
+    dlg.fase = DIALOGO_COMPLEMENTAR;
+    return false;
+}
 
-    int original = piezasOriginales.at(destino);
-    int surtidoInicial = piezasAjustadas.at(destino);
-    int odv = destino_a_OV.at(destino);
+// Avanza el primer dialogo con una linea del operador.
+void responderDialogo(SurtidoEnCurso& s, const std::string& linea) {
+    DialogoConfirmacion& dlg = s.dialogos.front();
+    DestinoEncendido& d = s.destinos.at(dlg.destino);
+    std::string respuesta = linea;
+    std::transform(respuesta.begin(), respuesta.end(), respuesta.begin(), ::tolower);
+    bool si = respuesta == "s", no = respuesta == "n";
 
-    std::string respuesta = "";
-    while (respuesta != "s" && respuesta != "n") {
-        std::cout << "\n==================== CONFIRMACION REQUERIDA ====================" << std::endl;
-        std::cout << "Destino: " << destino << " (OV: " << odv << ")" << std::endl;
-        std::cout << "  Requerido: " << original << " | Surtido: " << surtidoInicial << std::endl;
-        std::cout << "  ¿Es correcta esta cantidad? (s/n): ";
-        std::getline(std::cin, respuesta); respuesta = trim(respuesta);
-        std::transform(respuesta.begin(), respuesta.end(), respuesta.begin(), ::tolower);
+    switch (dlg.fase) {
+    case DIALOGO_CORRECTA:
+        if (no) {
+            SalidaEstacion(s.est) << "  CANCELADO. Ajuste piezas en modulo.\n";
+            d.enDialogo = false;
+            siguienteDialogo(s);
+            return;
+        }
+        if (si && d.ajustadas == d.piezas) {
+            registrarBackorder(s.sku, d.ordenDeVenta, dlg.destino, d.piezas, d.piezas, s.lote, s.lote, "OK");
+            descontarInventario(s.sku, s.lote, d.piezas);
+            cerrarDestino(s, dlg.destino, d.piezas);
+            siguienteDialogo(s);
+            return;
+        }
+        if (si) {
+            d.cantidadFija = true;
+            dlg.lotesUsados.push_back({s.lote, d.ajustadas});
+            dlg.faltan = d.piezas - d.ajustadas;
+            dlg.surtidoTotal = d.ajustadas;
+            dlg.fase = DIALOGO_COMPLEMENTAR;
+        }
+        break;
+    case DIALOGO_COMPLEMENTAR:
+        if (no) { terminarDialogo(s); return; }
+        if (si) { dlg.fase = DIALOGO_LOTE; break; }
+        // Con inventario, escanear un lote con existencia aqui lo usa de una vez: toma lo que
+        // falta o lo que tenga el lote. Sin existencia registrada se pregunta la cantidad.
+        if (inventario.cargado && !linea.empty()) {
+            dlg.loteComplemento = loteEscaneado(s.sku, linea);
+            std::vector<std::string> excluidos = lotesExcluidos(s, dlg);
+            if (std::find(excluidos.begin(), excluidos.end(), dlg.loteComplemento) != excluidos.end()) {
+                SalidaEstacion(s.est) << "  Lote invalido o duplicado.\n";
+                break;
+            }
+            int existencia = existenciaLote(s.sku, dlg.loteComplemento);
+            if (existencia <= 0) {
+                SalidaEstacion(s.est) << "  AVISO: Lote " << dlg.loteComplemento << " sin existencia en inventario.\n";
+                dlg.fase = DIALOGO_CANTIDAD;
+                break;
+            }
+            int cant = std::min(dlg.faltan, existencia);
+            SalidaEstacion(s.est) << "  Complemento: lote " << dlg.loteComplemento << ", " << cant << " pzs.\n";
+            CONTAR(CONTADOR_COMPLEMENTOS_ESCANEADOS, 1);
+            if (agregarComplemento(s, dlg, cant)) return;
+        }
+        break;
+    case DIALOGO_LOTE: {
+        dlg.loteComplemento = loteEscaneado(s.sku, linea);
+        std::vector<std::string> excluidos = lotesExcluidos(s, dlg);
+        if (dlg.loteComplemento.empty() || std::find(excluidos.begin(), excluidos.end(), dlg.loteComplemento) != excluidos.end()) {
+            SalidaEstacion(s.est) << "  Lote invalido o duplicado.\n";
+            dlg.fase = DIALOGO_COMPLEMENTAR;
+        } else {
+            if (inventario.cargado && existenciaLote(s.sku, dlg.loteComplemento) <= 0) {
+                SalidaEstacion(s.est) << "  AVISO: Lote " << dlg.loteComplemento << " sin existencia en inventario.\n";
+            }
+            dlg.fase = DIALOGO_CANTIDAD;
+        }
+        break;
+    }
+    case DIALOGO_CANTIDAD: {
+        int cant;
+        if (!leerEntero(linea, cant) || cant < 1 || cant > dlg.faltan) {
+            SalidaEstacion(s.est) << "  Entrada invalida. Ingrese numero (1-" << dlg.faltan << "): ";
+            return;
+        }
+        if (agregarComplemento(s, dlg, cant)) return;
+        break;
+    }
+    }
+    mostrarDialogo(s, false);
+}
+
+// Sin entrada ya no llegan respuestas: la primera pregunta cuenta como "n" (el destino sigue
+// pendiente y se cancela) y un complemento a medias se registra con lo que se alcanzo a surtir.
+void cerrarDialogos(SurtidoEnCurso& s) {
+    while (!s.dialogos.empty()) {
+        if (s.dialogos.front().fase == DIALOGO_CORRECTA) {
+            s.destinos.at(s.dialogos.front().destino).enDialogo = false;
+            s.dialogos.pop_front();
+        } else {
+            terminarDialogo(s);
+        }
     }
+}
 
-    if (respuesta == "n") {
-        std::cout << "  CANCELADO. Ajuste piezas en modulo." << std::endl;
+void atenderBoton(SurtidoEnCurso& s, int destino) {
+    auto it = s.destinos.find(destino);
+    if (it == s.destinos.end() || it->second.enDialogo) return; // Ya espera confirmacion
+    DestinoEncendido& d = it->second;
+    if (d.ajustadas == d.piezas) {
+        registrarBackorder(s.sku, d.ordenDeVenta, destino, d.piezas, d.ajustadas, s.lote, s.lote, "OK");
+        descontarInventario(s.sku, s.lote, d.piezas);
+        avisar(s, "DESTINO " + std::to_string(destino) + " confirmado.\n");
+        cerrarDestino(s, destino, d.piezas);
         return;
     }
+    avisar(s, "ALERTA: Diferencia en Destino " + std::to_string(destino) + ". Esperando confirmacion...\n");
+    d.enDialogo = true;
+    s.dialogos.emplace_back();
+    s.dialogos.back().destino = destino;
+    if (s.dialogos.size() == 1) mostrarDialogo(s, true);
+}
+
+void atenderAjuste(SurtidoEnCurso& s, char op, int destino) {
+    auto it = s.destinos.find(destino);
+    if (it == s.destinos.end() || it->second.cantidadFija) return;
+    DestinoEncendido& d = it->second;
+    if (op == '+') d.ajustadas = (d.ajustadas >= d.piezas) ? 0 : d.ajustadas + 1;
+    else d.ajustadas = (d.ajustadas <= 0) ? d.piezas : d.ajustadas - 1;
+    esperarWAL(registrarWAL(WAL_AJUSTADO, d.ref, destino, d.ajustadas));
+    enviarComandos({{OP_ACTUALIZAR, destino, d.ajustadas}});
+    avisar(s, "Destino " + std::to_string(destino) + " ajustado: " + std::to_string(d.ajustadas) + "\n");
+}
+
+// boton_N, +N o -N, del Arduino o tecleados en la consola.
+bool atenderModulo(SurtidoEnCurso& s, const std::string& mensaje) {
+    int destino;
+    if (mensaje.rfind("boton_", 0) == 0) {
+        if (leerEntero(std::string_view(mensaje).substr(6), destino)) atenderBoton(s, destino);
+        return true;
+    }
+    if (!mensaje.empty() && (mensaje[0] == '+' || mensaje[0] == '-')) {
+        if (leerEntero(std::string_view(mensaje).substr(1), destino)) atenderAjuste(s, mensaje[0], destino);
+        return true;
+    }
+    return false;
+}
+
+// Las lineas del operador van al dialogo abierto; sin dialogo solo cuenta "exit".
+void atenderLinea(SurtidoEnCurso& s, const std::string& linea) {
+    if (atenderModulo(s, linea)) return;
+    if (!s.dialogos.empty()) responderDialogo(s, linea);
+    else if (linea == "exit" || linea == "salir") s.cancelado = true;
+}
+
+// Enciende los destinos pendientes de un grupo que esten libres (y en la zona de la estacion)
+// y atiende botones y entrada hasta terminar o cancelar. Con 'reanudar' solo enciende esos
+// destinos (indice -> cantidad) de una sesion anterior.
+void surtirGrupo(Estacion& est, uint32_t idGrupo, const std::map<uint32_t, int>* reanudar) {
+    INICIAR_MEDICION(inicioEncendido);
+    SurtidoEnCurso s{est, "", "", {}, {}, {}, false};
+    descartarEventosBus(est);
+
+    std::vector<ComandoPTL> encendidos; // Se envian juntos: una trama para toda la ola
+    std::vector<int> ocupados;
+    std::vector<int> enEspera;          // OV sin modulo fisico todavia
+
+    {
+        std::lock_guard<std::mutex> lockDatos(mutexDatos);
+        std::lock_guard<std::mutex> lockDuenos(mutexDuenos);
+        const GrupoLote* grupo = &datos.grupos[idGrupo]; // Una carga adicional puede mover 'grupos'
+        s.sku = datos.textos[grupo->sku];
+        s.lote = datos.textos[grupo->lote];
+        for (uint32_t i = 0; i < grupo->destinos.size(); ++i) {
+            const DestinoGrupo& dg = grupo->destinos[i];
+            if (dg.surtido) continue; // VERIFICACION: ya surtido en un escaneo anterior
+            if (reanudar && !reanudar->count(i)) continue;
+            int dest = moduloDe(datos, dg.destino);
+            if (dest == 0) { enEspera.push_back(dg.ordenDeVenta); continue; }
+            if (!enZona(est, dest)) continue;
+
+            if (duenoDestino[dest] != 0 && duenoDestino[dest] != est.id) { ocupados.push_back(dest); continue; }
+            duenoDestino[dest] = est.id;
+            int cantidad = reanudar ? reanudar->at(i) : dg.piezas;
+            s.destinos[dest] = {{idGrupo, i}, dg.ordenDeVenta, dg.piezas, cantidad};
+            encendidos.push_back({OP_ENCENDER, dest, cantidad});
+        }
+    }
 
-    // CASO SIMPLE: Coincide
-    if (surtidoInicial == original) {
-        registrarBackorder(sku, odv, destino, original, original, loteRequerido, loteRequerido, "OK");
-        pendientes.erase(destino);
-        enviarAArduino("APAGAR_DESTINO_" + std::to_string(destino));
-        
-        // MARCAR COMO SURTIDO
-        if(mapaEntradasActivas.count(destino)) mapaEntradasActivas[destino]->yaSurtido = true;
-        
+    SalidaEstacion(est) << "--- SURTIDO: " << s.sku << " ---\n";
+    uint64_t turnoWAL = 0;
+    for (const ComandoPTL& c : encendidos) {
+        if (!reanudar) turnoWAL = registrarWAL(WAL_ENCENDIDO, s.destinos[c.destino].ref, c.destino, c.cantidad);
+        SalidaEstacion(est) << "  -> Destino " << c.destino << ": " << c.cantidad << " pzs\n";
+    }
+    if (!ocupados.empty()) {
+        SalidaEstacion out(est);
+        out << "  Ocupados por otra estacion (vuelva a escanear despues):";
+        for (int d : ocupados) out << " " << d;
+        out << "\n";
+    }
+    if (!enEspera.empty()) {
+        SalidaEstacion out(est);
+        out << "  Sin modulo libre todavia (se surten al completarse otras OV): " << enEspera.size() << " OV";
+        for (size_t k = 0; k < enEspera.size() && k < 10; ++k) out << (k == 0 ? " (" : " ") << enEspera[k];
+        out << (enEspera.size() > 10 ? " ...)" : ")") << "\n";
+    }
+    if (s.destinos.empty()) {
+        SalidaEstacion(est) << "Sin destinos disponibles para esta estacion.\n";
         return;
     }
 
-    // CASO COMPLEJO: Ajuste o Cambio de Lote
-    int piezasFaltantes = original - surtidoInicial;
-    int piezasPendientes = piezasFaltantes;
-    int piezasSurtidasTotal = surtidoInicial;
-    
-    std::vector<std::pair<std::string, int>> lotesUsados;
-    lotesUsados.push_back({loteRequerido, surtidoInicial});
+    esperarWAL(turnoWAL);
+    enviarComandos(encendidos);
+    TERMINAR_MEDICION(inicioEncendido, ETAPA_ENCENDIDO);
+
+    // Bloquea solo hasta el siguiente evento (boton o linea), nunca dentro de un dialogo
+    EventoEstacion ev;
+    while (!s.destinos.empty() && !s.cancelado) {
+        if (!esperarEvento(est, ev)) { cerrarDialogos(s); break; } // Entrada cerrada: se cancela lo pendiente
+        std::string mensaje = trim(ev.texto);
+        if (ev.deBus) atenderModulo(s, mensaje);
+        else atenderLinea(s, mensaje);
+    }
+    mostrarAvisos(s);
 
-    bool seguirComplementando = true;
-    while (piezasPendientes > 0 && seguirComplementando) {
-        std::string resp = "";
-        while (resp != "s" && resp != "n") {
-            std::cout << "\n  >> Faltan " << piezasPendientes << ". ¿Complementar con otro lote? (s/n): ";
-            std::getline(std::cin, resp); resp = trim(resp);
-            std::transform(resp.begin(), resp.end(), resp.begin(), ::tolower);
+    if (!s.destinos.empty()) {
+        // La cancelacion queda en la bitacora antes de apagar: una caida entre ambos no la pierde
+        std::vector<ComandoPTL> apagados;
+        uint64_t turnoCancelados = 0;
+        for (const auto& [d, info] : s.destinos) {
+            apagados.push_back({OP_APAGAR, d, 0});
+            turnoCancelados = registrarWAL(WAL_CANCELADO, info.ref, d, 0);
+        }
+        esperarWAL(turnoCancelados);
+        enviarComandos(apagados);
+        for (const auto& [d, info] : s.destinos) {
+            registrarBackorder(s.sku, info.ordenDeVenta, d, info.piezas, 0, s.lote, s.lote, "Cancelado");
+            avanceCancelacion(info.ordenDeVenta, s.sku, d);
+            liberarDestino(d);
+            // NOTA: Si se cancela, NO lo marcamos como surtido, para permitir re-intento.
         }
+    } else {
+        SalidaEstacion(est) << "--- COMPLETO ---\n";
+    }
+}
 
-        if (resp == "n") { seguirComplementando = false; break; }
+void hiloEstacion(Estacion& est, DestinosActivos reanudar) {
+    for (const auto& par : reanudar) surtirGrupo(est, par.first, &par.second);
 
-        std::string loteComp;
-        std::cout << "  >> Ingrese LOTE COMPLEMENTO: ";
-        std::getline(std::cin, loteComp); loteComp = trim(loteComp);
-        
-        size_t pos = loteComp.find(' '); if (pos != std::string::npos) loteComp = loteComp.substr(0, pos);
+    while (true) {
+        if (sesion.registrosDesdeSnapshot >= SNAPSHOT_CADA) {
+            guardarSnapshot(datos);
+            guardarInventario();
+        }
+        std::string skuSugerido, loteSugerido;
+        size_t paso, pasos;
+        if (siguienteSugerido(skuSugerido, loteSugerido, paso, pasos)) {
+            SalidaEstacion(est) << "\nSiguiente: SKU " << skuSugerido << ", lote " << loteSugerido << " (paso " << paso + 1
+                                << " de " << pasos << ")";
+        }
+        SalidaEstacion(est) << "\n>>> Escanee SKU (o 'exit'): ";
+        std::string escaneo;
+        do {
+            if (!leerEntrada(est, escaneo, true)) escaneo = "exit";
+        } while (escaneo.empty());
+        if (escaneo == "exit") break;
+        if (escaneo.rfind("cargar ", 0) == 0) {
+            encolarCarga(trim(escaneo.substr(7)));
+            SalidaEstacion(est) << "Cargando " << trim(escaneo.substr(7)) << " en segundo plano.\n";
+            continue;
+        }
+        if (escaneo == "avance" || escaneo.rfind("avance ", 0) == 0) {
+            mostrarAvance(est, trim(escaneo.substr(6)));
+            continue;
+        }
 
-        if (loteComp.empty() || loteComp == loteRequerido) {
-            std::cout << "  Lote invalido o duplicado." << std::endl;
+        // Un escaneo combinado (GS1, "SKU LOTE") resuelve el grupo sin pedir el lote
+        EscaneoDecodificado leido;
+        std::shared_ptr<const IndiceBusqueda> indice = indiceActual(); // gruposSKU apunta dentro de el
+        const std::vector<uint32_t>* gruposSKU;
+        {
+            MEDIR_ETAPA(ETAPA_BUSQUEDA_SKU);
+            leido = decodificarEscaneo(*indice, escaneo);
+            gruposSKU = buscarGruposSKU(*indice, leido.sku);
+        }
+        if (leido.resultado == ESCANEO_DESCONOCIDO) {
+            SalidaEstacion(est) << "SKU no encontrado.\n";
             continue;
         }
+        uint32_t idGrupo = leido.idGrupo;
+        bool encontrado = leido.resultado == ESCANEO_COMPLETO;
+        if (encontrado) {
+            CONTAR(CONTADOR_ESCANEOS_COMBINADOS, 1);
+        } else if (leido.resultado == ESCANEO_SOLO_SKU) {
+            SalidaEstacion(est) << "Escanee LOTE: ";
+            std::string lote;
+            if (!leerEntrada(est, lote)) break;
+            // El lote termina en el primer espacio; si no es del SKU puede ser un escaneo combinado
+            MEDIR_ETAPA(ETAPA_BUSQUEDA_SKU);
+            encontrado = buscarIdGrupo(*indice, leido.sku, lote.substr(0, lote.find(' ')), idGrupo);
+            if (!encontrado) {
+                EscaneoDecodificado combinado = decodificarEscaneo(*indice, lote);
+                encontrado = combinado.resultado == ESCANEO_COMPLETO && combinado.sku == leido.sku;
+                if (encontrado) idGrupo = combinado.idGrupo;
+            }
+        }
 
-        std::cout << "  >> Cantidad del lote (" << loteComp << ") [1-" << piezasPendientes << "]: ";
-        int cant = readIntInRange(1, piezasPendientes);
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        // Cualquier lote del SKU es valido; cada (SKU, lote) tiene sus propios destinos
+        if (!encontrado) {
+            SalidaEstacion s(est);
+            s << "Lote incorrecto. Lotes pendientes de este SKU:";
+            std::vector<std::string> pendientes;
+            {
+                std::lock_guard<std::mutex> lock(mutexDatos);
+                for (uint32_t g : *gruposSKU) {
+                    if (datos.grupos[g].pendientes > 0) pendientes.push_back(datos.textos[datos.grupos[g].lote]);
+                }
+            }
+            for (const std::string& l : pendientes) {
+                s << " " << l;
+                int existencia = inventario.cargado ? existenciaLote(leido.sku, l) : -1;
+                if (existencia >= 0) s << " (" << existencia << " disp)";
+            }
+            s << "\n";
+            continue;
+        }
 
-        lotesUsados.push_back({loteComp, cant});
-        piezasPendientes -= cant;
-        piezasSurtidasTotal += cant;
+        int pendientesGrupo;
+        {
+            std::lock_guard<std::mutex> lock(mutexDatos);
+            pendientesGrupo = datos.grupos[idGrupo].pendientes;
+        }
+        if (pendientesGrupo == 0) {
+            SalidaEstacion(est) << "AVISO: Este SKU/Lote ya fue surtido por completo en todas las ordenes.\n";
+            continue; // Volver a pedir SKU
+        }
+        CONTAR(CONTADOR_ESCANEOS, 1);
+        surtirGrupo(est, idGrupo, nullptr);
+        est.gruposSurtidos++;
     }
+    if (est.id == 1) pedirCierre(); // La consola cierra el programa
+}
 
-    std::string motivoFinal = (piezasPendientes == 0) ? "Cambio de lote - Completo" : "Falta de material";
-    if (lotesUsados.size() > 1 && piezasPendientes > 0) motivoFinal = "Cambio de lote - Incompleto";
+// "COM8" o "COM8=1-12,20": puerto y, opcionalmente, los destinos que atiende.
+bool separarRangos(const std::string& especificacion, std::string& puerto, std::vector<std::pair<int, int>>& rangos) {
+    size_t igual = especificacion.find('=');
+    puerto = especificacion.substr(0, igual);
+    if (igual == std::string::npos) return !puerto.empty();
+    std::string_view resto = std::string_view(especificacion).substr(igual + 1);
+    while (!resto.empty()) {
+        size_t coma = resto.find(',');
+        std::string_view parte = resto.substr(0, coma);
+        resto = (coma == std::string_view::npos) ? std::string_view() : resto.substr(coma + 1);
+        size_t guion = parte.find('-');
+        int desde, hasta;
+        if (!leerEntero(parte.substr(0, guion), desde)) return false;
+        hasta = desde;
+        if (guion != std::string_view::npos && !leerEntero(parte.substr(guion + 1), hasta)) return false;
+        if (desde < 0 || hasta < desde) return false;
+        rangos.push_back({desde, hasta});
+    }
+    return !puerto.empty() && !rangos.empty();
+}
 
-    for (size_t i = 0; i < lotesUsados.size(); ++i) {
-        int req = (i==0) ? original : 0;
-        std::string subMotivo = motivoFinal + ((i==0) ? " (Principal)" : " (Suplementario)");
-        registrarBackorder(sku, odv, destino, req, lotesUsados[i].second, loteRequerido, lotesUsados[i].first, subMotivo);
+void detenerBuses() {
+    for (auto& bus : buses) {
+        detenerHiloEscritura(*bus, bus->escritor);
+        detenerHiloLectura(*bus);
     }
-    
-    pendientes.erase(destino);
-    enviarAArduino("APAGAR_DESTINO_" + std::to_string(destino));
-    
-    // MARCAR COMO SURTIDO
-    if(mapaEntradasActivas.count(destino)) mapaEntradasActivas[destino]->yaSurtido = true;
-    
-    std::cout << "  Destino " << destino << " registrado." << std::endl;
 }
 
-void processInputMessage(const std::string& mensaje, std::set<int>& pendientes,
-                         std::map<int, int>& piezasOriginales, std::map<int, int>& piezasAjustadas,
-                         const std::string& sku, const std::string& lote, bool& loop_break,
-                         const std::map<int, int>& destino_a_OV, std::queue<int>& destinosParaConfirmar,
-                         std::map<int, EntradaProducto*>& mapaEntradasActivas) {
+// --- EXPORTACION DE METRICAS ---
+// --metricas=ptl.prom reescribe el archivo cada METRICAS_CADA_S en formato de texto de
+// Prometheus (para node_exporter con textfile collector); al salir se imprime un resumen.
+#define METRICAS_CADA_S 10
 
-    if (mensaje == "exit" || mensaje == "salir") { loop_break = true; return; }
+#ifndef PTL_SIN_METRICAS
+std::string archivoMetricas;
+std::thread hiloMetricas;
+std::mutex mutexMetricas;
+std::condition_variable cvMetricas;
+bool metricasActivas = false;
 
-    if (mensaje.rfind("boton_", 0) == 0) {
-        try {
-            int dest = std::stoi(mensaje.substr(6));
-            if (pendientes.count(dest)) {
-                int orig = piezasOriginales[dest];
-                int act = piezasAjustadas[dest];
-                int odv = destino_a_OV.at(dest);
-
-                if (orig == act) {
-                    pendientes.erase(dest);
-                    enviarAArduino("APAGAR_DESTINO_" + std::to_string(dest));
-                    registrarBackorder(sku, odv, dest, orig, act, lote, lote, "OK");
-                    std::cout << "DESTINO " << dest << " confirmado." << std::endl;
-                    
-                    // MARCAR COMO SURTIDO
-                    if(mapaEntradasActivas.count(dest)) mapaEntradasActivas[dest]->yaSurtido = true;
-                    
-                } else {
-                    std::cout << "ALERTA: Diferencia en Destino " << dest << ". Esperando confirmacion..." << std::endl;
-                    destinosParaConfirmar.push(dest);
-                }
-            }
-        } catch (...) {}
-    } 
-    else if (mensaje[0] == '+' || mensaje[0] == '-') {
-        try {
-            char op = mensaje[0];
-            int dest = std::stoi(mensaje.substr(1));
-            if (pendientes.count(dest)) {
-                int orig = piezasOriginales[dest];
-                int& act = piezasAjustadas[dest];
-                if (op == '+') act = (act >= orig) ? 0 : act + 1;
-                else act = (act <= 0) ? orig : act - 1;
-                enviarAArduino("ACTUALIZAR_" + std::to_string(dest) + "_" + std::to_string(act));
-                std::cout << "Destino " << dest << " ajustado: " << act << std::endl;
-            }
-        } catch (...) {}
+double picksPorHora(uint64_t picks) {
+    double horas = std::chrono::duration<double>(std::chrono::steady_clock::now() - metricas.inicio).count() / 3600.0;
+    return horas > 0 ? picks / horas : 0;
+}
+
+std::string textoPrometheus() {
+    std::ostringstream out;
+    out << std::setprecision(6);
+    out << "# HELP ptl_etapa_segundos Latencia por etapa del ciclo de surtido.\n"
+        << "# TYPE ptl_etapa_segundos summary\n";
+    for (int e = 0; e < NUM_ETAPAS; ++e) {
+        const HistogramaLatencia& h = metricas.etapas[e];
+        for (double q : { 0.5, 0.9, 0.99 }) {
+            out << "ptl_etapa_segundos{etapa=\"" << NOMBRES_ETAPA[e] << "\",quantile=\"" << q << "\"} "
+                << h.percentil(q * 100) / 1e6 << "\n";
+        }
+        out << "ptl_etapa_segundos_sum{etapa=\"" << NOMBRES_ETAPA[e] << "\"} " << h.suma() / 1e6 << "\n"
+            << "ptl_etapa_segundos_count{etapa=\"" << NOMBRES_ETAPA[e] << "\"} " << h.cuenta() << "\n";
+    }
+    for (int c = 0; c < NUM_CONTADORES; ++c) {
+        out << "# TYPE ptl_" << NOMBRES_CONTADOR[c] << "_total counter\n"
+            << "ptl_" << NOMBRES_CONTADOR[c] << "_total " << metricas.contadores[c].load(std::memory_order_relaxed) << "\n";
+    }
+    out << "# TYPE ptl_picks_estacion_total counter\n";
+    for (const auto& est : estaciones) {
+        out << "ptl_picks_estacion_total{estacion=\"" << est->nombre << "\"} "
+            << metricas.picksPorEstacion[est->id - 1].load(std::memory_order_relaxed) << "\n";
+    }
+    out << "# TYPE ptl_picks_por_hora gauge\n";
+    for (const auto& est : estaciones) {
+        uint64_t picks = metricas.picksPorEstacion[est->id - 1].load(std::memory_order_relaxed);
+        out << "ptl_picks_por_hora{estacion=\"" << est->nombre << "\"} " << picksPorHora(picks) << "\n";
+    }
+    return out.str();
+}
+
+void escribirMetricas() {
+    std::string temporal = archivoMetricas + ".tmp";
+    std::ofstream out(temporal, std::ios::binary | std::ios::trunc);
+    if (!out) return;
+    out << textoPrometheus();
+    out.close();
+    if (out) reemplazarArchivo(temporal, archivoMetricas);
+}
+
+// Las tasas cuentan desde que las estaciones empiezan a surtir.
+void iniciarMetricas() {
+    metricas.picksPorEstacion = std::make_unique<std::atomic<uint64_t>[]>(estaciones.size());
+    metricas.inicio = std::chrono::steady_clock::now();
+    if (archivoMetricas.empty()) return;
+    metricasActivas = true;
+    hiloMetricas = std::thread([] {
+        std::unique_lock<std::mutex> lock(mutexMetricas);
+        while (metricasActivas) {
+            cvMetricas.wait_for(lock, std::chrono::seconds(METRICAS_CADA_S), [] { return !metricasActivas; });
+            lock.unlock();
+            escribirMetricas();
+            lock.lock();
+        }
+    });
+}
+
+std::string formatoDuracion(uint64_t us) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    if (us < 1000) out << us << " us";
+    else if (us < 1000000) out << us / 1e3 << " ms";
+    else out << us / 1e6 << " s";
+    return out.str();
+}
+
+void detenerMetricas() {
+    {
+        std::lock_guard<std::mutex> lock(mutexMetricas);
+        metricasActivas = false;
+    }
+    cvMetricas.notify_all();
+    if (hiloMetricas.joinable()) hiloMetricas.join();
+
+    auto contador = [](ContadorPTL c) { return metricas.contadores[c].load(std::memory_order_relaxed); };
+    std::cout << "\n--- METRICAS DE LA SESION ---\n"
+              << std::left << std::setw(18) << "Etapa" << std::right << std::setw(10) << "muestras"
+              << std::setw(11) << "p50" << std::setw(11) << "p99" << std::setw(11) << "maximo" << "\n";
+    for (int e = 0; e < NUM_ETAPAS; ++e) {
+        const HistogramaLatencia& h = metricas.etapas[e];
+        if (h.cuenta() == 0) continue;
+        std::cout << std::left << std::setw(18) << NOMBRES_ETAPA[e] << std::right << std::setw(10) << h.cuenta()
+                  << std::setw(11) << formatoDuracion(h.percentil(50)) << std::setw(11) << formatoDuracion(h.percentil(99))
+                  << std::setw(11) << formatoDuracion(h.maximo()) << "\n";
     }
+    std::cout << "Escaneos: " << contador(CONTADOR_ESCANEOS) << ", picks: " << contador(CONTADOR_PICKS)
+              << " (faltantes: " << contador(CONTADOR_FALTANTES) << ", cambios de lote: " << contador(CONTADOR_CAMBIOS_LOTE)
+              << "), serial: " << contador(CONTADOR_BYTES_TX) << " B enviados, " << contador(CONTADOR_BYTES_RX)
+              << " B recibidos, " << contador(CONTADOR_RETRANSMISIONES) << " retransmisiones." << std::endl;
+    for (const auto& est : estaciones) {
+        uint64_t picks = metricas.picksPorEstacion[est->id - 1].load(std::memory_order_relaxed);
+        std::cout << "Estacion " << est->nombre << ": " << picks << " picks, "
+                  << std::fixed << std::setprecision(0) << picksPorHora(picks) << " picks/hora." << std::endl;
+    }
+    std::cout.unsetf(std::ios::floatfield);
+    if (!archivoMetricas.empty()) escribirMetricas();
 }
+#else
+inline void iniciarMetricas() {}
+inline void detenerMetricas() {}
+#endif
 
 // --- MAIN ---
-int main() {
+int main(int argc, char* argv[]) {
     std::cout << "Programa PTL v5.0 (Proteccion Doble Escaneo)" << std::endl;
-    if (!inicializarPuertoSerial(PUERTO_SERIAL_DEFAULT)) return 1;
-    std::thread serialThread(hiloLecturaSerial);
+    std::vector<std::string> puertos;     // "COM8" o "COM8=1-12": un bus por puerto
+    std::vector<std::string> escaneres;   // --estacion=COM12[=13-24]: estaciones con escaner serial
+    std::vector<std::string> mapas;       // --mapa=[COM8=]mapa.csv: mapa de modulos de un bus
+    bool soloTexto = false; // --texto: firmware anterior, sin negociar protocolo binario
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--texto") soloTexto = true;
+        else if (arg == "--durabilidad=so") diario.durabilidad = diarioWAL.durabilidad = Durabilidad::SO;
+        else if (arg == "--durabilidad=disco") diario.durabilidad = diarioWAL.durabilidad = Durabilidad::DISCO;
+        else if (arg == "--formato-backorder=jsonl") formatoBackorder = FormatoDiario::JSONL;
+        else if (arg == "--formato-backorder=csv") formatoBackorder = FormatoDiario::CSV;
+        else if (arg.rfind("--estacion=", 0) == 0) escaneres.push_back(arg.substr(11));
+        else if (arg.rfind("--mapa=", 0) == 0) mapas.push_back(arg.substr(7));
+        else if (arg.rfind("--secuencia=", 0) == 0) archivoSecuencia = arg.substr(12);
+        else if (arg.rfind("--peso-cierre=", 0) == 0) {
+            char* fin = nullptr;
+            pesoCierre = std::strtod(arg.c_str() + 14, &fin);
+            if (*fin != '\0' || pesoCierre < 0) {
+                std::cerr << "ERROR: Peso de cierre invalido: '" << arg << "'." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--modulos=", 0) == 0) {
+            if (!leerEntero(arg.substr(10), modulosFisicos) || modulosFisicos < 1) {
+                std::cerr << "ERROR: Numero de modulos invalido: '" << arg << "'." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--separadores-escaneo=", 0) == 0) separadoresEscaneo = arg.substr(22);
+        else if (arg.rfind("--fnc1=", 0) == 0 && arg.size() == 8) sustitutoFNC1 = arg[7];
+        else if (arg.rfind("--largo-sku=", 0) == 0) {
+            int largo = 0;
+            if (!leerEntero(arg.substr(12), largo) || largo < 1) {
+                std::cerr << "ERROR: Largo de SKU invalido: '" << arg << "'." << std::endl;
+                return 1;
+            }
+            largoSKU = (size_t)largo;
+        }
+        else if (arg.rfind("--carpeta-pedidos=", 0) == 0) cargador.carpeta = arg.substr(18);
+        else if (arg.rfind("--inventario=", 0) == 0) archivoInventario = arg.substr(13);
+        else if (arg.rfind("--resumen=", 0) == 0) archivoResumen = arg.substr(10);
+        else if (arg.rfind("--alerta-ov=", 0) == 0) {
+            if (!leerEntero(arg.substr(12), alertaOVMinutos) || alertaOVMinutos < 1) {
+                std::cerr << "ERROR: Minutos de alerta invalidos: '" << arg << "'." << std::endl;
+                return 1;
+            }
+        }
+#ifndef PTL_SIN_METRICAS
+        else if (arg.rfind("--metricas=", 0) == 0) archivoMetricas = arg.substr(11);
+#else
+        else if (arg.rfind("--metricas=", 0) == 0) std::cerr << "AVISO: Compilado con PTL_SIN_METRICAS; se ignora " << arg << std::endl;
+#endif
+        else puertos.push_back(arg);
+    }
+    if (puertos.empty()) puertos.push_back(PUERTO_SERIAL_DEFAULT);
 
-    DatosCargados datos;
-    bool csvCargado = false;
+    for (const std::string& especificacion : puertos) {
+        std::string puerto;
+        std::vector<std::pair<int, int>> rangos;
+        if (!separarRangos(especificacion, puerto, rangos)) {
+            std::cerr << "ERROR: Puerto o rango de destinos invalido: '" << especificacion << "'." << std::endl;
+            return 1;
+        }
+        buses.push_back(std::make_unique<EnlacePTL>());
+        if (!inicializarPuertoSerial(*buses.back(), puerto)) return 1;
+        for (const auto& r : rangos) {
+            if ((int)busPorDestino.size() <= r.second) busPorDestino.resize(r.second + 1, -1);
+            for (int d = r.first; d <= r.second; ++d) {
+                if (busPorDestino[d] >= 0) { std::cerr << "ERROR: El destino " << d << " esta en dos buses." << std::endl; return 1; }
+                busPorDestino[d] = (int)buses.size() - 1;
+            }
+        }
+    }
+
+    for (const std::string& especificacion : mapas) {
+        // Sin puerto el mapa es del primer bus
+        size_t igual = especificacion.find('=');
+        std::string puerto = igual == std::string::npos ? buses[0]->puerto : especificacion.substr(0, igual);
+        auto bus = std::find_if(buses.begin(), buses.end(), [&](const auto& b) { return b->puerto == puerto; });
+        if (bus == buses.end()) { std::cerr << "ERROR: El mapa '" << especificacion << "' no es de ningun bus." << std::endl; return 1; }
+        (*bus)->archivoMapa = igual == std::string::npos ? especificacion : especificacion.substr(igual + 1);
+    }
+
+    estaciones.push_back(std::make_unique<Estacion>());
+    estaciones[0]->id = 1;
+    estaciones[0]->nombre = "consola";
+    for (const std::string& especificacion : escaneres) {
+        auto est = std::make_unique<Estacion>();
+        std::string puerto;
+        if (!separarRangos(especificacion, puerto, est->zona)) {
+            std::cerr << "ERROR: Estacion invalida: '" << especificacion << "'." << std::endl;
+            return 1;
+        }
+        est->id = (int)estaciones.size() + 1;
+        est->nombre = puerto;
+        est->escaner = crearTransporte();
+        if (!est->escaner->abrir(puerto, BAUDRATE)) {
+            std::cerr << "ERROR: Escaner '" << puerto << "' no encontrado." << std::endl;
+            return 1;
+        }
+        estaciones.push_back(std::move(est));
+    }
+
+    for (auto& bus : buses) bus->lector = std::thread(hiloLecturaSerial, std::ref(*bus));
+    if (!soloTexto) {
+        // Cada Arduino se negocia por separado; en paralelo para no sumar sus esperas
+        std::vector<std::thread> negociaciones;
+        for (auto& bus : buses) {
+            negociaciones.emplace_back([&enlace = *bus] {
+                negociarProtocolo(enlace);
+                if (enlace.binario && !enlace.archivoMapa.empty()) enviarMapa(enlace);
+            });
+        }
+        for (std::thread& t : negociaciones) t.join();
+    }
+    for (auto& bus : buses) bus->escritor = std::thread(hiloEscrituraSerial, std::ref(*bus));
+
+    DestinosActivos activos;
+    bool csvCargado = reanudarSesion(activos);
+    bool reanudada = csvCargado;
+    if (csvCargado && modulosFisicos > 0 && modulosFisicos != datos.modulos.capacidad) {
+        std::cout << "AVISO: La sesion anterior usa " << datos.modulos.capacidad << " modulos; se conserva su asignacion." << std::endl;
+    }
     
     while (!csvCargado) {
         std::cout << "\nArchivo CSV (ej. pedidos.csv): ";
@@ -379,121 +4416,85 @@ int main() {
         if (datos.cargadoExitosamente) {
             csvCargado = true;
             nombreArchivoBackorder = generarNombreArchivo();
+            iniciarDiarioBackorder(nombreArchivoBackorder);
+            iniciarAsignador(datos, modulosFisicos);
+            iniciarSesion(datos);
             std::cout << "Backorders: " << nombreArchivoBackorder << std::endl;
         } else {
             std::cout << "Presione ENTER para reintentar o 'exit' para salir." << std::endl;
             std::string chk; std::getline(std::cin, chk);
-            if (trim(chk) == "exit") { hiloLecturaActivo = false; if (serialThread.joinable()) serialThread.join(); return 0; }
+            if (trim(chk) == "exit") { detenerBuses(); return 0; }
         }
     }
-    
-    while (true) {
-        std::cout << "\n>>> Escanee SKU (o 'exit'): ";
-        std::string sku;
-        if (!(std::cin >> sku)) break; 
-        sku = trim(sku);
-        if (sku == "exit") break;
-
-        if (datos.productosPorSKU.find(sku) == datos.productosPorSKU.end()) {
-            std::cout << "SKU no encontrado." << std::endl;
-            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-            continue;
-        }
-        
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); 
-        std::cout << "Escanee LOTE: ";
-        std::string lote;
-        std::getline(std::cin, lote); lote = trim(lote);
-        size_t pos = lote.find(' '); if (pos != std::string::npos) lote = lote.substr(0, pos);
-
-        const std::string loteReq = datos.productosPorSKU.at(sku).front().lote; 
-
-        if (loteReq != lote) {
-            std::cout << "Lote incorrecto. Requerido: " << loteReq << std::endl;
-            continue;
-        }
-
-        std::cout << "--- SURTIDO: " << sku << " ---" << std::endl;
-        std::set<int> pendientes;
-        std::map<int, int> piezasOriginales;
-        std::map<int, int> piezasAjustadas;
-        std::map<int, int> destino_a_OV;
-        std::queue<int> destinosParaConfirmar; 
-        
-        // Mapa para poder actualizar la bandera 'yaSurtido' de la entrada original
-        std::map<int, EntradaProducto*> mapaEntradasActivas;
-
-        bool todoYaSurtido = true; // Asumimos que todo está surtido hasta encontrar uno que no
-
-        // IMPORTANTE: Usamos 'auto&' para modificar la entrada original
-        for (auto& entrada : datos.productosPorSKU.at(sku)) {
-            if (entrada.lote == loteReq) {
-                // VERIFICACION: Si ya fue surtido, lo saltamos
-                if (entrada.yaSurtido) {
-                    continue; 
-                }
-
-                todoYaSurtido = false; // Encontramos al menos uno pendiente
-                int dest = entrada.destino;
-                if (pendientes.count(dest)) continue; 
-                
-                pendientes.insert(dest);
-                piezasOriginales[dest] = entrada.piezas;
-                piezasAjustadas[dest] = entrada.piezas;
-                destino_a_OV[dest] = entrada.ordenDeVenta; 
-                
-                // Guardamos el puntero para actualizarlo despues
-                mapaEntradasActivas[dest] = &entrada;
-
-                enviarAArduino("ENCENDER_" + std::to_string(dest) + "_" + std::to_string(entrada.piezas));
-                std::cout << "  -> Destino " << dest << ": " << entrada.piezas << " pzs" << std::endl;
-            }
-        }
-        
-        if (todoYaSurtido) {
-            std::cout << "AVISO: Este SKU/Lote ya fue surtido por completo en todas las ordenes." << std::endl;
-            continue; // Volver a pedir SKU
-        }
-        
-        bool scanFinished = false;
-        while (!pendientes.empty() && !scanFinished) {
-            while (!destinosParaConfirmar.empty() && !scanFinished) {
-                int d = destinosParaConfirmar.front(); destinosParaConfirmar.pop();
-                if (pendientes.count(d)) handleConfirmation(d, pendientes, piezasOriginales, piezasAjustadas, sku, loteReq, destino_a_OV, mapaEntradasActivas);
-                if (pendientes.empty()) scanFinished = true;
-            }
-            if (scanFinished || pendientes.empty()) break;
 
-            std::string msg = obtenerMensajeSerial();
-            while (!msg.empty() && !scanFinished) { 
-                processInputMessage(msg, pendientes, piezasOriginales, piezasAjustadas, sku, loteReq, scanFinished, destino_a_OV, destinosParaConfirmar, mapaEntradasActivas);
-                if (scanFinished) break;
-                msg = obtenerMensajeSerial();
-            }
-
-            if (hayEntradaEnConsola()) {
-                std::string man; std::cin >> man; man = trim(man);
-                if (man.rfind("boton_", 0) == 0 || man == "exit" || man[0] == '+' || man[0] == '-') {
-                     processInputMessage(man, pendientes, piezasOriginales, piezasAjustadas, sku, loteReq, scanFinished, destino_a_OV, destinosParaConfirmar, mapaEntradasActivas);
-                }
-                if (std::cin.peek() == '\n') std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-        }
+    {
+        std::lock_guard<std::mutex> lock(mutexDuenos);
+        duenoDestino.assign(datos.modulos.capacidad + 1, 0);
+    }
+    if (datos.modulos.reciclando()) {
+        std::cout << "Modulos: " << datos.modulos.capacidad << " para " << datos.modulos.moduloPorDestino.size() - 1
+                  << " OV; cada modulo pasa a la siguiente OV al completarse la suya." << std::endl;
+    }
+    // Al reanudar, el inventario con los descuentos de la sesion anterior
+    bool hayDescontado = std::filesystem::exists(ARCHIVO_INVENTARIO);
+    if (archivoInventario.empty() && reanudada && hayDescontado) archivoInventario = ARCHIVO_INVENTARIO;
+    else if (reanudada && hayDescontado && archivoInventario != ARCHIVO_INVENTARIO) {
+        std::cout << "AVISO: Se usa " << archivoInventario << "; lo descontado en la sesion anterior esta en " ARCHIVO_INVENTARIO "." << std::endl;
+    }
+    if (!archivoInventario.empty() && !cargarInventario(archivoInventario)) { detenerBuses(); return 1; }
+    publicarIndice(datos);
+    iniciarSecuencia(datos);
+    iniciarAvance(datos);
+    iniciarCargador();
+    if (estaciones.size() > 1) std::cout << "Estaciones: " << estaciones.size() << ", buses: " << buses.size() << std::endl;
 
-        if (!pendientes.empty()) {
-            for (int d : pendientes) {
-                enviarAArduino("APAGAR_DESTINO_" + std::to_string(d));
-                registrarBackorder(sku, destino_a_OV[d], d, piezasOriginales[d], 0, loteReq, loteReq, "Cancelado"); 
-                // NOTA: Si se cancela, NO lo marcamos como surtido, para permitir re-intento.
-            }
-        } else {
-            std::cout << "--- COMPLETO ---" << std::endl;
-        }
+    iniciarMetricas();
+    // La consola lee en su propio hilo; getline no se puede interrumpir, asi que se suelta
+    estaciones[0]->hiloEntrada = std::thread(hiloEntradaConsola, std::ref(*estaciones[0]));
+    estaciones[0]->hiloEntrada.detach();
+    for (size_t i = 1; i < estaciones.size(); ++i) {
+        estaciones[i]->hiloEntrada = std::thread(hiloEntradaEscaner, std::ref(*estaciones[i]));
+    }
+    // Lo que quedo encendido en la sesion anterior se retoma en la consola
+    estaciones[0]->hilo = std::thread(hiloEstacion, std::ref(*estaciones[0]), std::move(activos));
+    for (size_t i = 1; i < estaciones.size(); ++i) {
+        estaciones[i]->hilo = std::thread(hiloEstacion, std::ref(*estaciones[i]), DestinosActivos());
+    }
+    for (auto& est : estaciones) est->hilo.join();
+    for (size_t i = 1; i < estaciones.size(); ++i) {
+        estaciones[i]->leyendo = false;
+        estaciones[i]->escaner->despertar();
+        estaciones[i]->hiloEntrada.join();
+        estaciones[i]->escaner->cerrar();
     }
 
-    hiloLecturaActivo = false;
-    if (serialThread.joinable()) serialThread.join();
-    if (hSerial != INVALID_HANDLE_VALUE) CloseHandle(hSerial);
+    detenerCargador();
+    detenerAvance();
+    for (auto& bus : buses) reportarBarrido(*bus);
+    detenerBuses();
+    // Con lineas pendientes, al volver a abrir se reanuda sin reaplicar la bitacora; con la ola
+    // completa la sesion se cierra y no se ofrece reanudarla
+    bool hayPendientes = std::any_of(datos.grupos.begin(), datos.grupos.end(), [](const GrupoLote& g) { return g.pendientes > 0; });
+    if (hayPendientes) guardarSnapshot(datos);
+    guardarInventario();
+    if (inventario.cargado) std::cout << "Inventario actualizado: " ARCHIVO_INVENTARIO << std::endl;
+    esperarSnapshot();
+    detenerDiario(diarioWAL);
+    if (!hayPendientes) cerrarSesion();
+    detenerDiario(diario);
+    std::cout << "Backorders: " << diario.registros << " registros en " << diario.grupos << " escrituras";
+    if (diario.fallas > 0) std::cout << ", " << diario.fallas << " escrituras fallidas (reintentadas)";
+    if (diario.perdidos > 0) std::cout << ", " << diario.perdidos << " registros PERDIDOS";
+    std::cout << "." << std::endl;
+    uint64_t encolados = 0, coalescidos = 0, enviados = 0;
+    for (auto& bus : buses) {
+        encolados += bus->comandosEncolados; coalescidos += bus->comandosCoalescidos; enviados += bus->comandosEnviados;
+        bus->transporte->cerrar();
+    }
+    std::cout << "Comandos: " << encolados << " encolados, " << coalescidos << " coalescidos, " << enviados << " enviados." << std::endl;
+    if (estaciones.size() > 1) {
+        for (auto& est : estaciones) std::cout << "Estacion " << est->nombre << ": " << est->gruposSurtidos << " surtidos." << std::endl;
+    }
+    detenerMetricas();
     return 0;
-}
\ No newline at end of file
+}
@@ -1,50 +1,318 @@
+#include <Arduino.h>
 #include <Wire.h>
 #include <TM1637Display.h>
+#include <EEPROM.h>
 
 /* * CONFIGURACIÓN DE HARDWARE MULTI-MODULO
  * v5.1 - Corrección de Lógica LED (Active HIGH)
+ * v5.2 - Protocolo binario con tramas multi-destino, CRC y ACK/NACK (texto sigue soportado)
+ * v5.3 - Botones y pantallas sin delay(): una maquina de estados por modulo con millis()
+ * v5.4 - Hasta MAX_DESTINOS modulos detras de multiplexores TCA9548A; el mapa vive en la
+ *        EEPROM y lo manda el host (OP_MAPA). Los TM1637 pueden compartir CLK: cada uno
+ *        solo necesita su propio DIO.
+ * v5.5 - Las tramas del host se recuerdan en una ventana de 32 secuencias: una retransmision
+ *        que llega despues de tramas mas nuevas ya no se vuelve a aplicar.
+ * v5.6 - Protocolo v2: los eventos (boton/+/-) tambien llevan ACK del host y se reenvian;
+ *        un 0xA5 a media linea de texto abre trama (el ruido ya no deja sordo al parser).
+ *
+ * Compila en PC contra los simulados de host/ (Wire, TM1637Display, Serial):
+ *   g++ -std=c++17 -I host -x c++ -c Smashead.ino
  */
 
 // --- CONFIGURACIÓN DE CANTIDAD DE DESTINOS ---
-const int NUM_DESTINOS = 2; 
+// Un Mega tiene RAM para ~96 modulos; un solo bus I2C llega a 8 PCF8574 (0x20-0x27), y con
+// hasta 8 TCA9548A (0x70-0x77) de 8 canales cada uno se repiten esas direcciones por canal.
+const int MAX_DESTINOS = 96;
+const int MAX_ID_DESTINO = 254;  // Ids de 1 a 254: la tabla id -> posicion es un arreglo de bytes
+const byte SIN_MUX = 0xFF;       // Canal de un PCF conectado directo al bus principal
+const byte MUX_BASE = 0x70;
+int numDestinos = 0;
 
 // Estructura que define un Módulo PTL completo
 struct ModuloPTL {
   int id;                  
-  int pinClk;              
-  int pinDio;              
+  byte pinClk;             
+  byte pinDio;             
   byte pcfAddr;            
+  byte canal;              // (multiplexor << 3) | canal del TCA9548A, o SIN_MUX
   
   TM1637Display* displayObj; 
   int cantidad;            
   bool activo;             
   byte estadoPCF;          
+
+  // Maquina de estados de botones (bits en 1 = suelto, como los lee el PCF8574)
+  byte lecturaCruda;             // Ultima lectura del PCF
+  byte botonesEstables;          // Lectura que ya duro ANTIRREBOTE_MS
+  unsigned long cambioDesde;     // Cuando cambio lecturaCruda
+  unsigned long siguienteRepeticion; // +/- sostenido: proximo paso automatico (0 = ninguno)
+  unsigned long animacionHasta;  // "dOnE" o prueba de encendido en pantalla (0 = ninguna)
 };
 
 // --- MAPEO DE HARDWARE ---
-ModuloPTL destinos[NUM_DESTINOS] = {
-  // { ID, CLK, DIO, DIRECCION_I2C, ... }
-  { 1, 26, 27, 0x20, NULL, 0, false, 0xF7 }, // Inicializamos estado en 0xF7 (LED apagado/LOW)
-  { 2, 28, 29, 0x21, NULL, 0, false, 0xF7 } 
+// Se llena desde la EEPROM en cargarMapa(); si no hay mapa valido se usa MAPA_POR_DEFECTO.
+ModuloPTL destinos[MAX_DESTINOS];
+byte posicionPorId[MAX_ID_DESTINO + 1];  // id -> indice en destinos[], 0xFF si no existe
+
+// Entrada del mapa tal como viaja en OP_MAPA y se guarda en la EEPROM (6 bytes):
+// [id u16][canal][direccion PCF][pin CLK][pin DIO]
+struct EntradaMapa {
+  int id;
+  byte canal;
+  byte pcfAddr;
+  byte pinClk;
+  byte pinDio;
 };
+const int ENTRADA_MAPA = 6;
+
+const EntradaMapa MAPA_POR_DEFECTO[] = {
+  // { ID, CANAL, DIRECCION_I2C, CLK, DIO }
+  { 1, SIN_MUX, 0x20, 26, 27 },
+  { 2, SIN_MUX, 0x21, 28, 29 }
+};
+
+// EEPROM: [0..1] "PM" [2] version [3] modulos [4..5] CRC16 de las entradas [6..] entradas.
+// La cabecera se escribe al final, asi un mapa a medias nunca se toma como valido.
+const int MAPA_CABECERA = 6;
+const byte MAPA_VERSION = 1;
+int siguienteEntradaMapa = -1;                 // Tramo de OP_MAPA que se espera (-1 = ninguno)
+byte idsRecibidos[(MAX_ID_DESTINO + 8) / 8];   // Para rechazar ids repetidos entre tramos
 
 // Máscaras de bits
 const byte MASK_BTN_CONFIRM = 0x01; // P0
 const byte MASK_BTN_UP      = 0x02; // P1
 const byte MASK_BTN_DOWN    = 0x04; // P2
 const byte MASK_LED_AVISO   = 0x08; // P3
+const byte MASK_BOTONES     = MASK_BTN_CONFIRM | MASK_BTN_UP | MASK_BTN_DOWN;
+
+// --- TIEMPOS DE BOTONES Y PANTALLA ---
+const unsigned long ANTIRREBOTE_MS = 30;
+const unsigned long REPETICION_INICIO_MS = 500;  // +/- sostenido empieza a repetir tras esto...
+const unsigned long REPETICION_CADA_MS = 150;    // ...y luego repite a este ritmo
+const unsigned long ANIMACION_DONE_MS = 500;
+const unsigned long PRUEBA_PANTALLA_MS = 200;
+
+// Planificador de lectura: cada vuelta de loop() lee a lo mucho LECTURAS_POR_VUELTA modulos
+// y sigue desde ahi en la siguiente, para que la serial se atienda igual con 8 que con 96
+// modulos. Un barrido es la vuelta completa al rack; su duracion es la latencia de botones.
+const int LECTURAS_POR_VUELTA = 8;
+int cursorBarrido = 0;
+unsigned long inicioBarrido = 0;
+unsigned long barridoUltimoMs = 0;
+unsigned long barridoMaximoMs = 0;
+byte canalAbierto = SIN_MUX;   // Canal del TCA9548A que quedo seleccionado
+
+// Linea INT de los PCF8574 (colector abierto, baja al cambiar una entrada). Con -1 se leen
+// todos los modulos activos en cada vuelta; con un pin solo se leen cuando algo cambio.
+const int PIN_INT_PCF = -1;
+
+// --- PROTOCOLO BINARIO (debe coincidir con Smashead.cpp) ---
+// Trama: [0xA5][VERSION][SEQ][OPCODE][LEN][DATOS x LEN][CRC16 alto][CRC16 bajo]
+const byte TRAMA_INICIO = 0xA5;
+const byte PROTOCOLO_VERSION = 2;
+const int TRAMA_CABECERA = 5;
+const int TRAMA_MAX_DATOS = 240;
+const unsigned long BAUDRATE_INICIAL = 9600;
+const unsigned long TRAMA_TIMEOUT_MS = 50;       // Trama a medias tras este tiempo = bytes perdidos
+const unsigned long BAUDIOS_CONFIRMAR_MS = 2000; // Sin trama valida a la nueva velocidad se regresa a 9600
+const unsigned long EVENTO_REINTENTO_MS = 250;   // Igual que la retransmision del host
+const byte EVENTO_MAX_INTENTOS = 4;
+const byte MAX_EVENTOS_PENDIENTES = 8;
+const byte VENTANA_SECUENCIAS = 32;
 
-String inputString = "";
+const byte OP_HOLA = 0x01, OP_BAUDIOS = 0x02;
+const byte OP_ENCENDER = 0x10, OP_ACTUALIZAR = 0x11, OP_APAGAR = 0x12, OP_APAGAR_TODO = 0x13;
+const byte OP_BOTON = 0x20, OP_MAS = 0x21, OP_MENOS = 0x22;
+const byte OP_MAPA = 0x30, OP_BARRIDO = 0x31;
+const byte OP_ACK = 0x7E, OP_NACK = 0x7F;
+const byte NACK_CRC = 1, NACK_OPCODE = 2, NACK_LONGITUD = 3, NACK_INCOMPLETA = 4, NACK_MAPA = 5;
+
+bool modoBinario = false;    // Se activa con la primera trama valida; antes se responde en texto
+byte secuenciaEventos = 0;
+// El host tiene varias tramas en vuelo: una retransmitida puede llegar despues de otras mas
+// nuevas. Bit k de secuenciasVistas = ya se aplico ultimaSecuencia - k.
+int ultimaSecuencia = -1;
+uint32_t secuenciasVistas = 0;
+
+// Eventos enviados que el host aun no confirma; se reenvian como el host reenvia sus tramas.
+struct EventoPendiente {
+  byte seq;
+  byte opcode;
+  int id;
+  unsigned long enviado;
+  byte intentos;
+};
+EventoPendiente eventosPendientes[MAX_EVENTOS_PENDIENTES];
+byte numEventosPendientes = 0;
+
+unsigned long baudiosPendientesDesde = 0;
+
+byte trama[TRAMA_CABECERA + TRAMA_MAX_DATOS + 2];
+int largoTrama = 0;
+unsigned long ultimoByteTrama = 0;
+
+char lineaTexto[40];         // Comandos de texto sin String: nada de memoria dinamica
+byte largoTexto = 0;
+
+// Prototipos (el IDE de Arduino los genera solo; en PC hacen falta)
+void cargarMapa();
+void aplicarMapa(const EntradaMapa* mapa, int n);
+uint16_t leerMapaEEPROM(EntradaMapa* mapa, int n);
+bool recibirMapa(const byte* datos, byte len);
+void seleccionarCanal(byte canal);
+void cerrarBarrido();
+void actualizarPCF(int idx, byte nuevoEstado);
+void setLed(int idx, bool on);
+void revisarModulo(int i, unsigned long ahora);
+bool botonesEnProceso(int i);
+void accionBoton(int i, byte mascara);
+uint16_t crc16(const byte* datos, int n);
+void enviarTrama(byte opcode, byte seq, const byte* datos, byte len);
+void enviarNack(byte seq, byte motivo);
+void enviarEvento(byte opcode, int id);
+void transmitirEvento(const EventoPendiente& e);
+void confirmarEvento(byte seq);
+void revisarEventos();
+bool secuenciaVista(byte seq);
+void marcarSecuencia(byte seq);
+void verificarComandosSeriales();
+int buscarModulo(int targetId);
+void encenderModulo(int idx, int qty);
+void procesarTrama(byte seq, byte opcode, const byte* datos, byte len);
+void procesarComando(char* cmd);
+void confirmarDestino(int idx);
+void resetModulo(int idx);
+void mostrarEspera(int idx);
 
 void setup() {
-  Serial.begin(9600); 
-  inputString.reserve(100);
+  Serial.begin(BAUDRATE_INICIAL); 
   Wire.begin();
 
-  // Inicializar cada módulo configurado
-  for (int i = 0; i < NUM_DESTINOS; i++) {
-    destinos[i].displayObj = new TM1637Display(destinos[i].pinClk, destinos[i].pinDio);
-    destinos[i].displayObj->setBrightness(0x0f);
+  cargarMapa();
+  if (PIN_INT_PCF >= 0) pinMode(PIN_INT_PCF, INPUT_PULLUP);
+
+  Serial.println(F("SYSTEM_READY"));
+}
+
+void loop() {
+  verificarComandosSeriales();
+  revisarEventos();
+
+  if (baudiosPendientesDesde != 0 && millis() - baudiosPendientesDesde > BAUDIOS_CONFIRMAR_MS) {
+    Serial.begin(BAUDRATE_INICIAL);
+    modoBinario = false;
+    baudiosPendientesDesde = 0;
+  }
+  
+  // Ningun modulo espera a otro: cada uno avanza su propio estado y se sigue con el siguiente
+  unsigned long ahora = millis();
+  for (int i = 0; i < numDestinos; i++) {
+    if (destinos[i].animacionHasta != 0 && (long)(ahora - destinos[i].animacionHasta) >= 0) {
+      destinos[i].animacionHasta = 0;
+      if (destinos[i].activo) destinos[i].displayObj->showNumberDec(destinos[i].cantidad);
+      else mostrarEspera(i);
+    }
+  }
+
+  bool sinCambios = PIN_INT_PCF >= 0 && digitalRead(PIN_INT_PCF) == HIGH;
+  int lecturas = 0;
+  for (int revisados = 0; revisados < numDestinos && lecturas < LECTURAS_POR_VUELTA; revisados++) {
+    int i = cursorBarrido;
+    if (++cursorBarrido >= numDestinos) cerrarBarrido();
+    if (destinos[i].activo && (!sinCambios || botonesEnProceso(i))) {
+      revisarModulo(i, ahora);
+      lecturas++;
+    }
+  }
+}
+
+void cerrarBarrido() {
+  unsigned long ahora = millis();
+  cursorBarrido = 0;
+  barridoUltimoMs = ahora - inicioBarrido;
+  if (barridoUltimoMs > barridoMaximoMs) barridoMaximoMs = barridoUltimoMs;
+  inicioBarrido = ahora;
+}
+
+// Un TCA9548A solo se reescribe al cambiar de canal; como el mapa va ordenado por canal,
+// un barrido cambia de canal pocas veces. Al pasar a otro multiplexor (o al bus principal)
+// se cierra el anterior para no dejar dos PCF con la misma direccion en paralelo.
+void seleccionarCanal(byte canal) {
+  if (canal == canalAbierto) return;
+  if (canalAbierto != SIN_MUX && (canal == SIN_MUX || (canal >> 3) != (canalAbierto >> 3))) {
+    Wire.beginTransmission(MUX_BASE + (canalAbierto >> 3));
+    Wire.write((byte)0);
+    Wire.endTransmission();
+  }
+  if (canal != SIN_MUX) {
+    Wire.beginTransmission(MUX_BASE + (canal >> 3));
+    Wire.write((byte)(1 << (canal & 0x07)));
+    Wire.endTransmission();
+  }
+  canalAbierto = canal;
+}
+
+// Lee el mapa de la EEPROM (o el de fabrica) y arranca los modulos con el.
+void cargarMapa() {
+  EntradaMapa mapa[MAX_DESTINOS];
+  int n = EEPROM.read(3);
+  bool valido = EEPROM.read(0) == 'P' && EEPROM.read(1) == 'M' && EEPROM.read(2) == MAPA_VERSION
+             && n > 0 && n <= MAX_DESTINOS
+             && leerMapaEEPROM(mapa, n) == (((uint16_t)EEPROM.read(4) << 8) | EEPROM.read(5));
+  if (valido) aplicarMapa(mapa, n);
+  else aplicarMapa(MAPA_POR_DEFECTO, sizeof(MAPA_POR_DEFECTO) / sizeof(MAPA_POR_DEFECTO[0]));
+}
+
+// Lee n entradas de la EEPROM y devuelve su CRC16.
+uint16_t leerMapaEEPROM(EntradaMapa* mapa, int n) {
+  byte entrada[ENTRADA_MAPA];
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < n; i++) {
+    for (int b = 0; b < ENTRADA_MAPA; b++) {
+      entrada[b] = EEPROM.read(MAPA_CABECERA + i * ENTRADA_MAPA + b);
+      crc ^= (uint16_t)entrada[b] << 8;
+      for (byte k = 0; k < 8; k++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    mapa[i].id = entrada[0] | (entrada[1] << 8);
+    mapa[i].canal = entrada[2];
+    mapa[i].pcfAddr = entrada[3];
+    mapa[i].pinClk = entrada[4];
+    mapa[i].pinDio = entrada[5];
+  }
+  return crc;
+}
+
+void aplicarMapa(const EntradaMapa* mapa, int n) {
+  for (int i = 0; i < numDestinos; i++) delete destinos[i].displayObj;
+  memset(posicionPorId, 0xFF, sizeof(posicionPorId));
+  numDestinos = n;
+  cursorBarrido = 0;
+  inicioBarrido = millis();
+  barridoUltimoMs = barridoMaximoMs = 0;
+
+  // Los multiplexores conservan su canal tras un reinicio del Arduino: se cierran todos
+  for (byte mux = 0; mux < 8; mux++) {
+    Wire.beginTransmission(MUX_BASE + mux);
+    Wire.write((byte)0);
+    Wire.endTransmission();
+  }
+  canalAbierto = SIN_MUX;
+
+  for (int i = 0; i < n; i++) {
+    ModuloPTL& m = destinos[i];
+    m.id = mapa[i].id;
+    m.canal = mapa[i].canal;
+    m.pcfAddr = mapa[i].pcfAddr;
+    m.pinClk = mapa[i].pinClk;
+    m.pinDio = mapa[i].pinDio;
+    m.cantidad = 0;
+    m.activo = false;
+    m.lecturaCruda = m.botonesEstables = 0xFF;
+    m.cambioDesde = m.siguienteRepeticion = 0;
+    posicionPorId[m.id] = i;
+
+    m.displayObj = new TM1637Display(m.pinClk, m.pinDio);
+    m.displayObj->setBrightness(0x0f);
     
     // Inicializar PCF8574
     // IMPORTANTE: Ponemos P0-P2 en HIGH (1) para que funcionen como entradas.
@@ -52,28 +320,62 @@ void setup() {
     // 1111 0111 = 0xF7
     actualizarPCF(i, 0xF7); 
     
-    // Test visual rápido
+    // Test visual rápido: todas las pantallas a la vez; loop() las regresa a "----"
     uint8_t allOn[] = { 0xff, 0xff, 0xff, 0xff };
-    destinos[i].displayObj->setSegments(allOn);
-    delay(200);
-    mostrarEspera(i);
+    m.displayObj->setSegments(allOn);
+    m.animacionHasta = millis() + PRUEBA_PANTALLA_MS;
   }
-
-  Serial.println(F("SYSTEM_READY"));
 }
 
-void loop() {
-  verificarComandosSeriales();
-  
-  for (int i = 0; i < NUM_DESTINOS; i++) {
-    if (destinos[i].activo) {
-      gestionarBotones(i);
+// OP_MAPA: [total][inicio][entradas...], tramos en orden. Cada tramo se valida (ids de 1 a
+// MAX_ID_DESTINO sin repetir, canal existente) antes de escribirlo en la EEPROM; con el
+// ultimo se escribe la cabecera y se reinician los modulos. Hasta entonces siguen los de
+// antes. Escribir la EEPROM detiene el loop unos ms por byte: el host espera cada ACK.
+bool recibirMapa(const byte* datos, byte len) {
+  if (len < 2 || (len - 2) % ENTRADA_MAPA != 0) return false;
+  int total = datos[0], inicio = datos[1], n = (len - 2) / ENTRADA_MAPA;
+  if (total == 0 || total > MAX_DESTINOS || inicio + n > total) return false;
+  if (inicio == 0) {
+    siguienteEntradaMapa = 0;
+    memset(idsRecibidos, 0, sizeof(idsRecibidos));
+  }
+  if (inicio != siguienteEntradaMapa) return false;
+
+  for (int i = 0; i < n; i++) {
+    const byte* e = datos + 2 + i * ENTRADA_MAPA;
+    int id = e[0] | (e[1] << 8);
+    bool repetido = id >= 1 && id <= MAX_ID_DESTINO && (idsRecibidos[id >> 3] & (1 << (id & 7)));
+    if (id < 1 || id > MAX_ID_DESTINO || repetido || (e[2] != SIN_MUX && e[2] >= 64)) {
+      siguienteEntradaMapa = -1;
+      return false;
     }
+    idsRecibidos[id >> 3] |= 1 << (id & 7);
   }
+  if (inicio == 0) EEPROM.update(0, 0xFF); // El mapa guardado deja de valer hasta el ultimo tramo
+  for (int i = 0; i < n * ENTRADA_MAPA; i++) {
+    EEPROM.update(MAPA_CABECERA + inicio * ENTRADA_MAPA + i, datos[2 + i]);
+  }
+  siguienteEntradaMapa = inicio + n;
+  if (siguienteEntradaMapa < total) return true;
+
+  siguienteEntradaMapa = -1;
+  EntradaMapa mapa[MAX_DESTINOS];
+  uint16_t crc = leerMapaEEPROM(mapa, total);
+  EEPROM.update(1, 'M');
+  EEPROM.update(2, MAPA_VERSION);
+  EEPROM.update(3, (byte)total);
+  EEPROM.update(4, (byte)(crc >> 8));
+  EEPROM.update(5, (byte)(crc & 0xFF));
+  EEPROM.update(0, 'P');
+
+  for (int i = 0; i < numDestinos; i++) resetModulo(i);
+  aplicarMapa(mapa, total);
+  return true;
 }
 
 void actualizarPCF(int idx, byte nuevoEstado) {
   destinos[idx].estadoPCF = nuevoEstado;
+  seleccionarCanal(destinos[idx].canal);
   Wire.beginTransmission(destinos[idx].pcfAddr);
   Wire.write(destinos[idx].estadoPCF);
   Wire.endTransmission();
@@ -93,106 +395,315 @@ void setLed(int idx, bool on) {
   actualizarPCF(idx, destinos[idx].estadoPCF);
 }
 
-void gestionarBotones(int i) {
-  Wire.requestFrom(destinos[i].pcfAddr, (uint8_t)1);
-  if (Wire.available()) {
-    byte lectura = Wire.read();
-    
-    // --- BOTÓN CONFIRMAR (P0) ---
-    if (!(lectura & MASK_BTN_CONFIRM)) {
-      delay(50); 
-      Wire.requestFrom(destinos[i].pcfAddr, (uint8_t)1);
-      if (!(Wire.read() & MASK_BTN_CONFIRM)) {
-        confirmarDestino(i);
-        do { Wire.requestFrom(destinos[i].pcfAddr, (uint8_t)1); delay(10); } 
-        while (!(Wire.read() & MASK_BTN_CONFIRM));
-      }
+// Rebote pendiente o +/- sostenido: hay que seguir leyendo aunque INT no haya bajado.
+bool botonesEnProceso(int i) {
+  return destinos[i].lecturaCruda != destinos[i].botonesEstables || destinos[i].siguienteRepeticion != 0;
+}
+
+// Una sola lectura del PCF por vuelta. Un cambio cuenta cuando la lectura se mantiene
+// ANTIRREBOTE_MS; se actua al presionar (flanco de bajada) y +/- repiten si se sostienen.
+void revisarModulo(int i, unsigned long ahora) {
+  ModuloPTL& m = destinos[i];
+  seleccionarCanal(m.canal);
+  if (Wire.requestFrom(m.pcfAddr, (uint8_t)1) != 1 || !Wire.available()) return;
+  byte lectura = (byte)(Wire.read() | ~MASK_BOTONES);
+
+  if (lectura != m.lecturaCruda) {
+    m.lecturaCruda = lectura;
+    m.cambioDesde = ahora;
+  } else if (lectura != m.botonesEstables && ahora - m.cambioDesde >= ANTIRREBOTE_MS) {
+    byte presionados = m.botonesEstables & ~lectura;
+    m.botonesEstables = lectura;
+    m.siguienteRepeticion = 0;
+    // Como antes, un boton a la vez con prioridad Confirmar > Subir > Bajar
+    if (presionados & MASK_BTN_CONFIRM) accionBoton(i, MASK_BTN_CONFIRM);
+    else if (presionados & MASK_BTN_UP) accionBoton(i, MASK_BTN_UP);
+    else if (presionados & MASK_BTN_DOWN) accionBoton(i, MASK_BTN_DOWN);
+    if (m.activo && (presionados & (MASK_BTN_UP | MASK_BTN_DOWN)) && !(presionados & MASK_BTN_CONFIRM)) {
+      m.siguienteRepeticion = ahora + REPETICION_INICIO_MS;
     }
-    
-    // --- BOTÓN SUBIR (P1) ---
-    else if (!(lectura & MASK_BTN_UP)) {
-      delay(150);
-      Serial.print(F("+")); Serial.println(destinos[i].id);
-      destinos[i].cantidad++;
-      destinos[i].displayObj->showNumberDec(destinos[i].cantidad);
-      do { Wire.requestFrom(destinos[i].pcfAddr, (uint8_t)1); delay(10); } 
-      while (!(Wire.read() & MASK_BTN_UP));
+  }
+
+  if (m.siguienteRepeticion != 0 && (long)(ahora - m.siguienteRepeticion) >= 0) {
+    if (!(m.botonesEstables & MASK_BTN_UP)) accionBoton(i, MASK_BTN_UP);
+    else if (!(m.botonesEstables & MASK_BTN_DOWN)) accionBoton(i, MASK_BTN_DOWN);
+    m.siguienteRepeticion = (m.botonesEstables & (MASK_BTN_UP | MASK_BTN_DOWN)) == (MASK_BTN_UP | MASK_BTN_DOWN)
+                          ? 0 : ahora + REPETICION_CADA_MS;
+  }
+}
+
+void accionBoton(int i, byte mascara) {
+  if (mascara == MASK_BTN_CONFIRM) {
+    confirmarDestino(i);
+  } else if (mascara == MASK_BTN_UP) {
+    enviarEvento(OP_MAS, destinos[i].id);
+    destinos[i].cantidad++;
+    destinos[i].displayObj->showNumberDec(destinos[i].cantidad);
+  } else {
+    enviarEvento(OP_MENOS, destinos[i].id);
+    if (destinos[i].cantidad > 0) {
+        destinos[i].cantidad--;
+        destinos[i].displayObj->showNumberDec(destinos[i].cantidad);
     }
-    
-    // --- BOTÓN BAJAR (P2) ---
-    else if (!(lectura & MASK_BTN_DOWN)) {
-      delay(150);
-      Serial.print(F("-")); Serial.println(destinos[i].id);
-      if (destinos[i].cantidad > 0) {
-          destinos[i].cantidad--;
-          destinos[i].displayObj->showNumberDec(destinos[i].cantidad);
-      }
-      do { Wire.requestFrom(destinos[i].pcfAddr, (uint8_t)1); delay(10); } 
-      while (!(Wire.read() & MASK_BTN_DOWN));
+  }
+}
+
+uint16_t crc16(const byte* datos, int n) {
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < n; i++) {
+    crc ^= (uint16_t)datos[i] << 8;
+    for (byte b = 0; b < 8; b++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+void enviarTrama(byte opcode, byte seq, const byte* datos, byte len) {
+  byte cabecera[TRAMA_CABECERA] = { TRAMA_INICIO, PROTOCOLO_VERSION, seq, opcode, len };
+  uint16_t crc = crc16(cabecera + 1, TRAMA_CABECERA - 1);
+  for (byte i = 0; i < len; i++) {
+    crc ^= (uint16_t)datos[i] << 8;
+    for (byte b = 0; b < 8; b++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  Serial.write(cabecera, TRAMA_CABECERA);
+  if (len > 0) Serial.write(datos, len);
+  Serial.write((byte)(crc >> 8));
+  Serial.write((byte)(crc & 0xFF));
+}
+
+void enviarNack(byte seq, byte motivo) {
+  enviarTrama(OP_NACK, seq, &motivo, 1);
+}
+
+// Boton/+/-: en binario como trama que espera ACK, en texto como "boton_N", "+N", "-N"
+void enviarEvento(byte opcode, int id) {
+  if (modoBinario) {
+    if (numEventosPendientes == MAX_EVENTOS_PENDIENTES) { // Se descarta el mas viejo
+      memmove(eventosPendientes, eventosPendientes + 1, (MAX_EVENTOS_PENDIENTES - 1) * sizeof(EventoPendiente));
+      numEventosPendientes--;
     }
+    EventoPendiente& e = eventosPendientes[numEventosPendientes++];
+    e.seq = secuenciaEventos++;
+    e.opcode = opcode;
+    e.id = id;
+    e.enviado = millis();
+    e.intentos = 1;
+    transmitirEvento(e);
+    return;
   }
+  if (opcode == OP_BOTON) Serial.print(F("boton_"));
+  else if (opcode == OP_MAS) Serial.print(F("+"));
+  else Serial.print(F("-"));
+  Serial.println(id);
 }
 
-void verificarComandosSeriales() {
-  while (Serial.available()) {
-    char inChar = (char)Serial.read();
-    if (inChar == '\n') {
-      procesarComando(inputString);
-      inputString = "";
+void transmitirEvento(const EventoPendiente& e) {
+  byte datos[2] = { (byte)(e.id & 0xFF), (byte)(e.id >> 8) };
+  enviarTrama(e.opcode, e.seq, datos, 2);
+}
+
+void confirmarEvento(byte seq) {
+  for (byte i = 0; i < numEventosPendientes; i++) {
+    if (eventosPendientes[i].seq != seq) continue;
+    memmove(eventosPendientes + i, eventosPendientes + i + 1, (numEventosPendientes - i - 1) * sizeof(EventoPendiente));
+    numEventosPendientes--;
+    return;
+  }
+}
+
+// Reenvia los eventos sin ACK; tras EVENTO_MAX_INTENTOS se dan por perdidos.
+void revisarEventos() {
+  unsigned long ahora = millis();
+  for (byte i = 0; i < numEventosPendientes;) {
+    EventoPendiente& e = eventosPendientes[i];
+    if (ahora - e.enviado < EVENTO_REINTENTO_MS) { i++; continue; }
+    if (e.intentos < EVENTO_MAX_INTENTOS) {
+      e.intentos++;
+      e.enviado = ahora;
+      transmitirEvento(e);
+      i++;
     } else {
-      inputString += inChar;
+      memmove(eventosPendientes + i, eventosPendientes + i + 1, (numEventosPendientes - i - 1) * sizeof(EventoPendiente));
+      numEventosPendientes--;
     }
   }
 }
 
-void procesarComando(String cmd) {
-  cmd.trim();
-  int firstUnderscore = cmd.indexOf('_');
-  int lastUnderscore = cmd.lastIndexOf('_');
-  
-  if (firstUnderscore != -1) {
-    String accion = cmd.substring(0, firstUnderscore);
-    int targetId; 
-    int qty = 0;
-
-    if (lastUnderscore != firstUnderscore) {
-      targetId = cmd.substring(firstUnderscore + 1, lastUnderscore).toInt();
-      qty = cmd.substring(lastUnderscore + 1).toInt();
-    } else {
-      targetId = cmd.substring(firstUnderscore + 1).toInt();
+// Una secuencia que quedo mas de VENTANA_SECUENCIAS atras cuenta como nueva.
+bool secuenciaVista(byte seq) {
+  if (ultimaSecuencia < 0) return false;
+  byte atras = (byte)(ultimaSecuencia - seq);
+  return atras < VENTANA_SECUENCIAS && (secuenciasVistas & (1UL << atras));
+}
+
+void marcarSecuencia(byte seq) {
+  if (ultimaSecuencia < 0) {
+    ultimaSecuencia = seq;
+    secuenciasVistas = 1;
+    return;
+  }
+  byte atras = (byte)(ultimaSecuencia - seq);
+  if (atras < VENTANA_SECUENCIAS) {
+    secuenciasVistas |= 1UL << atras;
+    return;
+  }
+  byte adelante = (byte)(seq - ultimaSecuencia);
+  secuenciasVistas = adelante >= VENTANA_SECUENCIAS ? 1 : (secuenciasVistas << adelante) | 1;
+  ultimaSecuencia = seq;
+}
+
+void verificarComandosSeriales() {
+  if (largoTrama > 0 && millis() - ultimoByteTrama > TRAMA_TIMEOUT_MS) {
+    if (largoTrama > 2) enviarNack(trama[2], NACK_INCOMPLETA);
+    largoTrama = 0;
+  }
+
+  while (Serial.available()) {
+    byte c = (byte)Serial.read();
+
+    // 0xA5 no aparece en los comandos de texto: a media linea, lo anterior era ruido
+    if (largoTrama == 0 && c == TRAMA_INICIO) {
+      largoTexto = 0;
+      trama[largoTrama++] = c;
+      ultimoByteTrama = millis();
+      continue;
     }
-    
-    int idx = -1;
-    for(int i=0; i<NUM_DESTINOS; i++) {
-      if(destinos[i].id == targetId) {
-        idx = i;
-        break;
+    if (largoTrama > 0) {
+      trama[largoTrama++] = c;
+      ultimoByteTrama = millis();
+      if (largoTrama == TRAMA_CABECERA && trama[4] > TRAMA_MAX_DATOS) {
+        enviarNack(trama[2], NACK_LONGITUD);
+        largoTrama = 0;
+      } else if (largoTrama >= TRAMA_CABECERA && largoTrama == TRAMA_CABECERA + trama[4] + 2) {
+        uint16_t crc = ((uint16_t)trama[largoTrama - 2] << 8) | trama[largoTrama - 1];
+        if (trama[1] != PROTOCOLO_VERSION || crc16(trama + 1, largoTrama - 3) != crc) enviarNack(trama[2], NACK_CRC);
+        else procesarTrama(trama[2], trama[3], trama + TRAMA_CABECERA, trama[4]);
+        largoTrama = 0;
       }
+      continue;
     }
 
-    if (idx != -1) {
-      if (accion == "ENCENDER" || accion == "ACTUALIZAR") {
-        destinos[idx].cantidad = qty;
-        destinos[idx].activo = true;
-        destinos[idx].displayObj->showNumberDec(qty);
-        setLed(idx, true); // <--- Esto ahora mandará HIGH para encender
-      } 
-      else if (accion == "APAGAR" || accion == "APAGAR_DESTINO") { 
-        resetModulo(idx);
-      }
-    } else {
-       if (cmd == "APAGAR_TODO") {
-         for(int i=0; i<NUM_DESTINOS; i++) resetModulo(i);
-       }
+    if (c == '\n') {
+      lineaTexto[largoTexto] = '\0';
+      procesarComando(lineaTexto);
+      largoTexto = 0;
+    } else if (largoTexto < sizeof(lineaTexto) - 1) {
+      lineaTexto[largoTexto++] = (char)c;
+    }
+  }
+}
+
+int buscarModulo(int targetId) {
+  if (targetId < 1 || targetId > MAX_ID_DESTINO || posicionPorId[targetId] == 0xFF) return -1;
+  return posicionPorId[targetId];
+}
+
+void encenderModulo(int idx, int qty) {
+  if (!destinos[idx].activo) {
+    // Se parte de "todo suelto": un boton ya presionado al encender cuenta, como antes
+    destinos[idx].botonesEstables = destinos[idx].lecturaCruda = 0xFF;
+    destinos[idx].cambioDesde = millis();
+    destinos[idx].siguienteRepeticion = 0;
+  }
+  destinos[idx].cantidad = qty;
+  destinos[idx].activo = true;
+  destinos[idx].animacionHasta = 0;
+  destinos[idx].displayObj->showNumberDec(qty);
+  setLed(idx, true); // <--- Esto ahora mandará HIGH para encender
+}
+
+void procesarTrama(byte seq, byte opcode, const byte* datos, byte len) {
+  modoBinario = true;
+  baudiosPendientesDesde = 0; // Llego una trama valida: la velocidad actual queda confirmada
+
+  if (opcode == OP_HOLA) {
+    byte respuesta[2] = { PROTOCOLO_VERSION, (byte)numDestinos };
+    ultimaSecuencia = -1; // El host reinicio su numeracion (y la de los eventos)
+    secuenciasVistas = 0;
+    secuenciaEventos = 0;
+    numEventosPendientes = 0;
+    enviarTrama(OP_HOLA, seq, respuesta, 2);
+    return;
+  }
+  if (opcode == OP_ACK) { // El host recibio un evento; seq es la del evento
+    confirmarEvento(seq);
+    return;
+  }
+  if (secuenciaVista(seq)) { // Retransmision: el ACK anterior se perdio
+    enviarTrama(OP_ACK, seq, NULL, 0);
+    return;
+  }
+
+  if (opcode == OP_ENCENDER || opcode == OP_ACTUALIZAR) {
+    if (len % 4 != 0) { enviarNack(seq, NACK_LONGITUD); return; }
+    for (byte i = 0; i < len; i += 4) {
+      int idx = buscarModulo(datos[i] | (datos[i + 1] << 8));
+      if (idx != -1) encenderModulo(idx, datos[i + 2] | (datos[i + 3] << 8));
     }
-  } else if (cmd == "APAGAR_TODO") {
-      for(int i=0; i<NUM_DESTINOS; i++) resetModulo(i);
+  } else if (opcode == OP_APAGAR) {
+    if (len % 2 != 0) { enviarNack(seq, NACK_LONGITUD); return; }
+    for (byte i = 0; i < len; i += 2) {
+      int idx = buscarModulo(datos[i] | (datos[i + 1] << 8));
+      if (idx != -1) resetModulo(idx);
+    }
+  } else if (opcode == OP_APAGAR_TODO) {
+    for (int i = 0; i < numDestinos; i++) resetModulo(i);
+  } else if (opcode == OP_MAPA) {
+    if (!recibirMapa(datos, len)) { enviarNack(seq, NACK_MAPA); return; }
+  } else if (opcode == OP_BARRIDO) {
+    // [modulos][activos][ultimo barrido ms u16][peor barrido ms u16][lecturas por vuelta]
+    byte activos = 0;
+    for (int i = 0; i < numDestinos; i++) if (destinos[i].activo) activos++;
+    unsigned long ultimo = barridoUltimoMs > 0xFFFF ? 0xFFFF : barridoUltimoMs;
+    unsigned long maximo = barridoMaximoMs > 0xFFFF ? 0xFFFF : barridoMaximoMs;
+    byte respuesta[7] = { (byte)numDestinos, activos, (byte)(ultimo & 0xFF), (byte)(ultimo >> 8),
+                          (byte)(maximo & 0xFF), (byte)(maximo >> 8), (byte)LECTURAS_POR_VUELTA };
+    marcarSecuencia(seq);
+    enviarTrama(OP_BARRIDO, seq, respuesta, 7);
+    return;
+  } else if (opcode == OP_BAUDIOS) {
+    if (len != 4) { enviarNack(seq, NACK_LONGITUD); return; }
+    unsigned long baudios = (unsigned long)datos[0] | ((unsigned long)datos[1] << 8)
+                          | ((unsigned long)datos[2] << 16) | ((unsigned long)datos[3] << 24);
+    enviarTrama(OP_ACK, seq, NULL, 0);
+    Serial.flush(); // El ACK sale a la velocidad anterior
+    Serial.begin(baudios);
+    marcarSecuencia(seq);
+    baudiosPendientesDesde = millis();
+    return;
+  } else {
+    enviarNack(seq, NACK_OPCODE);
+    return;
   }
+  marcarSecuencia(seq);
+  enviarTrama(OP_ACK, seq, NULL, 0);
 }
 
+// Modo de compatibilidad: ENCENDER_<id>_<qty>, ACTUALIZAR_<id>_<qty>, APAGAR_DESTINO_<id>, APAGAR_TODO
+void procesarComando(char* cmd) {
+  int largo = strlen(cmd);
+  while (largo > 0 && (cmd[largo - 1] == '\r' || cmd[largo - 1] == ' ')) cmd[--largo] = '\0';
+
+  if (strcmp(cmd, "APAGAR_TODO") == 0) {
+    for (int i = 0; i < numDestinos; i++) resetModulo(i);
+    return;
+  }
+
+  if (strncmp(cmd, "ENCENDER_", 9) == 0 || strncmp(cmd, "ACTUALIZAR_", 11) == 0) {
+    char* id = strchr(cmd, '_') + 1;
+    char* qty = strchr(id, '_');
+    int idx = buscarModulo(atoi(id));
+    if (idx != -1) encenderModulo(idx, qty ? atoi(qty + 1) : 0);
+  } 
+  else if (strncmp(cmd, "APAGAR_", 7) == 0) { 
+    // APAGAR_DESTINO_<id> (o APAGAR_<id>): el id es lo que sigue al ultimo '_'
+    int idx = buscarModulo(atoi(strrchr(cmd, '_') + 1));
+    if (idx != -1) resetModulo(idx);
+  }
+}
+
+// "dOnE" se queda ANIMACION_DONE_MS sin detener nada; loop() pone "----" al terminar.
 void confirmarDestino(int idx) {
-  Serial.print(F("boton_"));
-  Serial.println(destinos[idx].id);
+  enviarEvento(OP_BOTON, destinos[idx].id);
   
   uint8_t done[] = { 
     SEG_B | SEG_C | SEG_D | SEG_E | SEG_G,          // d
@@ -200,16 +711,17 @@ void confirmarDestino(int idx) {
     SEG_C | SEG_E | SEG_G,                          // n
     SEG_A | SEG_D | SEG_E | SEG_F | SEG_G           // E
   };
-  destinos[idx].displayObj->setSegments(done);
-  delay(500);
+  destinos[idx].animacionHasta = millis() + ANIMACION_DONE_MS;
   resetModulo(idx);
+  destinos[idx].displayObj->setSegments(done);
 }
 
 void resetModulo(int idx) {
   destinos[idx].activo = false;
   destinos[idx].cantidad = 0;
+  destinos[idx].siguienteRepeticion = 0;
   setLed(idx, false); // <--- Esto ahora mandará LOW para apagar
-  mostrarEspera(idx);
+  if (destinos[idx].animacionHasta == 0) mostrarEspera(idx); // Si hay "dOnE", loop() lo quita a tiempo
 }
 
 void mostrarEspera(int idx) {
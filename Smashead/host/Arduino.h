@@ -0,0 +1,52 @@
+// Entorno de Arduino simulado para compilar y probar Smashead.ino en PC (Linux o Windows).
+// Solo lo que usa el firmware. El reloj no corre solo: lo avanza quien simula (relojMs o
+// delay()), asi una prueba puede recorrer rebotes y animaciones sin esperar.
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <string>
+
+typedef uint8_t byte;
+#define F(x) (x)
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+inline unsigned long relojMs = 0;
+inline unsigned long millis() { return relojMs; }
+inline void delay(unsigned long ms) { relojMs += ms; }
+
+inline std::map<int, int> pinesSimulados;    // Pines de entrada que fija la simulacion (por omision HIGH)
+inline void pinMode(int, int) {}
+inline int digitalRead(int pin) { auto it = pinesSimulados.find(pin); return it == pinesSimulados.end() ? HIGH : it->second; }
+inline void digitalWrite(int pin, int valor) { pinesSimulados[pin] = valor; }
+
+// Puerto serie: 'entrada' es lo que manda el host y 'salida' lo que escribe el firmware.
+struct SerialSimulado {
+  std::deque<uint8_t> entrada;
+  std::string salida;
+  unsigned long baudios = 0;
+
+  void begin(unsigned long b) { baudios = b; }
+  int available() { return (int)entrada.size(); }
+  int read() {
+    if (entrada.empty()) return -1;
+    int c = entrada.front();
+    entrada.pop_front();
+    return c;
+  }
+  size_t write(uint8_t c) { salida += (char)c; return 1; }
+  size_t write(const uint8_t* datos, size_t n) { salida.append((const char*)datos, n); return n; }
+  void flush() {}
+  void print(const char* s) { salida += s; }
+  void print(int v) { salida += std::to_string(v); }
+  void println() { salida += "\r\n"; }
+  template <class T> void println(T v) { print(v); println(); }
+};
+
+inline SerialSimulado Serial;
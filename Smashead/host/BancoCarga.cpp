@@ -0,0 +1,142 @@
+// Banco del cargador de pedidos: mide cargarProductosDesdeCSV() de Smashead.cpp contra el
+// cargador anterior (getline + stringstream por linea, trim a cada campo y std::map por SKU),
+// copiado tal cual abajo, sobre el mismo archivo.
+//
+// Compilar (desde Smashead/):
+//   g++ -std=c++17 -O2 -pthread host/BancoCarga.cpp -o banco_carga
+//
+// Uso:
+//   simulador_ptl ola --lineas=1000000 --salida=ola_1m.csv
+//   banco_carga ola_1m.csv [--vueltas=N (3)]
+//
+// Cada cargador corre N vueltas y se reporta la mejor; al final se comprueba que ambos leyeron
+// las mismas lineas y piezas. La ola sintetica usa columnas en el orden fijo del cargador
+// anterior (SKU,Lote,OV,PZA), que es lo unico que este sabia leer.
+#define main principalPTL
+#include "../../Smashead.cpp"
+#undef main
+
+// --- CARGADOR ANTERIOR ---
+struct ProductoAnterior {
+  std::string sku;
+  std::string lote;
+  int ordenDeVenta;
+  int piezas;
+  int destino;
+  bool yaSurtido;
+};
+
+struct DatosAnteriores {
+  std::map<std::string, std::vector<ProductoAnterior>> productosPorSKU;
+  bool cargadoExitosamente = false;
+};
+
+DatosAnteriores cargarCSVAnterior(const std::string& archivo) {
+  DatosAnteriores datos;
+  std::ifstream file(archivo);
+  std::string line;
+
+  if (!file.is_open()) return datos;
+  std::getline(file, line); // Saltar encabezado
+
+  std::map<std::string, int> asignacionDestinos;
+  int siguienteDestinoDisponible = 1;
+
+  while (std::getline(file, line)) {
+    std::stringstream ss(line);
+    std::string sku, lote, ordenStr, piezasStr;
+    std::getline(ss, sku, ','); std::getline(ss, lote, ',');
+    std::getline(ss, ordenStr, ','); std::getline(ss, piezasStr, ',');
+
+    sku = trim(sku); lote = trim(lote); ordenStr = trim(ordenStr); piezasStr = trim(piezasStr);
+    size_t posEspacio = lote.find(' '); if (posEspacio != std::string::npos) lote = lote.substr(0, posEspacio);
+
+    if (sku.empty()) continue;
+
+    try {
+      int orden = std::stoi(ordenStr);
+      int piezas = std::stoi(piezasStr);
+
+      int destinoAsignado;
+      if (asignacionDestinos.find(ordenStr) != asignacionDestinos.end()) {
+        destinoAsignado = asignacionDestinos[ordenStr];
+      } else {
+        destinoAsignado = siguienteDestinoDisponible;
+        asignacionDestinos[ordenStr] = destinoAsignado;
+        siguienteDestinoDisponible++;
+      }
+      datos.productosPorSKU[sku].push_back({sku, lote, orden, piezas, destinoAsignado, false});
+    } catch (...) {}
+  }
+  datos.cargadoExitosamente = !datos.productosPorSKU.empty();
+  return datos;
+}
+
+// --- BANCO ---
+struct Medicion {
+  double mejorMs = 0;
+  size_t lineas = 0;
+  long long piezas = 0;
+};
+
+template <typename Carga>
+Medicion medir(int vueltas, Carga carga) {
+  Medicion m;
+  for (int i = 0; i < vueltas; ++i) {
+    auto inicio = std::chrono::steady_clock::now();
+    Medicion vuelta = carga();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - inicio).count();
+    if (i == 0 || ms < m.mejorMs) m.mejorMs = ms;
+    m.lineas = vuelta.lineas;
+    m.piezas = vuelta.piezas;
+  }
+  return m;
+}
+
+int main(int argc, char* argv[]) {
+  std::string archivo;
+  int vueltas = 3;
+  for (int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    if (a.rfind("--vueltas=", 0) == 0) vueltas = std::max(1, atoi(a.c_str() + 10));
+    else if (archivo.empty()) archivo = a;
+    else { archivo.clear(); break; }
+  }
+  std::string contenido;
+  if (archivo.empty() || !leerArchivoCompleto(archivo, contenido)) {
+    fprintf(stderr, "Uso: banco_carga archivo.csv [--vueltas=N] (ver el inicio de BancoCarga.cpp)\n");
+    return 2;
+  }
+  printf("%s: %.1f MB, %u hilos\n", archivo.c_str(), contenido.size() / 1048576.0, std::max(1u, std::thread::hardware_concurrency()));
+  contenido.clear();
+  contenido.shrink_to_fit();
+
+  Medicion anterior = medir(vueltas, [&] {
+    DatosAnteriores d = cargarCSVAnterior(archivo);
+    Medicion m;
+    for (const auto& par : d.productosPorSKU) {
+      m.lineas += par.second.size();
+      for (const ProductoAnterior& p : par.second) m.piezas += p.piezas;
+    }
+    return m;
+  });
+  Medicion nuevo = medir(vueltas, [&] {
+    std::ostringstream silencio; // "Carga exitosa..." una vez por vuelta no aporta
+    std::streambuf* salida = std::cout.rdbuf(silencio.rdbuf());
+    DatosCargados d = cargarProductosDesdeCSV(archivo);
+    std::cout.rdbuf(salida);
+    Medicion m;
+    m.lineas = d.entradas.size();
+    for (const EntradaProducto& e : d.entradas) m.piezas += e.piezas;
+    return m;
+  });
+
+  printf("Anterior: %9.1f ms, %zu lineas, %lld piezas\n", anterior.mejorMs, anterior.lineas, anterior.piezas);
+  printf("Nuevo:    %9.1f ms, %zu lineas, %lld piezas (%.1fx)\n", nuevo.mejorMs, nuevo.lineas, nuevo.piezas,
+         nuevo.mejorMs > 0 ? anterior.mejorMs / nuevo.mejorMs : 0.0);
+  if (anterior.lineas != nuevo.lineas || anterior.piezas != nuevo.piezas) {
+    printf("ALERTA: los cargadores no leyeron lo mismo\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+// EEPROM simulada (4 KB como la de un Mega), en blanco (0xFF) al iniciar. 'escrituras'
+// cuenta los bytes que realmente cambiaron, como el desgaste de update().
+#pragma once
+#include "Arduino.h"
+
+struct EEPROMSimulada {
+  uint8_t datos[4096];
+  unsigned long escrituras = 0;
+
+  EEPROMSimulada() { memset(datos, 0xFF, sizeof(datos)); }
+  uint8_t read(int idx) { return datos[idx]; }
+  void write(int idx, uint8_t valor) { datos[idx] = valor; escrituras++; }
+  void update(int idx, uint8_t valor) { if (datos[idx] != valor) write(idx, valor); }
+  uint16_t length() { return sizeof(datos); }
+};
+
+inline EEPROMSimulada EEPROM;
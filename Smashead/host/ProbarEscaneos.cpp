@@ -0,0 +1,116 @@
+// Prueba del decodificador de escaneos de Smashead.cpp (decodificarEscaneo) fuera del
+// programa de produccion. Decodifica un corpus (una lectura por linea; sin archivo se arma con
+// cada SKU/lote de los pedidos en todos los formatos), lo mezcla con mutaciones aleatorias y
+// mide cuanto tarda cada decision. Falla si una lectura de formato conocido no da su grupo o
+// si alguna decision apunta a algo que no esta en el indice.
+//
+// Compilar (desde Smashead/):
+//   g++ -std=c++17 -O2 -pthread host/ProbarEscaneos.cpp -o probar_escaneos
+//
+// Uso:
+//   probar_escaneos pedidos.csv [corpus.txt] [--fnc1=C] [--separadores-escaneo=S] [--largo-sku=N]
+//
+// Las opciones son las del host y cambian el decodificador igual que alla.
+#define main principalPTL
+#include "../../Smashead.cpp"
+#undef main
+
+// --- PRUEBA ---
+int probarDecodificador(const std::string& archivoCSV, const std::string& archivoCorpus) {
+  DatosCargados d = cargarProductosDesdeCSV(archivoCSV);
+  if (!d.cargadoExitosamente) return 1;
+  publicarIndice(d); // Se decodifica contra el indice de las estaciones y se verifica contra 'd'
+  std::shared_ptr<const IndiceBusqueda> indice = indiceActual();
+
+  std::vector<std::string> corpus;
+  std::vector<int> esperado; // Grupo que debe salir; -1 = sin expectativa
+  if (!archivoCorpus.empty()) {
+    std::ifstream f(archivoCorpus);
+    if (!f) { std::cerr << "ERROR: No se pudo abrir el corpus." << std::endl; return 1; }
+    for (std::string linea; std::getline(f, linea);) {
+      if (!recortar(linea).empty()) { corpus.push_back(linea); esperado.push_back(-1); }
+    }
+  } else {
+    for (uint32_t g = 0; g < d.grupos.size() && corpus.size() < 100000; ++g) {
+      const std::string& sku = d.textos[d.grupos[g].sku];
+      const std::string& lote = d.textos[d.grupos[g].lote];
+      std::vector<std::string> formas = { sku + " " + lote, sku + "|" + lote, sku + ";" + lote };
+      if (soloDigitos(sku) && sku.size() <= 14 && lote.size() <= 20 && lote.find(GS1_GS) == std::string::npos) {
+        std::string gtin = std::string(14 - sku.size(), '0') + sku;
+        formas.push_back("]C101" + gtin + "10" + lote + GS1_GS + "17271231");
+        formas.push_back("]d201" + gtin + "17271231" + "10" + lote);
+        formas.push_back("(01)" + gtin + "(17)271231(10)" + lote);
+        formas.push_back("(01)" + gtin + "(10)" + lote + "(17)271231");
+      }
+      for (std::string& forma : formas) { corpus.push_back(std::move(forma)); esperado.push_back((int)g); }
+    }
+  }
+
+  size_t porResultado[4] = {}, fallidos = 0, violaciones = 0;
+  auto verificar = [&](const EscaneoDecodificado& r) {
+    uint32_t g, idSku;
+    if (r.resultado == ESCANEO_COMPLETO) return buscarIdGrupo(d, r.sku, r.lote, g) && g == r.idGrupo;
+    if (r.resultado == ESCANEO_DESCONOCIDO) return true;
+    return buscarTexto(d, r.sku, idSku) && d.gruposPorSKU.count(idSku) > 0;
+  };
+  std::vector<uint64_t> nanos;
+  nanos.reserve(corpus.size());
+  for (size_t i = 0; i < corpus.size(); ++i) {
+    auto inicio = std::chrono::steady_clock::now();
+    EscaneoDecodificado r = decodificarEscaneo(*indice, corpus[i]);
+    nanos.push_back((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - inicio).count());
+    porResultado[r.resultado]++;
+    if (esperado[i] >= 0 && (r.resultado != ESCANEO_COMPLETO || (int)r.idGrupo != esperado[i])) {
+      if (fallidos++ < 10) std::cout << "  No decodificado: '" << corpus[i] << "'" << std::endl;
+    }
+    if (!verificar(r)) violaciones++;
+  }
+
+  // Mutaciones: cambiar, borrar o duplicar bytes, cortar y meter separadores o GS al azar
+  const char sustitutos[] = " |;\t()\x1D" "0123456789ABCxyz]";
+  std::mt19937 azar(1);
+  size_t mutaciones = 0;
+  for (const std::string& original : corpus) {
+    for (int m = 0; m < 8 && !original.empty(); ++m) {
+      std::string s = original;
+      size_t pos = azar() % s.size();
+      switch (azar() % 4) {
+      case 0: s[pos] = sustitutos[azar() % (sizeof(sustitutos) - 1)]; break;
+      case 1: s.erase(pos, 1); break;
+      case 2: s.insert(pos, s.substr(pos, 1 + azar() % 4)); break;
+      default: s.resize(pos); break;
+      }
+      if (!verificar(decodificarEscaneo(*indice, s))) violaciones++;
+      mutaciones++;
+    }
+  }
+
+  std::sort(nanos.begin(), nanos.end());
+  auto percentil = [&](double p) { return nanos.empty() ? 0 : nanos[std::min(nanos.size() - 1, (size_t)(p / 100.0 * nanos.size()))]; };
+  std::cout << "Corpus: " << corpus.size() << " lecturas | un escaneo: " << porResultado[ESCANEO_COMPLETO]
+       << ", solo SKU: " << porResultado[ESCANEO_SOLO_SKU] << ", lote invalido: " << porResultado[ESCANEO_LOTE_INVALIDO]
+       << ", desconocidas: " << porResultado[ESCANEO_DESCONOCIDO] << std::endl;
+  std::cout << "Decision por lectura: p50 " << percentil(50) << " ns, p99 " << percentil(99) << " ns, max "
+       << (nanos.empty() ? 0 : nanos.back()) << " ns" << std::endl;
+  std::cout << "Mutaciones: " << mutaciones << ", decisiones fuera del indice: " << violaciones
+       << ", lecturas esperadas sin decodificar: " << fallidos << std::endl;
+  return (violaciones == 0 && fallidos == 0) ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> archivos;
+  for (int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    int largo = 0;
+    if (a.rfind("--separadores-escaneo=", 0) == 0) separadoresEscaneo = a.substr(22);
+    else if (a.rfind("--fnc1=", 0) == 0 && a.size() == 8) sustitutoFNC1 = a[7];
+    else if (a.rfind("--largo-sku=", 0) == 0 && leerEntero(a.substr(12), largo) && largo > 0) largoSKU = (size_t)largo;
+    else if (a.rfind("--", 0) != 0) archivos.push_back(a);
+    else { archivos.clear(); break; }
+  }
+  if (archivos.empty() || archivos.size() > 2) {
+    fprintf(stderr, "Uso: probar_escaneos pedidos.csv [corpus.txt] [opciones] (ver el inicio de ProbarEscaneos.cpp)\n");
+    return 2;
+  }
+  return probarDecodificador(archivos[0], archivos.size() > 1 ? archivos[1] : "");
+}
@@ -0,0 +1,632 @@
+// Rack PTL virtual y banco de carga para Smashead.cpp (Linux).
+//
+// Corre el firmware real (Smashead.ino contra los simulados de host/) detras de un
+// pseudo-terminal, asi que habla exactamente el mismo protocolo que el Arduino: texto
+// (ENCENDER_/ACTUALIZAR_/APAGAR_DESTINO_, boton_N/+N/-N) o binario si el host lo negocia.
+// Un operador simulado por modulo presiona Confirmar tras un tiempo de reaccion y, a veces,
+// baja la cantidad antes (faltante). El enlace respeta los baudios y puede meter ruido.
+//
+// Compilar (desde Smashead/):
+//   g++ -std=c++17 -O2 -pthread -I host -x c++ host/SimuladorPTL.cpp -o simulador_ptl -lutil
+//
+// Uso:
+//   simulador_ptl rack  [opciones]                  Imprime el /dev/pts/N para Smashead.cpp
+//   simulador_ptl ola   --lineas=N --salida=ola.csv Solo genera una ola sintetica (para
+//                                                   BancoCarga.cpp, entre otros)
+//   simulador_ptl banco --host=./ptl [opciones] [-- argumentos extra del host]
+//       Genera la ola, arranca el rack y el host, escanea cada SKU/lote por la consola del
+//       host y contesta sus preguntas; al final reporta picks/hora, latencia de boton a
+//       confirmacion (p50/p90/p99) y CPU del host.
+//
+// Opciones: --modulos=N (1-96, 64)  --ordenes=N (OV de la ola; si pasan de los modulos el host
+//   los recicla, igual a --modulos)  --lineas=N (10000)  --por-grupo=N (destinos promedio por
+//   SKU/lote, 8)  --reaccion=MS (operador; 800 en rack, 5 en banco)  --faltantes=P (0.02)
+//   --ruido=P (bit invertido por byte, 0)  --sin-baudios (enlace sin limite de velocidad)
+//   --espera=MS (sin avance se cancela el escaneo, 5000)  --semilla=N (1)
+//   --respuesta=MS (lo que tarda el operador en contestar cada pregunta del host, 0)
+//   --sugerido (el banco escanea en el orden que sugiere el host en vez del de la ola)
+//   --escaneo=doble|combinado|gs1 (SKU y lote en dos escaneos, en uno "SKU LOTE" o en una
+//   etiqueta GS1-128 con FNC1; doble)
+//   --adicional=P (fraccion de los SKU/lote que llega a media ola en adicional.csv, junto con
+//   unas lineas repetidas; el banco la carga con "cargar" y luego los surte, 0)
+//   --inventario (el host recibe inventario.csv con existencia y caducidad de cada lote y, en un
+//   faltante, el banco escanea el primer lote que le sugiere en vez de contestar "n")
+#include "../Smashead.ino"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+using Reloj = std::chrono::steady_clock;
+
+struct Opciones {
+  std::string modo;
+  int modulos = 64;
+  int ordenes = 0;
+  size_t lineas = 10000;
+  int porGrupo = 8;
+  double reaccionMs = -1;
+  double faltantes = 0.02;
+  double ruido = 0;
+  bool limitarBaudios = true;
+  bool seguirSugerido = false;
+  int esperaMs = 5000;
+  int respuestaMs = 0;
+  std::string escaneo = "doble";
+  double adicional = 0;
+  bool inventario = false;
+  unsigned semilla = 1;
+  std::string salida;
+  std::string host;
+  std::vector<std::string> argumentosHost;
+};
+
+struct GrupoOla {
+  std::string sku, lote;
+};
+
+// --- OLA SINTETICA ---
+// Cada SKU/lote va a entre 1 y 2*porGrupo-1 ordenes distintas. Con tantas OV como modulos el
+// host les da los destinos 1..modulos; con mas, los modulos se reciclan. Con 'adicionales' y
+// --adicional esa fraccion de SKU/lote va a 'archivoAdicional', que ademas repite las primeras
+// lineas de la ola.
+std::vector<GrupoOla> generarOla(const Opciones& op, const std::string& archivo,
+                                 const std::string& archivoAdicional = "", std::vector<GrupoOla>* adicionales = nullptr) {
+  std::mt19937 azar(op.semilla);
+  std::ofstream principal(archivo), extra;
+  principal << "SKU,Lote,OV,PZA\n";
+  bool separar = adicionales && op.adicional > 0;
+  std::ostringstream repetidas;
+  if (separar) extra.open(archivoAdicional);
+  if (separar) extra << "SKU,Lote,OV,PZA\n";
+  std::vector<GrupoOla> grupos;
+  std::vector<int> ordenes(op.ordenes);
+  for (int i = 0; i < op.ordenes; ++i) ordenes[i] = 5001 + i;
+  int maxPorGrupo = std::max(1, std::min(op.ordenes, 2 * op.porGrupo - 1));
+  size_t escritas = 0;
+  for (int g = 0; escritas < op.lineas; ++g) {
+    GrupoOla grupo{ std::to_string(300000 + g / 3), "L" + std::to_string(g % 3 + 1) + "-" + std::to_string(g) };
+    int k = std::min<int>(std::uniform_int_distribution<int>(1, maxPorGrupo)(azar), (int)(op.lineas - escritas));
+    std::shuffle(ordenes.begin(), ordenes.end(), azar);
+    bool aparte = separar && std::uniform_real_distribution<double>(0, 1)(azar) < op.adicional;
+    std::ostream& out = aparte ? extra : principal;
+    for (int i = 0; i < k; ++i) {
+      std::string linea = grupo.sku + "," + grupo.lote + "," + std::to_string(ordenes[i]) + ","
+                          + std::to_string(std::uniform_int_distribution<int>(1, 50)(azar)) + "\n";
+      out << linea;
+      if (separar && !aparte && i == 0 && g < 5) repetidas << linea;
+    }
+    escritas += k;
+    (aparte ? *adicionales : grupos).push_back(grupo);
+  }
+  if (separar) extra << repetidas.str();
+  return grupos;
+}
+
+// Existencia de cada lote de la ola y un lote de reserva por SKU, con caducidades al azar: a
+// veces el lote que se sugiere no alcanza y hay que complementar con otro.
+void generarInventario(const Opciones& op, const std::vector<GrupoOla>& grupos, const std::string& archivo) {
+  std::mt19937 azar(op.semilla + 1);
+  std::ofstream f(archivo);
+  f << "SKU,Lote,Caducidad,Existencia\n";
+  auto lote = [&](const std::string& sku, const std::string& l) {
+    char caducidad[16];
+    snprintf(caducidad, sizeof(caducidad), "%d-%02d-15", std::uniform_int_distribution<int>(2030, 2032)(azar),
+             std::uniform_int_distribution<int>(1, 12)(azar));
+    f << sku << "," << l << "," << caducidad << "," << std::uniform_int_distribution<int>(0, 80)(azar) << "\n";
+  };
+  for (size_t g = 0; g < grupos.size(); ++g) {
+    lote(grupos[g].sku, grupos[g].lote);
+    if (g == 0 || grupos[g].sku != grupos[g - 1].sku) lote(grupos[g].sku, "R-" + grupos[g].sku);
+  }
+}
+
+// --- RACK ---
+// Estado del operador frente a un modulo encendido.
+enum FaseOperador { LIBRE, PENSANDO, BAJANDO, CONFIRMANDO, SOLTANDO };
+
+struct Operador {
+  FaseOperador fase = LIBRE;
+  Reloj::time_point siguiente;
+  int menos = 0;   // Veces que aun bajara la cantidad (faltante)
+};
+
+struct Rack {
+  Opciones op;
+  int maestro = -1, esclavo = -1;
+  std::string rutaEsclavo;
+  std::mt19937 azar;
+  std::vector<Operador> operadores;
+  std::deque<uint8_t> haciaFirmware;
+  std::string haciaHost;
+  double credito = 0;
+  std::thread hilo;
+  std::atomic<bool> activo{true};
+
+  std::mutex mutex;                                  // Protege presionado
+  std::vector<Reloj::time_point> presionado;         // Por id: cuando se presiono Confirmar
+  std::atomic<uint64_t> confirmaciones{0}, faltantes{0}, bytesAlterados{0};
+};
+
+// Mapa de N modulos en la EEPROM simulada: 8 PCF8574 por canal del TCA9548A.
+void grabarMapa(int modulos) {
+  for (int i = 0; i < modulos; ++i) {
+    byte* e = EEPROM.datos + MAPA_CABECERA + i * ENTRADA_MAPA;
+    e[0] = (byte)(i + 1); e[1] = 0;
+    e[2] = (byte)(i / 8);
+    e[3] = (byte)(0x20 + i % 8);
+    e[4] = (byte)(2 + i / 16);
+    e[5] = (byte)(22 + i);
+  }
+  uint16_t crc = crc16(EEPROM.datos + MAPA_CABECERA, modulos * ENTRADA_MAPA);
+  byte cabecera[MAPA_CABECERA] = { 'P', 'M', MAPA_VERSION, (byte)modulos, (byte)(crc >> 8), (byte)(crc & 0xFF) };
+  memcpy(EEPROM.datos, cabecera, MAPA_CABECERA);
+}
+
+uint8_t conRuido(Rack& r, uint8_t b) {
+  if (r.op.ruido > 0 && std::uniform_real_distribution<double>(0, 1)(r.azar) < r.op.ruido) {
+    r.bytesAlterados++;
+    return b ^ (uint8_t)(1 << std::uniform_int_distribution<int>(0, 7)(r.azar));
+  }
+  return b;
+}
+
+void moverBotones(int i, byte presionados) {
+  int ruta = destinos[i].canal == SIN_MUX ? 0 : 1 + destinos[i].canal;
+  Wire.presionados[ruta][destinos[i].pcfAddr] = presionados;
+}
+
+// Un paso de cada operador. Cada pulsacion dura 40 ms, mas que el antirrebote del firmware.
+void atenderOperadores(Rack& r, Reloj::time_point ahora) {
+  const auto pulsacion = std::chrono::milliseconds(40);
+  for (int i = 0; i < numDestinos; ++i) {
+    Operador& o = r.operadores[i];
+    if (!destinos[i].activo && (o.fase == PENSANDO || o.fase == BAJANDO)) { // El host lo apago
+      moverBotones(i, 0);
+      o.fase = LIBRE;
+    }
+    if (o.fase == LIBRE) {
+      if (!destinos[i].activo) continue;
+      double media = r.op.reaccionMs;
+      double ms = std::max(0.0, std::normal_distribution<double>(media, media / 4)(r.azar));
+      o.siguiente = ahora + std::chrono::microseconds((long)(ms * 1000));
+      o.menos = 0;
+      if (destinos[i].cantidad > 0 && std::uniform_real_distribution<double>(0, 1)(r.azar) < r.op.faltantes) {
+        o.menos = std::uniform_int_distribution<int>(1, std::min(3, destinos[i].cantidad))(r.azar);
+        r.faltantes++;
+      }
+      o.fase = PENSANDO;
+    }
+    if (ahora < o.siguiente) continue;
+    switch (o.fase) {
+      case PENSANDO:
+        if (o.menos > 0) {
+          moverBotones(i, MASK_BTN_DOWN);
+          o.fase = BAJANDO;
+        } else {
+          moverBotones(i, MASK_BTN_CONFIRM);
+          std::lock_guard<std::mutex> lock(r.mutex);
+          r.presionado[destinos[i].id] = ahora;
+          o.fase = CONFIRMANDO;
+        }
+        o.siguiente = ahora + pulsacion;
+        break;
+      case BAJANDO:
+        moverBotones(i, 0);
+        o.menos--;
+        o.fase = PENSANDO;
+        o.siguiente = ahora + pulsacion;
+        break;
+      case CONFIRMANDO:
+        moverBotones(i, 0);
+        r.confirmaciones++;
+        o.fase = SOLTANDO;
+        o.siguiente = ahora + pulsacion;
+        break;
+      case SOLTANDO:
+        o.fase = LIBRE;
+        break;
+      default: break;
+    }
+  }
+}
+
+// Puente entre el pseudo-terminal y el Serial simulado, con el firmware corriendo en el
+// mismo hilo. Con limite de baudios solo pasan los bytes que la velocidad actual permite.
+void hiloRack(Rack& r) {
+  auto inicio = Reloj::now(), anterior = inicio;
+  uint8_t buffer[512];
+  while (r.activo) {
+    pollfd p = { r.maestro, POLLIN, 0 };
+    poll(&p, 1, 1);
+    ssize_t n;
+    while ((n = read(r.maestro, buffer, sizeof(buffer))) > 0) {
+      for (ssize_t i = 0; i < n; ++i) r.haciaFirmware.push_back(conRuido(r, buffer[i]));
+    }
+
+    auto ahora = Reloj::now();
+    relojMs = (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(ahora - inicio).count();
+    size_t permitidos = SIZE_MAX;
+    if (r.op.limitarBaudios) {
+      double segundos = std::chrono::duration<double>(ahora - anterior).count();
+      r.credito = std::min(r.credito + segundos * Serial.baudios / 10.0, 256.0);
+      permitidos = (size_t)r.credito;
+    }
+    anterior = ahora;
+
+    size_t usados = 0;
+    while (!r.haciaFirmware.empty() && usados < permitidos) {
+      Serial.entrada.push_back(r.haciaFirmware.front());
+      r.haciaFirmware.pop_front();
+      usados++;
+    }
+    loop();
+    atenderOperadores(r, ahora);
+
+    for (char c : Serial.salida) r.haciaHost += (char)conRuido(r, (uint8_t)c);
+    Serial.salida.clear();
+    size_t enviar = std::min(r.haciaHost.size(), permitidos > usados ? permitidos - usados : 0);
+    if (enviar > 0) {
+      ssize_t escritos = write(r.maestro, r.haciaHost.data(), enviar);
+      if (escritos > 0) { r.haciaHost.erase(0, escritos); usados += escritos; }
+    }
+    if (r.op.limitarBaudios) r.credito -= usados;
+  }
+}
+
+bool iniciarRack(Rack& r, const Opciones& op) {
+  r.op = op;
+  r.azar.seed(op.semilla);
+  char nombre[128];
+  if (openpty(&r.maestro, &r.esclavo, nombre, nullptr, nullptr) != 0) { perror("openpty"); return false; }
+  termios t;
+  tcgetattr(r.esclavo, &t);
+  cfmakeraw(&t);
+  tcsetattr(r.esclavo, TCSANOW, &t);
+  fcntl(r.maestro, F_SETFL, O_NONBLOCK);
+  r.rutaEsclavo = nombre; // El esclavo queda abierto aqui: si el host cierra, el maestro no da EIO
+
+  grabarMapa(op.modulos);
+  setup();
+  Serial.salida.clear(); // SYSTEM_READY llegaria antes de que el host abra el puerto
+  r.operadores.assign(numDestinos, Operador());
+  r.presionado.assign(MAX_ID_DESTINO + 1, Reloj::time_point());
+  r.hilo = std::thread(hiloRack, std::ref(r));
+  return true;
+}
+
+void detenerRack(Rack& r) {
+  r.activo = false;
+  if (r.hilo.joinable()) r.hilo.join();
+  close(r.maestro);
+  close(r.esclavo);
+}
+
+// --- BANCO ---
+struct ResultadoBanco {
+  size_t escaneos = 0, cancelados = 0, confirmados = 0, conFaltante = 0, errores = 0;
+  size_t ordenesCompletas = 0, reescaneos = 0, complementos = 0;
+  std::vector<double> latenciasMs;
+  std::vector<std::string> resumenHost;
+};
+
+bool terminaCon(const std::string& s, const std::string& fin) {
+  return s.size() >= fin.size() && s.compare(s.size() - fin.size(), fin.size(), fin) == 0;
+}
+
+double percentil(std::vector<double>& v, double p) {
+  if (v.empty()) return 0;
+  size_t i = std::min(v.size() - 1, (size_t)(p / 100.0 * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+int correrBanco(const Opciones& op) {
+  // El host corre dentro de la carpeta de la ola: una ruta relativa (--host=./ptl) se resuelve antes
+  char rutaHost[PATH_MAX];
+  if (!realpath(op.host.c_str(), rutaHost) || access(rutaHost, X_OK) != 0) {
+    fprintf(stderr, "No se encontro el host ejecutable: %s\n", op.host.c_str());
+    return 1;
+  }
+  char plantilla[] = "/tmp/banco_ptl_XXXXXX";
+  if (!mkdtemp(plantilla)) { perror("mkdtemp"); return 1; }
+  std::string carpeta = plantilla, archivoOla = carpeta + "/ola.csv";
+  std::vector<GrupoOla> adicionales;
+  std::vector<GrupoOla> grupos = generarOla(op, archivoOla, carpeta + "/adicional.csv", &adicionales);
+  std::cout << "Ola: " << op.lineas << " lineas, " << grupos.size() + adicionales.size() << " SKU/lote ("
+            << adicionales.size() << " a media ola), " << op.ordenes << " OV en " << op.modulos << " modulos ("
+            << carpeta << ")" << std::endl;
+  if (op.inventario) {
+    std::vector<GrupoOla> todos = grupos;
+    todos.insert(todos.end(), adicionales.begin(), adicionales.end());
+    generarInventario(op, todos, carpeta + "/inventario.csv");
+  }
+
+  Rack rack;
+  if (!iniciarRack(rack, op)) return 1;
+
+  int entrada[2], salida[2];
+  if (pipe(entrada) != 0 || pipe(salida) != 0) { perror("pipe"); return 1; }
+  pid_t hijo = fork();
+  if (hijo == 0) {
+    dup2(entrada[0], 0);
+    dup2(salida[1], 1);
+    dup2(salida[1], 2);
+    close(entrada[1]); close(salida[0]);
+    if (chdir(carpeta.c_str()) != 0) _exit(127); // Sesion y backorders quedan en la carpeta de la ola
+    std::vector<char*> argumentos;
+    argumentos.push_back(rutaHost);
+    argumentos.push_back((char*)rack.rutaEsclavo.c_str());
+    std::string reciclar = "--modulos=" + std::to_string(op.modulos);
+    if (op.ordenes > op.modulos) argumentos.push_back((char*)reciclar.c_str());
+    std::string inventario = "--inventario=inventario.csv";
+    if (op.inventario) argumentos.push_back((char*)inventario.c_str());
+    for (const std::string& a : op.argumentosHost) argumentos.push_back((char*)a.c_str());
+    argumentos.push_back(nullptr);
+    execv(rutaHost, argumentos.data());
+    _exit(127);
+  }
+  close(entrada[0]); close(salida[1]);
+  auto escribir = [&](const std::string& linea) {
+    std::string s = linea + "\n";
+    if (write(entrada[1], s.data(), s.size()) < 0) perror("write");
+  };
+
+  ResultadoBanco res;
+  size_t siguiente = op.seguirSugerido ? grupos.size() : 0; // Con --sugerido solo quedan los de la carga adicional
+  size_t aMediaOla = grupos.size() / 2;
+  bool enPregunta = false, cargaEnviada = false, cargaPendiente = false;
+  GrupoOla actual, sugerido;
+  std::string respuesta;                 // Contestacion que el operador aun esta pensando
+  Reloj::time_point responderEn;
+  bool enEscaneo = false, terminado = false;
+  std::string pendiente;
+  std::string loteSugerido;              // Primer lote de la ultima sugerencia FEFO
+  auto inicio = Reloj::now(), ultimoAvance = inicio;
+  Reloj::time_point inicioSurtido;       // Valido solo si hubo escaneos
+  char buffer[4096];
+  while (true) {
+    pollfd p = { salida[0], POLLIN, 0 };
+    ssize_t n = 0;
+    if (poll(&p, 1, respuesta.empty() ? 100 : 5) > 0) {
+      n = read(salida[0], buffer, sizeof(buffer));
+      if (n == 0 || (n < 0 && errno != EINTR)) break; // El host termino
+    }
+    auto ahora = Reloj::now();
+    if (n > 0) pendiente.append(buffer, n);
+
+    size_t fin;
+    while ((fin = pendiente.find('\n')) != std::string::npos) {
+      std::string linea = pendiente.substr(0, fin);
+      pendiente.erase(0, fin + 1);
+      int id = 0;
+      if (linea.rfind("DESTINO ", 0) == 0 && terminaCon(linea, " confirmado.")
+          && sscanf(linea.c_str(), "DESTINO %d", &id) == 1 && id > 0 && id <= MAX_ID_DESTINO) {
+        std::lock_guard<std::mutex> lock(rack.mutex);
+        res.latenciasMs.push_back(std::chrono::duration<double, std::milli>(ahora - rack.presionado[id]).count());
+        res.confirmados++;
+        ultimoAvance = ahora;
+      } else if (linea.rfind("  Destino ", 0) == 0 && terminaCon(linea, " registrado.")) {
+        res.conFaltante++;
+        ultimoAvance = ahora;
+      } else if (linea.rfind("  >> Modulo ", 0) == 0 && linea.find(" completa.") != std::string::npos) {
+        res.ordenesCompletas++;
+      } else if (linea.rfind("  Sin modulo libre todavia", 0) == 0 && enEscaneo) {
+        // Las OV en espera de ese SKU/lote se surten al volver a escanearlo
+        if (!op.seguirSugerido) grupos.push_back(actual);
+        res.reescaneos++;
+      } else if (linea.rfind("  >> Faltan ", 0) == 0 && linea.find("Sugeridos (FEFO") != std::string::npos) {
+        size_t i = linea.find("): ");
+        if (i != std::string::npos) loteSugerido = linea.substr(i + 3, linea.find(' ', i + 3) - i - 3);
+      } else if (linea.rfind("  Complemento: lote ", 0) == 0) {
+        res.complementos++;
+      } else if (linea.rfind("Carga adicional: ", 0) == 0) {
+        cargaPendiente = false;
+        grupos.insert(grupos.end(), adicionales.begin(), adicionales.end());
+        std::cout << "host: " << linea << std::endl;
+      } else if (linea.rfind("Siguiente: SKU ", 0) == 0) {
+        size_t coma = linea.find(", lote "), parentesis = linea.find(" (paso ");
+        if (coma != std::string::npos && parentesis != std::string::npos) {
+          sugerido = { linea.substr(15, coma - 15), linea.substr(coma + 7, parentesis - coma - 7) };
+        }
+      } else if (linea.rfind("ERROR", 0) == 0 || linea == "SKU no encontrado." || linea.rfind("Lote incorrecto", 0) == 0
+                 || linea.rfind("DESCUADRE", 0) == 0) {
+        res.errores++;
+        std::cerr << "host: " << linea << std::endl;
+      } else if (terminado && (linea.rfind("Comandos:", 0) == 0 || linea.rfind("Backorders:", 0) == 0
+                 || linea.rfind("Lectura de botones:", 0) == 0 || linea.rfind("Lineas: ", 0) == 0
+                 || linea.rfind("Cuadra con el indice", 0) == 0)) {
+        res.resumenHost.push_back(linea);
+      }
+    }
+
+    // Preguntas del host: la salida se detiene en ellas hasta recibir respuesta
+    if (terminaCon(pendiente, "Archivo CSV (ej. pedidos.csv): ")) {
+      escribir(archivoOla);
+      pendiente.clear();
+    } else if (terminaCon(pendiente, ">>> Escanee SKU (o 'exit'): ")) {
+      if (res.escaneos == 0) inicioSurtido = ahora;
+      enEscaneo = false;
+      enPregunta = true;
+      pendiente.clear();
+      ultimoAvance = ahora;
+    } else if (terminaCon(pendiente, "Escanee LOTE: ")) {
+      escribir(actual.lote);
+      enEscaneo = true;
+      pendiente.clear();
+    } else if (terminaCon(pendiente, "(s/n): ")) {
+      // Faltante: se acepta lo surtido y, con inventario, se complementa con el lote sugerido;
+      // una sesion previa no se reanuda
+      if (pendiente.find("correcta") != std::string::npos) respuesta = "s";
+      else if (pendiente.find("Complementar") != std::string::npos && !loteSugerido.empty()) respuesta = loteSugerido;
+      else respuesta = "n";
+      loteSugerido.clear();
+      responderEn = ahora + std::chrono::milliseconds(op.respuestaMs);
+      pendiente.clear();
+      ultimoAvance = ahora;
+    } else if (!respuesta.empty()) {
+      ultimoAvance = ahora; // Mientras tanto el host debe seguir atendiendo los demas destinos
+    } else if (enEscaneo && ahora - ultimoAvance > std::chrono::milliseconds(op.esperaMs)) {
+      // El firmware reenvia los eventos sin ACK; si el ruido se lleva los cuatro intentos de un
+      // boton_N el escaneo queda esperando: se cancela y se sigue
+      escribir("exit");
+      res.cancelados++;
+      ultimoAvance = ahora;
+    }
+    // Pregunta de SKU. A media ola se manda la carga adicional; si mientras el host la carga ya
+    // no hay nada que escanear, se espera a que termine.
+    if (enPregunta && !adicionales.empty() && !cargaEnviada && res.escaneos >= aMediaOla) {
+      escribir("cargar adicional.csv");
+      cargaEnviada = cargaPendiente = true;
+      enPregunta = false;
+    } else if (enPregunta) {
+      bool porSugerencia = op.seguirSugerido && !sugerido.sku.empty();
+      if (porSugerencia || siguiente < grupos.size()) {
+        actual = porSugerencia ? sugerido : grupos[siguiente++];
+        sugerido = {};
+        if (op.escaneo == "combinado") escribir(actual.sku + " " + actual.lote);
+        else if (op.escaneo == "gs1") {
+          escribir("]C101" + std::string(14 - std::min<size_t>(14, actual.sku.size()), '0') + actual.sku + "10" + actual.lote + "\x1D" "17271231");
+        }
+        else escribir(actual.sku);
+        res.escaneos++;
+        enPregunta = false;
+      } else if (!cargaPendiente) {
+        if (!terminado) escribir("exit");
+        terminado = true;
+        enPregunta = false;
+      }
+    }
+    if (!respuesta.empty() && ahora >= responderEn) {
+      escribir(respuesta);
+      respuesta.clear();
+    }
+  }
+  auto finSurtido = Reloj::now();
+  int estado = 0;
+  waitpid(hijo, &estado, 0);
+  rusage uso;
+  getrusage(RUSAGE_CHILDREN, &uso);
+  detenerRack(rack);
+  close(entrada[1]); close(salida[0]);
+
+  double segundos = res.escaneos > 0 ? std::chrono::duration<double>(finSurtido - inicioSurtido).count() : 0.0;
+  double cpu = uso.ru_utime.tv_sec + uso.ru_utime.tv_usec / 1e6 + uso.ru_stime.tv_sec + uso.ru_stime.tv_usec / 1e6;
+  size_t picks = res.confirmados + res.conFaltante;
+  std::vector<double>& l = res.latenciasMs;
+  double p50 = percentil(l, 50), p90 = percentil(l, 90), p99 = percentil(l, 99);
+  double maximo = l.empty() ? 0 : *std::max_element(l.begin(), l.end());
+
+  printf("\n--- BANCO ---\n");
+  printf("Escaneos: %zu (%zu cancelados), picks: %zu (%zu con faltante), errores: %zu\n",
+         res.escaneos, res.cancelados, picks, res.conFaltante, res.errores);
+  if (op.ordenes > op.modulos) {
+    printf("Reciclado: %zu OV completas liberaron su modulo, %zu reescaneos por OV en espera\n", res.ordenesCompletas, res.reescaneos);
+  }
+  if (op.inventario) printf("Complementos: %zu lotes escaneados de la sugerencia FEFO\n", res.complementos);
+  if (res.escaneos > 0) {
+    printf("Tiempo de surtido: %.1f s, %.0f picks/hora\n", segundos, segundos > 0 ? picks * 3600.0 / segundos : 0.0);
+    printf("Boton -> confirmacion (ms): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f (%zu muestras)\n", p50, p90, p99, maximo, l.size());
+    printf("CPU del host: %.2f s (%.1f%% de un nucleo), %.0f us por pick, memoria max %ld KB\n",
+           cpu, segundos > 0 ? 100.0 * cpu / segundos : 0.0, picks ? cpu * 1e6 / picks : 0.0, uso.ru_maxrss);
+  } else {
+    printf("Sin escaneos: no hay tiempos de surtido que reportar.\n");
+  }
+  printf("Rack: %llu confirmaciones, %llu faltantes simulados, %llu bytes alterados por ruido\n",
+         (unsigned long long)rack.confirmaciones, (unsigned long long)rack.faltantes, (unsigned long long)rack.bytesAlterados);
+  for (const std::string& s : res.resumenHost) printf("Host: %s\n", s.c_str());
+  if (!WIFEXITED(estado) || WEXITSTATUS(estado) != 0) {
+    if (WIFSIGNALED(estado)) printf("ALERTA: el host termino por la senal %d\n", WTERMSIG(estado));
+    else printf("ALERTA: el host termino con estado %d\n", WIFEXITED(estado) ? WEXITSTATUS(estado) : -1);
+    return 1;
+  }
+  if (res.escaneos == 0) {
+    printf("ALERTA: el banco no llego a escanear nada\n");
+    return 1;
+  }
+  return 0;
+}
+
+// --- MAIN ---
+bool leerOpciones(int argc, char* argv[], Opciones& op) {
+  if (argc < 2) return false;
+  op.modo = argv[1];
+  for (int i = 2; i < argc; ++i) {
+    std::string a = argv[i];
+    auto valor = [&](const char* nombre) -> const char* {
+      size_t largo = strlen(nombre);
+      return a.compare(0, largo, nombre) == 0 ? a.c_str() + largo : nullptr;
+    };
+    const char* v;
+    if (a == "--") { op.argumentosHost.assign(argv + i + 1, argv + argc); break; }
+    else if ((v = valor("--modulos="))) op.modulos = atoi(v);
+    else if ((v = valor("--ordenes="))) op.ordenes = atoi(v);
+    else if ((v = valor("--lineas="))) op.lineas = strtoull(v, nullptr, 10);
+    else if ((v = valor("--por-grupo="))) op.porGrupo = atoi(v);
+    else if ((v = valor("--reaccion="))) op.reaccionMs = atof(v);
+    else if ((v = valor("--faltantes="))) op.faltantes = atof(v);
+    else if ((v = valor("--ruido="))) op.ruido = atof(v);
+    else if ((v = valor("--espera="))) op.esperaMs = atoi(v);
+    else if ((v = valor("--respuesta="))) op.respuestaMs = atoi(v);
+    else if ((v = valor("--semilla="))) op.semilla = (unsigned)strtoul(v, nullptr, 10);
+    else if ((v = valor("--salida="))) op.salida = v;
+    else if ((v = valor("--host="))) op.host = v;
+    else if ((v = valor("--escaneo="))) op.escaneo = v;
+    else if ((v = valor("--adicional="))) op.adicional = atof(v);
+    else if (a == "--sin-baudios") op.limitarBaudios = false;
+    else if (a == "--sugerido") op.seguirSugerido = true;
+    else if (a == "--inventario") op.inventario = true;
+    else { fprintf(stderr, "Opcion desconocida: %s\n", a.c_str()); return false; }
+  }
+  if (op.ordenes == 0) op.ordenes = op.modulos;
+  if (op.escaneo != "doble" && op.escaneo != "combinado" && op.escaneo != "gs1") return false;
+  if (op.modulos < 1 || op.modulos > MAX_DESTINOS || op.ordenes < 1 || op.porGrupo < 1 || op.lineas == 0) return false;
+  if (op.reaccionMs < 0) op.reaccionMs = (op.modo == "banco") ? 5 : 800;
+  return op.modo == "rack" || (op.modo == "ola" && !op.salida.empty()) || (op.modo == "banco" && !op.host.empty());
+}
+
+int main(int argc, char* argv[]) {
+  Opciones op;
+  if (!leerOpciones(argc, argv, op)) {
+    fprintf(stderr, "Uso: simulador_ptl rack|ola|banco [opciones] (ver el inicio de SimuladorPTL.cpp)\n");
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  if (op.modo == "ola") {
+    std::vector<GrupoOla> grupos = generarOla(op, op.salida);
+    printf("%s: %zu lineas, %zu SKU/lote, %d OV\n", op.salida.c_str(), op.lineas, grupos.size(), op.ordenes);
+    return 0;
+  }
+  if (op.modo == "banco") return correrBanco(op);
+
+  Rack rack;
+  if (!iniciarRack(rack, op)) return 1;
+  printf("Rack de %d modulos en %s (Ctrl+C para salir)\n", numDestinos, rack.rutaEsclavo.c_str());
+  fflush(stdout);
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+    printf("Confirmaciones: %llu, faltantes: %llu\n", (unsigned long long)rack.confirmaciones, (unsigned long long)rack.faltantes);
+    fflush(stdout);
+  }
+}
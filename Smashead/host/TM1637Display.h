@@ -0,0 +1,56 @@
+// Pantalla TM1637 simulada: guarda los 4 digitos tal como los veria el operador.
+#pragma once
+#include "Arduino.h"
+
+#define SEG_A 0x01
+#define SEG_B 0x02
+#define SEG_C 0x04
+#define SEG_D 0x08
+#define SEG_E 0x10
+#define SEG_F 0x20
+#define SEG_G 0x40
+#define SEG_DP 0x80
+
+class TM1637Display {
+public:
+  int pinClk, pinDio;
+  uint8_t segmentos[4] = { 0, 0, 0, 0 };
+  uint8_t brillo = 0;
+  unsigned long escrituras = 0;
+
+  TM1637Display(uint8_t clk, uint8_t dio) : pinClk(clk), pinDio(dio) {}
+
+  void setBrightness(uint8_t b, bool encendida = true) { brillo = encendida ? b : 0; }
+
+  void setSegments(const uint8_t datos[], uint8_t largo = 4, uint8_t pos = 0) {
+    for (uint8_t i = 0; i < largo && pos + i < 4; i++) segmentos[pos + i] = datos[i];
+    escrituras++;
+  }
+
+  void clear() {
+    uint8_t vacio[4] = { 0, 0, 0, 0 };
+    setSegments(vacio);
+  }
+
+  // Alineado a la derecha y sin ceros a la izquierda, como la biblioteca original
+  void showNumberDec(int num, bool cerosIzquierda = false, uint8_t largo = 4, uint8_t pos = 0) {
+    uint8_t datos[4] = { 0, 0, 0, 0 };
+    bool negativo = num < 0;
+    unsigned int valor = negativo ? -num : num;
+    for (int i = largo - 1; i >= 0; i--) {
+      if (valor == 0 && i < largo - 1 && !cerosIzquierda) {
+        if (negativo) { datos[i] = SEG_G; negativo = false; }
+        continue;
+      }
+      datos[i] = encodeDigit(valor % 10);
+      valor /= 10;
+    }
+    setSegments(datos, largo, pos);
+  }
+
+  static uint8_t encodeDigit(uint8_t digito) {
+    static const uint8_t digitos[] = { 0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F,
+                                       0x77, 0x7C, 0x39, 0x5E, 0x79, 0x71 };
+    return digitos[digito & 0x0F];
+  }
+};
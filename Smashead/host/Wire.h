@@ -0,0 +1,51 @@
+// Bus I2C simulado. Cada direccion se comporta como un PCF8574: lee lo ultimo escrito
+// (cuasi-bidireccional) con los botones presionados en bajo. 'presionados' lo fija la
+// simulacion (bit en 1 = boton presionado) y 'lecturas' cuenta las lecturas del firmware.
+// Las direcciones 0x70-0x77 son multiplexores TCA9548A: mientras uno tenga un canal abierto,
+// las demas direcciones se resuelven en ese canal. Los arreglos se indexan por ruta:
+// 0 = bus principal, 1 + mux * 8 + canal = detras de un multiplexor.
+#pragma once
+#include "Arduino.h"
+
+struct WireSimulado {
+  static const int RUTAS = 65;
+  uint8_t salidas[RUTAS][128];
+  uint8_t presionados[RUTAS][128];
+  uint8_t registroMux[8] = {};
+  unsigned long lecturas = 0;
+  unsigned long seleccionesMux = 0;
+  int direccion = 0;
+  int lecturaPendiente = -1;
+
+  WireSimulado() { memset(salidas, 0xFF, sizeof(salidas)); memset(presionados, 0, sizeof(presionados)); }
+  static bool esMux(int dir) { return dir >= 0x70 && dir <= 0x77; }
+  int ruta() const {
+    for (int m = 0; m < 8; m++) {
+      for (int c = 0; c < 8; c++) if (registroMux[m] & (1 << c)) return 1 + m * 8 + c;
+    }
+    return 0;
+  }
+  void begin() {}
+  void setClock(unsigned long) {}
+  void beginTransmission(int dir) { direccion = dir & 0x7F; }
+  size_t write(uint8_t valor) {
+    if (esMux(direccion)) { registroMux[direccion - 0x70] = valor; seleccionesMux++; }
+    else salidas[ruta()][direccion] = valor;
+    return 1;
+  }
+  uint8_t endTransmission() { return 0; }
+  uint8_t requestFrom(int dir, int cantidad) {
+    lecturas++;
+    int r = ruta();
+    lecturaPendiente = salidas[r][dir & 0x7F] & ~presionados[r][dir & 0x7F];
+    return cantidad > 0 ? 1 : 0;
+  }
+  int available() { return lecturaPendiente >= 0; }
+  int read() {
+    int v = lecturaPendiente;
+    lecturaPendiente = -1;
+    return v;
+  }
+};
+
+inline WireSimulado Wire;